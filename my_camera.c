@@ -13,12 +13,26 @@
 #include <media/v4l2-event.h>
 #include <linux/platform_device.h>
 #include <media/videobuf2-dma-contig.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
+#include <linux/sync_file.h>
+#include <linux/file.h>
 #include <linux/of_platform.h>
 #include <linux/of_graph.h>
+#include <linux/debugfs.h>
 #include <linux/ktime.h>	// 包含 ktime_get()
+#include <linux/mm.h>		// 包含 vm_insert_page()
+#include <linux/bitmap.h>
+#include <media/media-device.h>
+#include <media/media-entity.h>
 #include "my_camera.h"
 #include "my_isp.h"
 #include "my_csi.h"
+#include "my_sensor.h"
+#include "my_trace.h"
+#include "my_stats.h"
+#include "my_pmu.h"
+#include "my_vb2_mem.h"
 
 // 定义 TAG
 #define TAG "[my_camera_drv]: "
@@ -30,54 +44,207 @@
 #define cam_err(fmt, ...) \
     pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
+// 每帧都会经过的路径只用 dynamic debug，默认不输出；出错路径限速
 #define cam_dbg(fmt, ...) \
+    pr_debug(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-// 定义图像格式
-#define FRAME_WIDTH			1280
-#define FRAME_HEIGHT		720
-#define FPS 				30
-#define BYTES_PER_PIX_YUYV	2
+#define cam_err_ratelimited(fmt, ...) \
+    pr_err_ratelimited(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
+
+struct my_camera;
+
+// 流水线各段的延迟，只统计送到用户的帧
+enum {
+	MYCAM_LAT_SENSOR_CSI,				// sensor 帧起始 -> CSI 开始写入
+	MYCAM_LAT_CSI_ISP,					// CSI 提交到 ring buffer -> ISP 取出，旁路ISP时不统计
+	MYCAM_LAT_ISP,						// ISP 取出 -> 处理完交给 video 节点，旁路ISP时不统计
+	MYCAM_LAT_ISP_VB2,					// 交给 video 节点 -> vb2_buffer_done，共享模式下每个队列各记一次
+	MYCAM_LAT_END_TO_END,				// sensor 帧起始 -> vb2_buffer_done
+	MYCAM_LAT_NUM,
+};
+
+static const char * const mycam_lat_names[MYCAM_LAT_NUM] = {
+	[MYCAM_LAT_SENSOR_CSI] 	= "sensor_to_csi",
+	[MYCAM_LAT_CSI_ISP] 	= "csi_to_isp",
+	[MYCAM_LAT_ISP] 		= "isp",
+	[MYCAM_LAT_ISP_VB2] 	= "isp_to_vb2_done",
+	[MYCAM_LAT_END_TO_END] 	= "end_to_end",
+};
+
+// 每CPU一份，各段延迟在流水线线程中无锁记录
+struct mycam_latency {
+	struct my_hist stage[MYCAM_LAT_NUM];
+};
+
+// 完成环在驱动一侧的状态，共享的一页见 my_camera.h 中的 struct mycam_ring
+struct mycam_ring_ctx {
+	struct page *page;					// 映射给用户的一页，映射也持有引用，先于映射释放也安全
+	struct mycam_ring *shm;
+	struct file *owner;					// 打开完成环的文件句柄
+	u32 cq_head;						// 驱动自己的计数，不从共享内存读回
+	u32 sq_tail;
+	DECLARE_BITMAP(user_owned, VB2_MAX_FRAME);	// 已发布给用户、还没归还的缓冲区
+	wait_queue_head_t wait;				// poll() 等待完成队列非空
+};
+
+// 一个缓冲区队列及其等待填充的缓冲区链表
+struct mycam_queue {
+	struct my_camera *mycam;
+	struct vb2_queue queue;
+	spinlock_t qlock;
+	struct list_head buf_list;
+	atomic_t credits;					// buf_list 中空闲缓冲区的个数，上游据此决定是否还要生产
+	atomic64_t dropped;					// 本队列因没有空闲缓冲区丢弃的帧数
+	struct list_head node;				// 出流期间挂在 mycam->streams 上
+	struct mycam_ring_ctx *ring;		// 完成环，未打开时为 NULL；只在未出流时持 lock 修改
+};
+
+// 共享模式下的文件句柄，各自有独立的缓冲区队列和丢帧计数
+struct mycam_client {
+	struct v4l2_fh fh;
+	struct mycam_queue q;
+	struct v4l2_ctrl_handler ctrl_handler;	// 本句柄的丢帧计数，加上设备的控制项
+	struct list_head node;				// 挂在 mycam->clients 上
+};
 
 struct my_camera {
 	struct platform_device *pdev;
 	struct v4l2_device v4l2_dev;
+	struct media_device mdev;			// 媒体设备，描述 sensor -> CSI -> [ISP] -> video 的拓扑
+	struct media_pad pad;				// video节点的输入pad
+	struct media_pipeline pipe;
 	struct v4l2_async_notifier notifier; // 异步通知链
 	struct video_device vdev;
 	struct v4l2_ctrl_handler ctrl_handler;
 	struct mutex lock;
 	v4l2_std_id std;
 	struct v4l2_dv_timings timings;
-	struct v4l2_pix_format format;
+	struct v4l2_pix_format format;				// 当前格式（单平面接口）
+	struct v4l2_pix_format_mplane format_mp;	// 当前格式（多平面接口），按此分配每个平面
+	bool multiplanar;							// 注册为多平面采集节点
 	unsigned input;
 
-	struct vb2_queue queue;
-
-	spinlock_t qlock;
-	struct list_head buf_list;
+	u32 buf_type;						// 采集队列的类型，单平面或多平面
+	bool shared;						// 共享出流模式：每个打开的文件句柄各有一个缓冲区队列
+	struct mycam_queue main;			// 独占模式下唯一的缓冲区队列
+	struct list_head clients;			// 共享模式下所有打开的文件句柄，受 lock 保护
+	struct list_head streams;			// 正在出流的缓冲区队列，流水线的每一帧都交给其中每一个
+	struct mutex streams_lock;			// 保护 streams，帧的分发过程持有
+	unsigned int stream_count;			// 正在出流的队列个数，受 lock 保护，从0变1时启动流水线
 	unsigned field;
 	unsigned sequence;
+	atomic_t sof_sequence;				// 下一个帧起始的帧序号，与CSI分配的帧序号一致，出流时清零
 
 	struct v4l2_subdev *isp_subdev;
 	struct v4l2_subdev *csi_subdev;
 	struct v4l2_subdev *sensor_subdev;
+	bool bypass_isp;					// 本次出流时 CSI 直连 video，跳过 ISP
+
+	int drop_policy;					// MYCAM_DROP_AT_*，没有空闲缓冲区时在哪一级丢帧
+	atomic64_t dropped_source;			// 因没有空闲缓冲区在 CSI/ISP 丢弃的帧数
+	atomic64_t dropped_sink;			// 生产完才发现没有空闲缓冲区而丢弃的帧数
+	u32 frame_divider;					// 每 frame_divider 个到达的帧交一个给用户
+	u32 divider_skip;					// 旁路ISP时的抽帧倒数，出流时清零，只在CSI线程的回调中访问
+
+	struct mycam_latency __percpu *latency;	// 各段延迟直方图
+	struct {
+		u64 qbuf;						// 成功的 QBUF 次数，受 lock 保护
+		u64 dqbuf;						// 成功的 DQBUF 次数，受 lock 保护
+		u64 buffers_done;				// 写入一帧并交还给vb2的缓冲区个数，受 streams_lock 保护
+		u64 buffer_errors;				// 因缓冲区无效以 ERROR 状态交还的个数，受 streams_lock 保护
+		u64 frame_sync;					// 发出的 FRAME_SYNC 事件个数，只在帧起始通知中更新
+		u64 ring_returned;				// 从完成环的提交队列取回的缓冲区个数，受 streams_lock 保护
+		u64 ring_invalid;				// 提交队列中编号无效或重复归还而忽略的项，受 streams_lock 保护
+		atomic64_t cache_syncs;			// 可缓存缓冲区做的 cache 维护次数（每个缓冲区一次）
+		atomic64_t cache_sync_skipped;	// 因 NO_CACHE_* 标志跳过的 cache 维护次数
+	} stats;
+	struct my_pmu_stage pmu_copy;		// 把一帧拷贝进 vb2 缓冲区的 PMU 计数，受 streams_lock 保护
+	struct dentry *debugfs_dir;			// /sys/kernel/debug/my_camera/video<N>
+};
+
+// 自定义控制项ID，与 sensor 的 V4L2_CID_BASE + 0x1010 错开
+#define MYCAM_CID_DROP_POLICY		(V4L2_CID_BASE + 0x1020)
+#define MYCAM_CID_DROPPED_SOURCE	(V4L2_CID_BASE + 0x1021)
+#define MYCAM_CID_DROPPED_SINK		(V4L2_CID_BASE + 0x1022)
+#define MYCAM_CID_FRAME_DIVIDER		(V4L2_CID_BASE + 0x1023)
+#define MYCAM_CID_CLIENT_DROPPED	(V4L2_CID_BASE + 0x1024)
+
+// 每个句柄最多积压的 FRAME_SYNC 事件个数，来不及取走时丢弃最旧的
+#define MYCAM_FRAME_SYNC_EVENTS		8
+
+enum {
+	MYCAM_DROP_AT_SINK,					// 各级照常生产，到 video 节点才丢弃
+	MYCAM_DROP_AT_SOURCE,				// 没有空闲缓冲区时 CSI 不生成、ISP 不处理
 };
 
 struct mycam_buffer {
 	struct vb2_v4l2_buffer vb;
 	struct list_head list;
+	struct dma_fence *out_fence;		// QBUF 时创建的输出 fence，交还缓冲区时发出信号
+	u32 cache_hints;					// 最近一次 QBUF 带的 V4L2_BUF_FLAG_NO_CACHE_INVALIDATE/CLEAN，buffer_prepare 时记下
+};
+
+// 输出 fence，锁放在 fence 自己里面：消费者手里的 fence 可能比缓冲区队列活得更久
+struct mycam_fence {
+	struct dma_fence base;
+	spinlock_t lock;
 };
 
-// 全局变量
-static struct my_camera *g_mycam = NULL;
+// 以多平面接口（V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE）注册视频节点，NV12M 的Y和UV分别放在独立的平面中
+static bool multiplanar = false;
+module_param(multiplanar, bool, 0444);
+MODULE_PARM_DESC(multiplanar, "Register the video node as VIDEO_CAPTURE_MPLANE (default: false)");
+
+// 共享出流：多个进程同时打开同一个节点，各自申请缓冲区、各自出流，共用一条流水线
+static bool shared_stream = false;
+module_param(shared_stream, bool, 0444);
+MODULE_PARM_DESC(shared_stream, "Give every open file handle its own buffer queue fed from one pipeline (default: false)");
+// 大页缓冲区：MMAP 按 2MB 的物理连续块分配，可缓存，用户映射仍是 4KB 页；要大页 TLB 覆盖时用 USERPTR 交入用户的 hugetlb 内存
+// 大页缓冲区：按 2MB 的物理连续块分配，可缓存；用户映射仍是 4KB 页
+static bool hugepage_buffers = false;
+module_param(hugepage_buffers, bool, 0444);
+MODULE_PARM_DESC(hugepage_buffers, "Allocate cacheable capture buffers in 2MB physically contiguous chunks, accept USERPTR hugetlb memory (default: false)");
+
+// 可缓存缓冲区：用户映射可缓存，CPU 逐像素读写快得多，驱动在 QBUF/DQBUF 时做 cache 维护
+static bool cached_buffers = false;
+module_param(cached_buffers, bool, 0444);
+MODULE_PARM_DESC(cached_buffers, "Allocate cacheable capture buffers, synced at QBUF/DQBUF (default: false)");
+
 
-extern void my_csi_register_dma_cb(void *cb);
-extern void my_isp_register_dma_cb(void *cb);
+static struct dentry *mycam_debugfs_root = NULL;
 
 static inline struct mycam_buffer *to_mycam_buffer(struct vb2_v4l2_buffer *vbuf)
 {
 	return container_of(vbuf, struct mycam_buffer, vb);
 }
 
+// 文件句柄对应的缓冲区队列，独占模式下所有句柄共用 main，由vb2按 owner 仲裁
+static struct mycam_queue *mycam_file_queue(struct file *file)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	if (mycam->shared)
+		return &container_of(file->private_data, struct mycam_client, fh)->q;
+
+	return &mycam->main;
+}
+
+// 是否有任何一个队列已经申请了缓冲区，此时不能修改格式和链路
+static bool mycam_queues_busy(struct my_camera *mycam)
+{
+	struct mycam_client *client;
+
+	if (!mycam->shared)
+		return vb2_is_busy(&mycam->main.queue);
+
+	list_for_each_entry(client, &mycam->clients, node) {
+		if (vb2_is_busy(&client->q.queue))
+			return true;
+	}
+
+	return false;
+}
+
 // v4l2_ioctl_ops 的回调函数实现
 static int mycam_querycap(struct file *file, void *priv,
 			     struct v4l2_capability *cap)
@@ -96,66 +263,401 @@ static int mycam_querycap(struct file *file, void *priv,
 	return 0;
 }
 
-static void mycam_fill_pix_format(struct my_camera *mycam,
-				     struct v4l2_pix_format *pix)
+// 查找请求的像素格式，不支持的换成YUYV；多内存平面的格式只能通过多平面接口使用
+static const struct my_fmt_info *mycam_find_format(struct my_camera *mycam, u32 fourcc)
 {
-	pix->pixelformat  = V4L2_PIX_FMT_YUYV;
-	pix->width        = FRAME_WIDTH;
-	pix->height       = FRAME_HEIGHT;
-	pix->field        = V4L2_FIELD_NONE;
-	pix->colorspace   = V4L2_COLORSPACE_SRGB;
-	
-	/*
-	 * The YUYV format is four bytes for every two pixels, so bytesperline
-	 * is width * 2.
-	 */
-	pix->bytesperline = pix->width * BYTES_PER_PIX_YUYV;
-	pix->sizeimage    = pix->bytesperline * pix->height;
-	pix->priv         = 0;
+	const struct my_fmt_info *info = my_fmt_by_fourcc(fourcc);
+
+	if (!info || (info->mem_planes > 1 && !mycam->multiplanar))
+		return &my_formats[0];
+
+	return info;
+}
+
+// 分辨率限幅并对齐
+static void mycam_adjust_size(const struct my_fmt_info *info, u32 *width, u32 *height)
+{
+	struct v4l2_mbus_framefmt mf = {
+		.width  = *width,
+		.height = *height,
+		.code   = info->code,
+	};
+
+	my_adjust_mbus_format(&mf);
+	*width  = mf.width;
+	*height = mf.height;
 }
 
 // 视频格式相关
 static int mycam_try_fmt_vid_cap(struct file *file, void *priv,
 				    struct v4l2_format *f)
 {
-	cam_info("width=%u, height=%u, format=%#x\n",
-            f->fmt.pix.width, f->fmt.pix.height, f->fmt.pix.pixelformat);
+	struct my_camera *mycam = video_drvdata(file);
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+	const struct my_fmt_info *info;
+	u32 width = pix->width, height = pix->height;
+
+	cam_info("width=%u, height=%u, format=%#x\n", pix->width, pix->height, pix->pixelformat);
+
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
+
+	info = mycam_find_format(mycam, pix->pixelformat);
+	mycam_adjust_size(info, &width, &height);
+	my_fill_pix_format(info, width, height, pix);
 			
 	return 0;
 }
 
+static int mycam_try_fmt_vid_cap_mplane(struct file *file, void *priv,
+					   struct v4l2_format *f)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct v4l2_pix_format_mplane *pix_mp = &f->fmt.pix_mp;
+	const struct my_fmt_info *info;
+	u32 width = pix_mp->width, height = pix_mp->height;
+
+	cam_info("width=%u, height=%u, format=%#x\n", pix_mp->width, pix_mp->height, pix_mp->pixelformat);
+
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
+
+	info = mycam_find_format(mycam, pix_mp->pixelformat);
+	mycam_adjust_size(info, &width, &height);
+	my_fill_pix_format_mplane(info, width, height, pix_mp);
+
+	return 0;
+}
+
+// 设置子设备某个pad的格式，返回子设备实际采用的格式
+static int mycam_subdev_set_fmt(struct v4l2_subdev *sd, unsigned int pad,
+								struct v4l2_mbus_framefmt *mf)
+{
+	struct v4l2_subdev_format sd_fmt = {
+		.which  = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad    = pad,
+		.format = *mf,
+	};
+	int ret;
+
+	ret = v4l2_subdev_call(sd, pad, set_fmt, NULL, &sd_fmt);
+	if (ret) {
+		cam_err("Failed to set format on %s:%u, ret=%d\n", sd->name, pad, ret);
+		return ret;
+	}
+
+	*mf = sd_fmt.format;
+
+	return 0;
+}
+
+// 读取子设备某个pad的当前格式
+static int mycam_subdev_get_fmt(struct v4l2_subdev *sd, unsigned int pad,
+								struct v4l2_mbus_framefmt *mf)
+{
+	struct v4l2_subdev_format sd_fmt = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad   = pad,
+	};
+	int ret;
+
+	ret = v4l2_subdev_call(sd, pad, get_fmt, NULL, &sd_fmt);
+	if (ret) {
+		cam_err("Failed to get format on %s:%u, ret=%d\n", sd->name, pad, ret);
+		return ret;
+	}
+
+	*mf = sd_fmt.format;
+
+	return 0;
+}
+
+/*
+ * 将格式沿链路逐级下发：sensor:0 -> CSI:0，CSI:1 -> ISP:0，最终以ISP:1的输出格式为准。
+ * 每一级都可能调整分辨率，下一级使用上一级输出pad的实际格式，各级按此分配缓冲区。
+ */
+static int mycam_propagate_format(struct my_camera *mycam, const struct my_fmt_info *info,
+								  u32 *width, u32 *height)
+{
+	struct v4l2_mbus_framefmt mf = {
+		.width  = *width,
+		.height = *height,
+		.code   = info->code,
+	};
+	int ret;
+
+	if (!mycam->sensor_subdev || !mycam->csi_subdev || !mycam->isp_subdev)
+		return -ENODEV;
+
+	ret = mycam_subdev_set_fmt(mycam->sensor_subdev, 0, &mf);
+	if (ret)
+		return ret;
+
+	ret = mycam_subdev_set_fmt(mycam->csi_subdev, CSI_PAD_SINK, &mf);
+	if (ret)
+		return ret;
+
+	ret = mycam_subdev_get_fmt(mycam->csi_subdev, CSI_PAD_SOURCE, &mf);
+	if (ret)
+		return ret;
+
+	ret = mycam_subdev_set_fmt(mycam->isp_subdev, ISP_PAD_SINK, &mf);
+	if (ret)
+		return ret;
+
+	ret = mycam_subdev_get_fmt(mycam->isp_subdev, ISP_PAD_SOURCE, &mf);
+	if (ret)
+		return ret;
+
+	// 总线格式相同的像素格式只是内存布局不同，保留请求的像素格式
+	if (mf.code != info->code) {
+		cam_err("ISP output code %#x differs from requested %#x\n", mf.code, info->code);
+		return -EPIPE;
+	}
+
+	*width  = mf.width;
+	*height = mf.height;
+
+	return 0;
+}
+
+// 保存协商后的格式，单平面和多平面两种描述同时更新
+static void mycam_apply_format(struct my_camera *mycam, const struct my_fmt_info *info,
+							   u32 width, u32 height)
+{
+	my_fill_pix_format(info, width, height, &mycam->format);
+	my_fill_pix_format_mplane(info, width, height, &mycam->format_mp);
+}
+
+static int mycam_s_fmt(struct my_camera *mycam, u32 fourcc, u32 width, u32 height)
+{
+	const struct my_fmt_info *info = mycam_find_format(mycam, fourcc);
+	int ret;
+
+	mycam_adjust_size(info, &width, &height);
+
+	// 已经分配了缓冲区就不能再修改格式；共享模式下其他句柄设置相同的格式是允许的
+	if (mycam_queues_busy(mycam)) {
+		if (info->fourcc == mycam->format.pixelformat &&
+			width == mycam->format.width && height == mycam->format.height)
+			return 0;
+		return -EBUSY;
+	}
+
+	ret = mycam_propagate_format(mycam, info, &width, &height);
+	if (ret)
+		return ret;
+
+	mycam_apply_format(mycam, info, width, height);
+
+	return 0;
+}
+
 static int mycam_s_fmt_vid_cap(struct file *file, void *priv,
 				  struct v4l2_format *f)
 {
-	cam_info("width=%u, height=%u, format=%#x\n",
-            f->fmt.pix.width, f->fmt.pix.height, f->fmt.pix.pixelformat);
+	struct my_camera *mycam = video_drvdata(file);
+	int ret;
+
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
 
-	// 忽略用户设置
+	ret = mycam_s_fmt(mycam, f->fmt.pix.pixelformat, f->fmt.pix.width, f->fmt.pix.height);
+	if (ret)
+		return ret;
+
+	f->fmt.pix = mycam->format;
 			
 	return 0;
 }
 
+static int mycam_s_fmt_vid_cap_mplane(struct file *file, void *priv,
+					 struct v4l2_format *f)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	int ret;
+
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
+
+	ret = mycam_s_fmt(mycam, f->fmt.pix_mp.pixelformat, f->fmt.pix_mp.width, f->fmt.pix_mp.height);
+	if (ret)
+		return ret;
+
+	f->fmt.pix_mp = mycam->format_mp;
+
+	return 0;
+}
+
 static int mycam_g_fmt_vid_cap(struct file *file, void *priv,
 				  struct v4l2_format *f)
 {
 	struct my_camera *mycam = video_drvdata(file);
 
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
+
 	f->fmt.pix = mycam->format;
 
 	return 0;
 }
 
+static int mycam_g_fmt_vid_cap_mplane(struct file *file, void *priv,
+					 struct v4l2_format *f)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	if (f->type != mycam->buf_type)
+		return -EINVAL;
+
+	f->fmt.pix_mp = mycam->format_mp;
+
+	return 0;
+}
+
 static int mycam_enum_fmt_vid_cap(struct file *file, void *priv,
 				     struct v4l2_fmtdesc *f)
 {
+	struct my_camera *mycam = video_drvdata(file);
+	u32 index = f->index;
+	int i;
+
 	//cam_info("Called by %s\n", current->comm); // 打印调用进程的名字
 	cam_info("\n");
-	
-	if (f->index != 0)
+
+	if (f->type != mycam->buf_type)
 		return -EINVAL;
 
-	f->pixelformat = V4L2_PIX_FMT_YUYV;
+	// 单平面接口不列出多内存平面的格式
+	for (i = 0; i < ARRAY_SIZE(my_formats); i++) {
+		if (my_formats[i].mem_planes > 1 && !mycam->multiplanar)
+			continue;
+		if (index-- == 0) {
+			f->pixelformat = my_formats[i].fourcc;
+			return 0;
+		}
+	}
 	
+	return -EINVAL;
+}
+
+static int mycam_enum_framesizes(struct file *file, void *priv, struct v4l2_frmsizeenum *fsize)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	const struct my_fmt_info *info = my_fmt_by_fourcc(fsize->pixel_format);
+	struct v4l2_subdev_frame_size_enum fse = {
+		.index = fsize->index,
+		.pad   = 0,
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+	};
+	int ret;
+
+	if (!info)
+		return -EINVAL;
+
+	if (!mycam->sensor_subdev)
+		return -ENODEV;
+
+	fse.code = info->code;
+	ret = v4l2_subdev_call(mycam->sensor_subdev, pad, enum_frame_size, NULL, &fse);
+	if (ret)
+		return ret;
+
+	// sensor的分辨率连续可调，按对齐要求给出步进
+	fsize->type                 = V4L2_FRMSIZE_TYPE_STEPWISE;
+	fsize->stepwise.min_width   = fse.min_width;
+	fsize->stepwise.max_width   = fse.max_width;
+	fsize->stepwise.step_width  = 1 << WIDTH_ALIGN;
+	fsize->stepwise.min_height  = fse.min_height;
+	fsize->stepwise.max_height  = fse.max_height;
+	fsize->stepwise.step_height = 1 << HEIGHT_ALIGN;
+
+	return 0;
+}
+
+// 帧率相关，实际由sensor子设备决定
+static int mycam_g_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct v4l2_subdev_frame_interval fi = { 0 };
+	int ret;
+
+	if (parm->type != mycam->buf_type)
+		return -EINVAL;
+
+	if (!mycam->sensor_subdev)
+		return -ENODEV;
+
+	ret = v4l2_subdev_call(mycam->sensor_subdev, video, g_frame_interval, &fi);
+	if (ret)
+		return ret;
+
+	memset(&parm->parm.capture, 0, sizeof(parm->parm.capture));
+	parm->parm.capture.capability   = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.timeperframe = fi.interval;
+	parm->parm.capture.readbuffers  = 4;
+
+	return 0;
+}
+
+static int mycam_s_parm(struct file *file, void *priv, struct v4l2_streamparm *parm)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct v4l2_subdev_frame_interval fi = { 0 };
+	int ret;
+
+	cam_info("timeperframe=%u/%u\n", parm->parm.capture.timeperframe.numerator,
+			 parm->parm.capture.timeperframe.denominator);
+
+	if (parm->type != mycam->buf_type)
+		return -EINVAL;
+
+	if (!mycam->sensor_subdev)
+		return -ENODEV;
+
+	// 出流时不允许修改帧率
+	if (mycam->stream_count)
+		return -EBUSY;
+
+	fi.interval = parm->parm.capture.timeperframe;
+	ret = v4l2_subdev_call(mycam->sensor_subdev, video, s_frame_interval, &fi);
+	if (ret)
+		return ret;
+
+	// 返回sensor实际采用的帧率
+	memset(&parm->parm.capture, 0, sizeof(parm->parm.capture));
+	parm->parm.capture.capability   = V4L2_CAP_TIMEPERFRAME;
+	parm->parm.capture.timeperframe = fi.interval;
+	parm->parm.capture.readbuffers  = 4;
+
+	return 0;
+}
+
+static int mycam_enum_frameintervals(struct file *file, void *priv, struct v4l2_frmivalenum *fival)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct v4l2_subdev_frame_interval_enum fie = {
+		.index 	= fival->index,
+		.pad 	= 0,
+		.width 	= fival->width,
+		.height = fival->height,
+		.which 	= V4L2_SUBDEV_FORMAT_ACTIVE,
+	};
+	int ret;
+
+	if (!my_fmt_by_fourcc(fival->pixel_format))
+		return -EINVAL;
+
+	if (!mycam->sensor_subdev)
+		return -ENODEV;
+
+	ret = v4l2_subdev_call(mycam->sensor_subdev, pad, enum_frame_interval, NULL, &fie);
+	if (ret)
+		return ret;
+
+	fival->type     = V4L2_FRMIVAL_TYPE_DISCRETE;
+	fival->discrete = fie.interval;
+
 	return 0;
 }
 
@@ -242,120 +744,493 @@ static int mycam_g_input(struct file *file, void *priv, unsigned int *i)
 	return 0;
 }
 
+/*
+ * 缓冲区相关的 ioctl。独占模式下直接使用 vb2_ioctl_*，由 vb2 保证只有一个句柄拥有队列；
+ * 共享模式下每个句柄操作自己的队列，不存在 owner 的概念。
+ */
 static int mycam_vb2_ioctl_reqbufs(struct file *file, void *fh, struct v4l2_requestbuffers *req)
 {
+	struct my_camera *mycam = video_drvdata(file);
+
     cam_info("type=%u, memory=%u, count=%u\n", req->type, req->memory, req->count);
 
-    if (req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    if (req->type != mycam->buf_type)
         return -EINVAL;
 
-    if (req->memory != V4L2_MEMORY_MMAP)
-        return -EINVAL;
+    /*
+     * 内存类型由 io_modes 决定，vb2 会拒绝队列不支持的类型：dma-contig 支持 MMAP 和 DMABUF 导入，
+     * USERPTR 不开放（要求用户内存物理连续，且没有内核映射，模拟DMA的memcpy无法写入）；
+     * my_vb2_mem 支持 MMAP 和 USERPTR，USERPTR 的页由它 vmap 给生产者。
+     */
+
+    if (mycam->shared)
+        return vb2_reqbufs(&mycam_file_queue(file)->queue, req);
 
     return vb2_ioctl_reqbufs(file, fh, req);
 }
 
+static int mycam_vb2_ioctl_create_bufs(struct file *file, void *fh, struct v4l2_create_buffers *p)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	if (mycam->shared)
+		return vb2_create_bufs(&mycam_file_queue(file)->queue, p);
+
+	return vb2_ioctl_create_bufs(file, fh, p);
+}
+
 static int mycam_vb2_ioctl_querybuf(struct file *file, void *fh, struct v4l2_buffer *p)
 {
+	struct my_camera *mycam = video_drvdata(file);
+
     cam_info("index=%u, type=%u, memory=%u\n", p->index, p->type, p->memory);
 
-    if (p->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    // memory 由vb2按队列当前的内存类型填写，这里不检查
+    if (p->type != mycam->buf_type)
         return -EINVAL;
 
-    if (p->memory != V4L2_MEMORY_MMAP)
-        return -EINVAL;
+    if (mycam->shared)
+        return vb2_querybuf(&mycam_file_queue(file)->queue, p);
 
     return vb2_ioctl_querybuf(file, fh, p);
 }
 
+static const char *mycam_fence_get_driver_name(struct dma_fence *fence)
+{
+	return "my_camera";
+}
+
+static const char *mycam_fence_get_timeline_name(struct dma_fence *fence)
+{
+	return "capture";
+}
+
+static const struct dma_fence_ops mycam_fence_ops = {
+	.get_driver_name	= mycam_fence_get_driver_name,
+	.get_timeline_name	= mycam_fence_get_timeline_name,
+};
+
+// 缓冲区交还后通知等在输出 fence 上的消费者，err 非0表示这一帧没有有效数据；没有 fence 时什么都不做
+static void mycam_buffer_signal_fence(struct mycam_buffer *buf, int err)
+{
+	struct dma_fence *fence = xchg(&buf->out_fence, NULL);
+
+	if (!fence)
+		return;
+
+	if (err)
+		dma_fence_set_error(fence, err);
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+}
+
+/*
+ * 给要入队的缓冲区挂上输出 fence 并创建对应的 sync_file。必须在 vb2_qbuf 之前挂上：
+ * 出流期间缓冲区一入队就可能被流水线写完，等 vb2_qbuf 返回再挂会错过信号。
+ */
+static int mycam_out_fence_create(struct mycam_queue *mq, const struct v4l2_buffer *p,
+								  struct mycam_buffer **pbuf, struct sync_file **psync)
+{
+	struct vb2_queue *q = &mq->queue;
+	struct mycam_buffer *buf;
+	struct mycam_fence *f;
+	struct vb2_buffer *vb;
+
+	if (p->type != q->type || p->index >= q->num_buffers || mq->ring)
+		return -EINVAL;
+
+	// 只有在用户手里的缓冲区才能入队，这样的缓冲区上不会还挂着 fence
+	vb = q->bufs[p->index];
+	if (vb->state != VB2_BUF_STATE_DEQUEUED)
+		return -EINVAL;
+	buf = to_mycam_buffer(to_vb2_v4l2_buffer(vb));
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+
+	/*
+	 * 每个 fence 单独一个 context：缓冲区交还的顺序和入队顺序不一定相同（入队失败、出错的帧），
+	 * 同一个 context 上的 fence 必须按 seqno 顺序发信号，否则 dma_fence_is_later 之类的比较会出错。
+	 */
+	spin_lock_init(&f->lock);
+	dma_fence_init(&f->base, &mycam_fence_ops, &f->lock, dma_fence_context_alloc(1), 1);
+
+	// sync_file 持有自己的引用，初始引用归缓冲区
+	*psync = sync_file_create(&f->base);
+	if (!*psync) {
+		dma_fence_put(&f->base);
+		return -ENOMEM;
+	}
+
+	buf->out_fence = &f->base;
+	*pbuf = buf;
+
+	return 0;
+}
+
+// my_vb2_mem 的缓冲区（分配的或交入的用户内存）是可缓存的，vb2 不替它们做 cache 维护；dma-contig 和导入的 dmabuf 不需要驱动管
+static bool mycam_buffer_cached(struct vb2_buffer *vb)
+{
+	return vb->memory != VB2_MEMORY_DMABUF && vb->vb2_queue->mem_ops != &vb2_dma_contig_memops;
+}
+
+/*
+ * 可缓存缓冲区的 cache 维护。for_cpu 时作废 cache 中的旧数据，用户读到的是刚写入的一帧（DQBUF、发布到完成环）；
+ * 否则把用户写过的脏数据写回内存，免得之后被逐出时盖掉新写入的内容（QBUF、从完成环归还）。
+ * 用户用 V4L2_BUF_FLAG_NO_CACHE_INVALIDATE/NO_CACHE_CLEAN 声明不需要时跳过，例如只把缓冲区交给其他硬件、从不用CPU访问。
+ */
+static void mycam_buffer_sync(struct my_camera *mycam, struct mycam_buffer *buf, bool for_cpu)
+{
+	struct vb2_buffer *vb = &buf->vb.vb2_buf;
+	unsigned int p;
+
+	if (!mycam_buffer_cached(vb))
+		return;
+
+	if (buf->cache_hints & (for_cpu ? V4L2_BUF_FLAG_NO_CACHE_INVALIDATE : V4L2_BUF_FLAG_NO_CACHE_CLEAN)) {
+		atomic64_inc(&mycam->stats.cache_sync_skipped);
+		return;
+	}
+
+	for (p = 0; p < vb->num_planes; p++) {
+		if (for_cpu)
+			my_vb2_mem_sync_for_cpu(vb->planes[p].mem_priv);
+		else
+			my_vb2_mem_sync_for_device(vb->planes[p].mem_priv);
+	}
+	atomic64_inc(&mycam->stats.cache_syncs);
+}
+
 static int mycam_vb2_ioctl_qbuf(struct file *file, void *fh, struct v4l2_buffer *p)
 {
-	cam_info("index=%u\n", p->index);
-	
-	return vb2_ioctl_qbuf(file, fh, p);
+	struct my_camera *mycam = video_drvdata(file);
+	bool out_fence = p->flags & MYCAM_BUF_FLAG_OUT_FENCE;
+	struct sync_file *sync_file = NULL;
+	struct mycam_buffer *buf = NULL;
+	int fence_fd = -1;
+	int ret;
+
+	cam_dbg("index=%u\n", p->index);
+
+	if (out_fence) {
+		fence_fd = get_unused_fd_flags(O_CLOEXEC);
+		if (fence_fd < 0)
+			return fence_fd;
+
+		ret = mycam_out_fence_create(mycam_file_queue(file), p, &buf, &sync_file);
+		if (ret) {
+			put_unused_fd(fence_fd);
+			return ret;
+		}
+	}
+
+	if (mycam->shared)
+		ret = vb2_qbuf(&mycam_file_queue(file)->queue, mycam->v4l2_dev.mdev, p);
+	else
+		ret = vb2_ioctl_qbuf(file, fh, p);
+
+	if (out_fence) {
+		if (ret) {
+			// 没能入队，fence 带错误状态结束，不会交给用户
+			mycam_buffer_signal_fence(buf, -ECANCELED);
+			fput(sync_file->file);
+			put_unused_fd(fence_fd);
+		} else {
+			// buffer_prepare 已经从 vbuf->flags 中清掉这个标志，回填的 v4l2_buffer 里没有，只在本次 QBUF 的返回中带上
+			fd_install(fence_fd, sync_file->file);
+			p->flags |= MYCAM_BUF_FLAG_OUT_FENCE;
+			p->reserved2 = fence_fd;
+		}
+	}
+
+	if (!ret) {
+		mycam->stats.qbuf++;
+		trace_my_vb2_qbuf(mycam->vdev.num, p->index);
+	}
+
+	return ret;
 }
 
 static int mycam_vb2_ioctl_dqbuf(struct file *file, void *fh, struct v4l2_buffer *p)
 {
+	struct my_camera *mycam = video_drvdata(file);
 	int ret = 0;
-		
-	ret = vb2_ioctl_dqbuf(file, fh, p);
 
-	cam_info("index=%u\n", p->index);
+	if (mycam->shared)
+		ret = vb2_dqbuf(&mycam_file_queue(file)->queue, p, file->f_flags & O_NONBLOCK);
+	else
+		ret = vb2_ioctl_dqbuf(file, fh, p);
+
+	if (!ret) {
+		mycam->stats.dqbuf++;
+		trace_my_vb2_dqbuf(mycam->vdev.num, p->sequence, p->index);
+	}
+
+	cam_dbg("index=%u\n", p->index);
 
 	return ret;
 }
 
+static int mycam_vb2_ioctl_expbuf(struct file *file, void *fh, struct v4l2_exportbuffer *p)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	if (mycam->shared)
+		return vb2_expbuf(&mycam_file_queue(file)->queue, p);
+
+	return vb2_ioctl_expbuf(file, fh, p);
+}
+
 static int mycam_vb2_ioctl_streamon(struct file *file, void *fh, enum v4l2_buf_type i)
 {
+	struct my_camera *mycam = video_drvdata(file);
+
 	cam_info("\n");
 
+	if (mycam->shared)
+		return vb2_streamon(&mycam_file_queue(file)->queue, i);
+
 	return vb2_ioctl_streamon(file, fh, i);
 }
 
 static int mycam_vb2_ioctl_streamoff(struct file *file, void *fh, enum v4l2_buf_type i)
 {
+	struct my_camera *mycam = video_drvdata(file);
+
 	cam_info("\n");
 
+	if (mycam->shared)
+		return vb2_streamoff(&mycam_file_queue(file)->queue, i);
+
 	return vb2_ioctl_streamoff(file, fh, i);
 }
 
-static void mycam_simulate_dma_transfer(u8 *fbuffer, int len)
+static inline void mycam_latency_record(struct my_camera *mycam, int stage, ktime_t from, ktime_t to)
+{
+	my_hist_pcpu_record(&mycam->latency->stage[stage], ktime_to_ns(ktime_sub(to, from)));
+}
+
+// 出流前清零两个队列，上一次出流发布出去的缓冲区在停流时都已交还给vb2
+static void mycam_ring_reset(struct mycam_ring_ctx *ring)
+{
+	memset(ring->shm, 0, sizeof(*ring->shm));
+	ring->cq_head = 0;
+	ring->sq_tail = 0;
+	bitmap_zero(ring->user_owned, VB2_MAX_FRAME);
+}
+
+/*
+ * 取回用户通过提交队列归还的缓冲区，重新挂到空闲链表。不需要用户发系统调用，
+ * 在分发一帧和判断有没有空闲缓冲区时顺带完成；调用者持有 streams_lock。
+ */
+static void mycam_ring_reap(struct my_camera *mycam, struct mycam_queue *mq)
+{
+	struct mycam_ring_ctx *ring = mq->ring;
+	struct vb2_queue *q = &mq->queue;
+	struct mycam_buffer *buf;
+	unsigned long flags;
+	u32 head, index;
+
+	head = smp_load_acquire(&ring->shm->sq_head);
+	if (head == ring->sq_tail)
+		return;
+	// 一次不可能归还超过队列长度的项，说明计数被写坏了，不再信任
+	if (head - ring->sq_tail > MYCAM_RING_ENTRIES) {
+		cam_err_ratelimited("Invalid sq_head %u, sq_tail %u\n", head, ring->sq_tail);
+		return;
+	}
+
+	for (; ring->sq_tail != head; ring->sq_tail++) {
+		index = READ_ONCE(ring->shm->sqes[ring->sq_tail % MYCAM_RING_ENTRIES]);
+
+		// 只接受发布出去还没归还的缓冲区，越界或重复归还的忽略
+		if (index >= q->num_buffers || !test_and_clear_bit(index, ring->user_owned)) {
+			mycam->stats.ring_invalid++;
+			continue;
+		}
+
+		// 相当于 QBUF 时的写回，整帧的 cache 维护放在锁外，不关着中断做
+		buf = to_mycam_buffer(to_vb2_v4l2_buffer(q->bufs[index]));
+		mycam_buffer_sync(mycam, buf, false);
+
+		spin_lock_irqsave(&mq->qlock, flags);
+		list_add_tail(&buf->list, &mq->buf_list);
+		atomic_inc(&mq->credits);
+		spin_unlock_irqrestore(&mq->qlock, flags);
+		mycam->stats.ring_returned++;
+		trace_my_vb2_qbuf(mycam->vdev.num, index);
+	}
+
+	smp_store_release(&ring->shm->sq_tail, ring->sq_tail);
+}
+
+// 把处理完的缓冲区发布到完成队列，之后归用户所有，直到从提交队列归还；调用者持有 streams_lock
+static void mycam_ring_complete(struct my_camera *mycam, struct mycam_queue *mq, struct mycam_buffer *buf,
+								u32 bytesused, u32 flags)
+{
+	struct mycam_ring_ctx *ring = mq->ring;
+	struct vb2_buffer *vb = &buf->vb.vb2_buf;
+	struct mycam_ring_cqe *cqe;
+	unsigned long irqflags;
+
+	// 用户不推进 cq_tail 时完成队列会满，缓冲区放回空闲链表，本帧算作在 video 节点丢弃
+	if (ring->cq_head - smp_load_acquire(&ring->shm->cq_tail) >= MYCAM_RING_ENTRIES) {
+		spin_lock_irqsave(&mq->qlock, irqflags);
+		list_add_tail(&buf->list, &mq->buf_list);
+		atomic_inc(&mq->credits);
+		spin_unlock_irqrestore(&mq->qlock, irqflags);
+		atomic64_inc(&mq->dropped);
+		atomic64_inc(&mycam->dropped_sink);
+		return;
+	}
+
+	// 相当于 DQBUF 时的作废，用户从完成队列拿到缓冲区后直接读
+	if (!(flags & MYCAM_RING_F_ERROR))
+		mycam_buffer_sync(mycam, buf, true);
 
+	cqe = &ring->shm->cqes[ring->cq_head % MYCAM_RING_ENTRIES];
+	cqe->index        = vb->index;
+	cqe->sequence     = buf->vb.sequence;
+	cqe->timestamp_ns = vb->timestamp;
+	cqe->bytesused    = bytesused;
+	cqe->flags        = flags;
+	set_bit(vb->index, ring->user_owned);
+
+	// 表项先于计数可见
+	smp_store_release(&ring->shm->cq_head, ++ring->cq_head);
+	wake_up_interruptible(&ring->wait);
+
+	mycam_buffer_signal_fence(buf, flags & MYCAM_RING_F_ERROR ? -EIO : 0);
+}
+
+// 把一帧写入一个队列的下一个空闲缓冲区
+static void mycam_deliver_frame(struct my_camera *mycam, struct mycam_queue *mq, struct my_frame *frame)
 {
 	struct vb2_buffer *vb = NULL;
 	struct mycam_buffer *buf = NULL;
 	unsigned long flags;
 	void *vaddr = NULL;
-	ktime_t start_time, end_time;
-	s64 diff_ns;
+	struct dma_buf *dbuf;
+	size_t offset = 0;
+	unsigned int p;
+	ktime_t done_ts;
+	struct my_pmu_snap snap;
+	bool pmu = my_pmu_enabled();
 
-	// 记录函数开始时间
-    start_time = ktime_get();
+	if (mq->ring)
+		mycam_ring_reap(mycam, mq);
 
 	// 加锁，防止并发操作
-	spin_lock_irqsave(&g_mycam->qlock, flags);
-
-	// 检查链表是否为空
-    if (list_empty(&g_mycam->buf_list)) {
-        cam_err("Buffer list is empty, no available buffer to pop\n");
-        goto release_lock;
+	spin_lock_irqsave(&mq->qlock, flags);
+
+	// 检查链表是否为空，为空说明用户态没有及时归还缓冲区，这一帧只能丢弃
+    if (list_empty(&mq->buf_list)) {
+        spin_unlock_irqrestore(&mq->qlock, flags);
+        atomic64_inc(&mq->dropped);
+        atomic64_inc(&mycam->dropped_sink);
+        cam_dbg("Buffer list is empty, drop frame %u\n", frame->sequence);
+        return;
     }
 
 	// 获取链表中的第一个缓冲区节点
-	buf = list_first_entry(&g_mycam->buf_list, struct mycam_buffer, list);
-	if (!buf) {
-        cam_err("Failed to retrieve buffer from list\n");
-        goto release_lock;
-    }
+	buf = list_first_entry(&mq->buf_list, struct mycam_buffer, list);
 
 	// 成功取到缓冲区节点，从链表中移除
 	list_del(&buf->list);
+	atomic_dec(&mq->credits);
+
+	// 缓冲区已从链表摘下，归本函数独占，拷贝放在锁外，避免高分辨率下长时间关中断
+	spin_unlock_irqrestore(&mq->qlock, flags);
 
 	// 获取 vb2_buffer
 	vb = &buf->vb.vb2_buf;
-	if (!vb) {
-		cam_err("Invalid vb2_buffer\n");
-		goto release_lock;
+
+	if (pmu)
+		my_pmu_stage_begin(&mycam->pmu_copy, &snap);
+
+	// 逐个平面写入，多内存平面时ring buffer中连续存放的各平面分别写进各自的缓冲区
+	for (p = 0; p < vb->num_planes; p++) {
+		size_t len = mycam->format_mp.plane_fmt[p].sizeimage;
+
+		// 获取dma缓冲区虚拟地址
+		vaddr = vb2_plane_vaddr(vb, p);
+		if (!vaddr || vb2_plane_size(vb, p) < len || offset + len > frame->len) {
+			mycam->stats.buffer_errors++;
+			cam_err_ratelimited("Invalid vb2_buffer, index=%u, plane=%u\n", vb->index, p);
+			if (mq->ring) {
+				buf->vb.sequence = frame->sequence;
+				mycam_ring_complete(mycam, mq, buf, 0, MYCAM_RING_F_ERROR);
+			} else {
+				vb2_buffer_done(vb, VB2_BUF_STATE_ERROR);
+				mycam_buffer_signal_fence(buf, -EIO);
+			}
+			return;
+		}
+
+		// 导入的dmabuf由导出者管理cache，CPU写之前后需要通知导出者
+		dbuf = vb->memory == VB2_MEMORY_DMABUF ? vb->planes[p].dbuf : NULL;
+		if (dbuf)
+			dma_buf_begin_cpu_access(dbuf, DMA_TO_DEVICE);
+
+		// 使用memcpy代替真实的DMA传输
+		memcpy(vaddr, frame->vaddr + offset, len);
+
+		if (dbuf)
+			dma_buf_end_cpu_access(dbuf, DMA_TO_DEVICE);
+
+		// 模拟DMA：经可缓存的内核映射写入的数据要写回内存，才相当于设备写进了内存，之后作废 cache 不会丢数据
+		if (mycam_buffer_cached(vb))
+			my_vb2_mem_sync_for_device(vb->planes[p].mem_priv);
+
+		vb2_set_plane_payload(vb, p, len);
+		offset += len;
 	}
 
-	// 获取dma缓冲区虚拟地址
-	vaddr = vb2_plane_vaddr(vb, 0);
+	if (pmu)
+		my_pmu_stage_end(&mycam->pmu_copy, &snap, offset);
+
+	// 设置时间戳和帧序号，并标记缓冲区为完成
+	// 帧序号来自CSI，上游跳过或丢弃的帧会在序号上留下空洞
+	done_ts = ktime_get();
+	vb->timestamp = ktime_to_ns(done_ts);
+	buf->vb.field = V4L2_FIELD_NONE;
+	buf->vb.sequence = frame->sequence;
+	trace_my_vb2_buf_done(mycam->vdev.num, frame->sequence, vb->index);
+	if (mq->ring) {
+		mycam_ring_complete(mycam, mq, buf, offset, 0);
+	} else {
+		vb2_buffer_done(vb, VB2_BUF_STATE_DONE);
+		// 先交还再发信号，消费者被唤醒后非阻塞 DQBUF 就能取到
+		mycam_buffer_signal_fence(buf, 0);
+	}
+	mycam->stats.buffers_done++;
 
-	// 使用memcpy代替真实的DMA传输
-	memcpy(vaddr, fbuffer, len);
+	mycam_latency_record(mycam, MYCAM_LAT_ISP_VB2, frame->post_ts, done_ts);
+	mycam_latency_record(mycam, MYCAM_LAT_END_TO_END, frame->sof_ts, done_ts);
+}
 
-	// 设置载荷大小，并标记缓冲区为完成
-	vb2_set_plane_payload(vb, 0, len);
-	vb2_buffer_done(vb, VB2_BUF_STATE_DONE);
+// ISP处理完一帧后回调，priv 为本路流水线的 my_camera；同一帧交给每一个正在出流的队列
+static void mycam_simulate_dma_transfer(void *priv, struct my_frame *frame)
+{
+	struct my_camera *mycam = priv;
+	struct mycam_queue *mq;
 
-release_lock:
-	spin_unlock_irqrestore(&g_mycam->qlock, flags);
+	// 抽帧：旁路ISP时没有经过ISP的过滤，在这里跳过，不占用缓冲区也不拷贝；经过ISP时已经抽过，不能再抽一次
+	if (mycam->bypass_isp && my_frame_divider_skip(&mycam->divider_skip, READ_ONCE(mycam->frame_divider)))
+		return;
 
-	end_time = ktime_get();
-	diff_ns  = ktime_to_ns(ktime_sub(end_time, start_time));
-	
-	cam_dbg("diff_ns=%lld\n", diff_ns);
+	mycam_latency_record(mycam, MYCAM_LAT_SENSOR_CSI, frame->sof_ts, frame->csi_ts);
+	if (!mycam->bypass_isp) {
+		mycam_latency_record(mycam, MYCAM_LAT_CSI_ISP, frame->write_ts, frame->read_ts);
+		mycam_latency_record(mycam, MYCAM_LAT_ISP, frame->read_ts, frame->post_ts);
+	}
+
+	// 持锁期间没有队列能停流，停流的队列先从链表摘下再归还缓冲区
+	mutex_lock(&mycam->streams_lock);
+	list_for_each_entry(mq, &mycam->streams, node)
+		mycam_deliver_frame(mycam, mq, frame);
+	mutex_unlock(&mycam->streams_lock);
 }
 
 /*
@@ -369,23 +1244,35 @@ static int queue_setup(struct vb2_queue *vq,
 		       unsigned int *nbuffers, unsigned int *nplanes,
 		       unsigned int sizes[], struct device *alloc_devs[])
 {
-	struct my_camera *mycam = vb2_get_drv_priv(vq);
+	struct mycam_queue *mq = vb2_get_drv_priv(vq);
+	const struct v4l2_pix_format_mplane *fmt = &mq->mycam->format_mp;
+	unsigned int p;
 
 	cam_info("num_buffers=%u, nbuffers=%u, nplanes=%u\n", vq->num_buffers, *nbuffers, *nplanes);
 	
 	/*  vq->num_buffers 是vb2_queue中已分配的buffer个数
 		nbuffers 是用户情况的个数，这里可以根据硬件实际情况进行调整
-		nplanes 是平面的个数，GPT说像YUV420这种Y/U/V多分量的建议用多个plane分别表示各个分量，
-		但是为了简化应用层管理内存，这里仅设置一个平面。
+		nplanes 是平面的个数，单平面接口下所有分量放在同一个平面中，
+		多平面接口下 NV12M 的Y和UV各占一个平面，分别分配、各自对齐。
 	*/
 	if (vq->num_buffers + *nbuffers < 4)	// 这里设置一共最多4个buffer
 		*nbuffers = 4 - vq->num_buffers;
 
-	// 设置为单平面
-	*nplanes = 1;
+	// VIDIOC_CREATE_BUFS 指定了大小，只需检查是否能放下当前格式的一帧
+	if (*nplanes) {
+		if (*nplanes != fmt->num_planes)
+			return -EINVAL;
+		for (p = 0; p < *nplanes; p++) {
+			if (sizes[p] < fmt->plane_fmt[p].sizeimage)
+				return -EINVAL;
+		}
+		return 0;
+	}
 
-	// 但平面的大小设置为当前像素格式的总大小
-	sizes[0] = mycam->format.sizeimage;
+	// 每个平面的大小按当前像素格式设置
+	*nplanes = fmt->num_planes;
+	for (p = 0; p < *nplanes; p++)
+		sizes[p] = fmt->plane_fmt[p].sizeimage;
 
 	cam_info("nbuffers=%u, nplanes=%u, sizes[0]=%u\n", *nbuffers, *nplanes, sizes[0]);
 	
@@ -398,69 +1285,204 @@ static int queue_setup(struct vb2_queue *vq,
  */
 static int buffer_prepare(struct vb2_buffer *vb)
 {
-	struct my_camera *mycam = vb2_get_drv_priv(vb->vb2_queue);
-	unsigned long size = mycam->format.sizeimage;
+	struct mycam_queue *mq = vb2_get_drv_priv(vb->vb2_queue);
+	struct my_camera *mycam = mq->mycam;
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct mycam_buffer *buf = to_mycam_buffer(vbuf);
+	unsigned int p;
 
-	cam_info("index=%u\n", vb->index);
+	cam_dbg("index=%u\n", vb->index);
 
-	if (vb2_plane_size(vb, 0) < size) {
-		cam_err("buffer too small (%lu < %lu)\n", vb2_plane_size(vb, 0), size);
-		return -EINVAL;
+	for (p = 0; p < vb->num_planes; p++) {
+		unsigned long size = mycam->format_mp.plane_fmt[p].sizeimage;
+
+		if (vb2_plane_size(vb, p) < size) {
+			cam_err_ratelimited("plane %u too small (%lu < %lu)\n", p, vb2_plane_size(vb, p), size);
+			return -EINVAL;
+		}
+
+		vb2_set_plane_payload(vb, p, size);
 	}
 
-	vb2_set_plane_payload(vb, 0, size);
+	/*
+	 * 记下 cache 提示标志。vb2 在 5.4 上不处理这两个标志，但会把它们留在 vbuf->flags 里；
+	 * 到这里 vb2 已经做完属主检查，别的文件句柄改不了这个缓冲区的标志。
+	 * 完成环交还的缓冲区不经过这里，沿用最后一次 QBUF 的标志。
+	 */
+	buf->cache_hints = vbuf->flags & (V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN);
+	mycam_buffer_sync(mycam, buf, false);
+
+	/*
+	 * vb2 在 5.4 上把不认识的标志原样留在 vbuf->flags 里，QUERYBUF/DQBUF 时再交还给用户；
+	 * 输出 fence 只对本次 QBUF 有效，不清掉的话原样再入队的程序每帧都会多建一个 fence 和 fd。
+	 */
+	vbuf->flags &= ~MYCAM_BUF_FLAG_OUT_FENCE;
+
 	return 0;
 }
 
+/*
+ * DQBUF 或取消队列（停流、释放缓冲区）时调用。写好的缓冲区在分发时已经发出信号，
+ * 这里只剩没有写入就交还的缓冲区，fence 带错误状态结束，等在上面的消费者不会一直等下去。
+ * 可缓存缓冲区在这里作废 cache：vb2 在 5.4 上是在 vb2_buffer_done 时做的，放到 DQBUF 时，
+ * 不取的帧、带 NO_CACHE_INVALIDATE 的帧都不用付这个代价。
+ */
+static void buffer_finish(struct vb2_buffer *vb)
+{
+	struct mycam_queue *mq = vb2_get_drv_priv(vb->vb2_queue);
+	struct mycam_buffer *buf = to_mycam_buffer(to_vb2_v4l2_buffer(vb));
+
+	if (vb->state == VB2_BUF_STATE_DONE)
+		mycam_buffer_sync(mq->mycam, buf, true);
+
+	mycam_buffer_signal_fence(buf, vb->state == VB2_BUF_STATE_DONE ? 0 : -ECANCELED);
+}
+
 /*
  * Queue this buffer to the DMA engine.
  */
 static void buffer_queue(struct vb2_buffer *vb)
 {
 	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
-	struct my_camera *mycam = vb2_get_drv_priv(vb->vb2_queue);
+	struct mycam_queue *mq = vb2_get_drv_priv(vb->vb2_queue);
 	struct mycam_buffer *buf = to_mycam_buffer(vbuf);
 	unsigned long flags = 0;
-	dma_addr_t phys_addr = 0;
-	void *vaddr = NULL;
 
-	
-	// vb/vbuf/buf 三者地址是一样，它们是嵌套关系
-	cam_info("index=%u\n", vb->index);
+	// vb/vbuf/buf 三者地址是一样，它们是嵌套关系；地址只在打开 dynamic debug 时才去查
+	cam_dbg("index=%u, vaddr=%p\n", vb->index, vb2_plane_vaddr(vb, 0));
 
 	// 加锁
-	spin_lock_irqsave(&mycam->qlock, flags);
-
-	// 将buf加入队尾
-	list_add_tail(&buf->list, &mycam->buf_list);
-
-	// 获取当前vb2_buffer中DMA缓冲区的物理地址
-	phys_addr = vb2_dma_contig_plane_dma_addr(vb, 0);
-	cam_dbg("phys_addr=%pad\n", &phys_addr);
-
-	// 获取当前vb2_buffer中DMA缓冲区的虚拟地址。
-	vaddr = vb2_plane_vaddr(vb, 0);
-	cam_dbg("vaddr=%p\n", vaddr);
+	spin_lock_irqsave(&mq->qlock, flags);
 
+	// 将buf加入队尾，上游多了一个可用的缓冲区
+	list_add_tail(&buf->list, &mq->buf_list);
+	atomic_inc(&mq->credits);
 
 	// 解锁
-	spin_unlock_irqrestore(&mycam->qlock, flags);
+	spin_unlock_irqrestore(&mq->qlock, flags);
 }
 
-static void return_all_buffers(struct my_camera *mycam,
+static void return_all_buffers(struct mycam_queue *mq,
 			       enum vb2_buffer_state state)
 {
 	struct mycam_buffer *buf, *node;
 	unsigned long flags;
+	unsigned int i;
 
 	cam_info("\n");
 
-	spin_lock_irqsave(&mycam->qlock, flags);
-	list_for_each_entry_safe(buf, node, &mycam->buf_list, list) {
+	spin_lock_irqsave(&mq->qlock, flags);
+	list_for_each_entry_safe(buf, node, &mq->buf_list, list) {
 		vb2_buffer_done(&buf->vb.vb2_buf, state);
 		list_del(&buf->list);
 	}
-	spin_unlock_irqrestore(&mycam->qlock, flags);
+	atomic_set(&mq->credits, 0);
+
+	// 完成环上发布给用户、还没归还的缓冲区，在vb2看来仍归驱动所有，也要交还
+	if (mq->ring) {
+		for_each_set_bit(i, mq->ring->user_owned, VB2_MAX_FRAME)
+			vb2_buffer_done(mq->queue.bufs[i], state);
+		bitmap_zero(mq->ring->user_owned, VB2_MAX_FRAME);
+	}
+	spin_unlock_irqrestore(&mq->qlock, flags);
+}
+
+// 依次打开 ISP -> CSI -> sensor，或依次关闭 sensor -> CSI -> ISP；旁路 ISP 时不打开 ISP
+static int mycam_subdevs_s_stream(struct my_camera *mycam, int enable)
+{
+	struct v4l2_subdev *chain[] = {
+		mycam->bypass_isp ? NULL : mycam->isp_subdev,
+		mycam->csi_subdev,
+		mycam->sensor_subdev,
+	};
+	int n = ARRAY_SIZE(chain);
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		struct v4l2_subdev *sd = chain[enable ? i : n - 1 - i];
+
+		if (!sd)
+			continue;
+
+		ret = v4l2_subdev_call(sd, video, s_stream, enable);
+		if (ret && ret != -ENOIOCTLCMD) {
+			cam_err("Failed to %s %s streaming, ret=%d\n", enable ? "start" : "stop", sd->name, ret);
+			if (enable) {
+				// 回退已经打开的子设备
+				while (--i >= 0) {
+					if (chain[i])
+						v4l2_subdev_call(chain[i], video, s_stream, 0);
+				}
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// 上游每生产/处理一帧前调用，按丢帧策略决定是否还值得做；共享模式下只要还有一个队列有空闲缓冲区就要做
+static bool mycam_has_credit(void *priv)
+{
+	struct my_camera *mycam = priv;
+	struct mycam_queue *mq;
+	bool credit = false;
+
+	if (READ_ONCE(mycam->drop_policy) != MYCAM_DROP_AT_SOURCE)
+		return true;
+
+	mutex_lock(&mycam->streams_lock);
+	list_for_each_entry(mq, &mycam->streams, node) {
+		if (mq->ring)
+			mycam_ring_reap(mycam, mq);
+		if (atomic_read(&mq->credits) > 0) {
+			credit = true;
+			break;
+		}
+	}
+	mutex_unlock(&mycam->streams_lock);
+
+	if (!credit)
+		atomic64_inc(&mycam->dropped_source);
+
+	return credit;
+}
+
+/*
+ * 按当前使能的链路决定数据通路：video 的输入来自 ISP 时 CSI 把帧交给 ISP、ISP 再交给本设备；
+ * 来自 CSI 时 CSI 直接把帧交给本设备，ISP 不参与，省去一次线程切换。
+ */
+static int mycam_route_pipeline(struct my_camera *mycam)
+{
+	struct media_pad *remote = media_entity_remote_pad(&mycam->pad);
+
+	if (!remote) {
+		cam_err("No enabled link to %s\n", mycam->vdev.name);
+		return -EPIPE;
+	}
+
+	mycam->bypass_isp = remote->entity == &mycam->csi_subdev->entity;
+
+	if (mycam->bypass_isp) {
+		my_isp_register_dma_cb(mycam->isp_subdev, NULL, NULL);
+		my_csi_set_consumer(mycam->csi_subdev, NULL);
+		my_csi_register_dma_cb(mycam->csi_subdev, mycam_simulate_dma_transfer, mycam);
+	} else {
+		my_csi_register_dma_cb(mycam->csi_subdev, NULL, NULL);
+		my_csi_set_consumer(mycam->csi_subdev, mycam->isp_subdev);
+		my_isp_register_dma_cb(mycam->isp_subdev, mycam_simulate_dma_transfer, mycam);
+	}
+
+	// 子设备可能在控制项设置之后才绑定，出流时再同步一次抽帧设置
+	my_isp_set_frame_divider(mycam->isp_subdev, READ_ONCE(mycam->frame_divider));
+
+	// 两条通路都做流控，是否真的在源头丢帧由 drop_policy 决定
+	my_csi_register_credit_cb(mycam->csi_subdev, mycam_has_credit, mycam);
+	my_isp_register_credit_cb(mycam->isp_subdev, mycam_has_credit, mycam);
+
+	cam_info("Route: %s\n", mycam->bypass_isp ? "CSI -> video" : "CSI -> ISP -> video");
+
+	return 0;
 }
 
 /*
@@ -471,34 +1493,63 @@ static void return_all_buffers(struct my_camera *mycam,
  */
 static int start_streaming(struct vb2_queue *vq, unsigned int count)
 {
-	struct my_camera *mycam = vb2_get_drv_priv(vq);
+	struct mycam_queue *mq = vb2_get_drv_priv(vq);
+	struct my_camera *mycam = mq->mycam;
 	int ret = 0;
-	unsigned long flags;
-	struct mycam_buffer *buf = NULL, *node = NULL;
-	struct vb2_buffer *vb = NULL;
-	void *vaddr = NULL;
+
+	atomic64_set(&mq->dropped, 0);
+	if (mq->ring)
+		mycam_ring_reset(mq->ring);
+
+	// 先挂到分发链表上再打开子设备，fast_start 的第一帧才不会错过
+	mutex_lock(&mycam->streams_lock);
+	list_add_tail(&mq->node, &mycam->streams);
+	mutex_unlock(&mycam->streams_lock);
+
+	// 共享模式下流水线已经在运行，新的队列从下一帧开始接收
+	if (mycam->stream_count++)
+		return 0;
 
 	mycam->sequence = 0;
+	mycam->divider_skip = 0;
+	atomic_set(&mycam->sof_sequence, 0);
+	atomic64_set(&mycam->dropped_source, 0);
+	atomic64_set(&mycam->dropped_sink, 0);
 
 	cam_info("--------------------------------\n");
 	
+	// 锁定链路并校验两端格式，出流期间不能修改链路
+	ret = media_pipeline_start(&mycam->vdev.entity, &mycam->pipe);
+	if (ret) {
+		cam_err("Failed to start media pipeline, ret=%d\n", ret);
+		goto err_return_buffers;
+	}
+
+	ret = mycam_route_pipeline(mycam);
+	if (ret)
+		goto err_stop_pipeline;
+
 	/* TODO: start DMA */
-	// 主设备通过 v4l2_subdev_call 调用 ISP 子设备的 s_stream 操作。
+	// 主设备通过 v4l2_subdev_call 调用各子设备的 s_stream 操作，从下游往上游依次打开，
+	// 保证sensor出第一帧时 CSI/ISP 已经就绪
+	ret = mycam_subdevs_s_stream(mycam, 1);
+	if (ret)
+		goto err_stop_pipeline;
 
-	if (mycam->sensor_subdev) {
-		ret = v4l2_subdev_call(mycam->sensor_subdev, video, s_stream, 1);
-		if (ret && ret != -ENOIOCTLCMD) {
-            cam_err("Failed to start sensor streaming, ret=%d\n", ret);
-        }
-	}
+	return 0;
 
-	if (ret) {
-		/*
-		 * In case of an error, return all active buffers to the
-		 * QUEUED state
-		 */
-		return_all_buffers(mycam, VB2_BUF_STATE_QUEUED);
-	}
+err_stop_pipeline:
+	media_pipeline_stop(&mycam->vdev.entity);
+err_return_buffers:
+	mycam->stream_count--;
+	mutex_lock(&mycam->streams_lock);
+	list_del_init(&mq->node);
+	mutex_unlock(&mycam->streams_lock);
+	/*
+	 * In case of an error, return all active buffers to the
+	 * QUEUED state
+	 */
+	return_all_buffers(mq, VB2_BUF_STATE_QUEUED);
 	return ret;
 }
 
@@ -508,22 +1559,26 @@ static int start_streaming(struct vb2_queue *vq, unsigned int count)
  */
 static void stop_streaming(struct vb2_queue *vq)
 {
-	struct my_camera *mycam = vb2_get_drv_priv(vq);
-	int ret = 0;
-
-	cam_info("++++++++++++++++++++++++++++++++\n");
-	
-	/* TODO: stop DMA */
-	// 关闭sensor
-	if (mycam->sensor_subdev) {
-		ret = v4l2_subdev_call(mycam->sensor_subdev, video, s_stream, 0);
-		if (ret && ret != -ENOIOCTLCMD) {
-            cam_err("Failed to stop sensor streaming, ret=%d\n", ret);
-        }
+	struct mycam_queue *mq = vb2_get_drv_priv(vq);
+	struct my_camera *mycam = mq->mycam;
+
+	// 先从分发链表摘下，之后不会再有帧写进本队列
+	mutex_lock(&mycam->streams_lock);
+	list_del_init(&mq->node);
+	mutex_unlock(&mycam->streams_lock);
+
+	// 最后一个出流的队列停流时才关闭流水线
+	if (--mycam->stream_count == 0) {
+		cam_info("++++++++++++++++++++++++++++++++\n");
+
+		/* TODO: stop DMA */
+		// 从sensor开始逐级关闭，ISP停流返回后不会再提交帧
+		mycam_subdevs_s_stream(mycam, 0);
+		media_pipeline_stop(&mycam->vdev.entity);
 	}
 
 	/* Release all active buffers */
-	return_all_buffers(mycam, VB2_BUF_STATE_ERROR);
+	return_all_buffers(mq, VB2_BUF_STATE_ERROR);
 }
 
 /*
@@ -535,18 +1590,145 @@ static const struct vb2_ops mycam_qops = {
 	.queue_setup		= queue_setup,			// 会被 vb2_ioctl_reqbufs 调用
 	.buf_prepare		= buffer_prepare,		// 会被 vb2_ioctl_qbuf 调用
 	.buf_queue			= buffer_queue,			// 会被 vb2_ioctl_streamon 调用
+	.buf_finish			= buffer_finish,		// 会被 vb2_ioctl_dqbuf 和停流时调用
 	.start_streaming	= start_streaming,		// 会被 vb2_ioctl_streamon 调用
 	.stop_streaming		= stop_streaming,
 	.wait_prepare		= vb2_ops_wait_prepare,
 	.wait_finish		= vb2_ops_wait_finish,
 };
 
+// 初始化一个缓冲区队列，独占模式下是 mycam->main，共享模式下每次打开一个
+static int mycam_queue_init(struct my_camera *mycam, struct mycam_queue *mq)
+{
+	struct vb2_queue *q = &mq->queue;
+
+	mq->mycam = mycam;
+	INIT_LIST_HEAD(&mq->buf_list);
+	INIT_LIST_HEAD(&mq->node);
+	spin_lock_init(&mq->qlock);
+
+	q->type = mycam->buf_type;
+	// read() 只能用于单平面，且只有独占模式下才有节点级的队列供其使用
+	// my_vb2_mem 的缓冲区可以 EXPBUF 导出、可以交入用户内存（比如 hugetlb 大页），但不能导入 dmabuf
+	q->io_modes = VB2_MMAP;
+	if (!hugepage_buffers && !cached_buffers)
+		q->io_modes |= VB2_DMABUF;
+	else
+		q->io_modes |= VB2_USERPTR;
+	if (!mycam->multiplanar && !mycam->shared)
+		q->io_modes |= VB2_READ;
+	q->dev = &mycam->pdev->dev;
+	q->drv_priv = mq;
+	q->buf_struct_size = sizeof(struct mycam_buffer); // 很重要，__vb2_queue_alloc 中实际会按此大小分配内存
+	q->ops = &mycam_qops;
+	if (hugepage_buffers)
+		q->mem_ops = &my_vb2_huge_memops;
+	else if (cached_buffers)
+		q->mem_ops = &my_vb2_cached_memops;
+	else
+		q->mem_ops = &vb2_dma_contig_memops;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	q->min_buffers_needed = 2;
+	q->lock = &mycam->lock;
+	q->gfp_flags = GFP_DMA32;
+
+	return vb2_queue_init(q);
+}
+
+// 关闭完成环，调用时队列不在出流
+static void mycam_ring_free(struct mycam_queue *mq)
+{
+	struct mycam_ring_ctx *ring = mq->ring;
+
+	if (!ring)
+		return;
+
+	mq->ring = NULL;
+	__free_page(ring->page);
+	kfree(ring);
+}
+
+// MYCAM_IOC_RING_SETUP，由 video_ioctl2 持 lock 调用
+static int mycam_ring_setup(struct file *file, struct mycam_ring_setup *setup)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct mycam_queue *mq = mycam_file_queue(file);
+	struct mycam_ring_ctx *ring;
+
+	BUILD_BUG_ON(sizeof(struct mycam_ring) > PAGE_SIZE);
+	BUILD_BUG_ON(MYCAM_RING_ENTRIES < VB2_MAX_FRAME);
+
+	// 独占模式下只有申请了缓冲区的句柄能打开，出流期间不能切换
+	if (!mycam->shared && mq->queue.owner != file->private_data)
+		return -EBUSY;
+	if (vb2_is_streaming(&mq->queue))
+		return -EBUSY;
+
+	if (!setup->enable) {
+		mycam_ring_free(mq);
+		return 0;
+	}
+
+	if (!mq->ring) {
+		ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+		if (!ring)
+			return -ENOMEM;
+
+		ring->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!ring->page) {
+			kfree(ring);
+			return -ENOMEM;
+		}
+		ring->shm = page_address(ring->page);
+		init_waitqueue_head(&ring->wait);
+		mq->ring = ring;
+	}
+	mq->ring->owner = file;
+
+	setup->entries     = MYCAM_RING_ENTRIES;
+	setup->size        = PAGE_SIZE;
+	setup->mmap_offset = MYCAM_RING_MMAP_OFFSET;
+
+	cam_info("Completion ring enabled, %u entries\n", setup->entries);
+
+	return 0;
+}
+
+static long mycam_vidioc_default(struct file *file, void *fh, bool valid_prio, unsigned int cmd, void *arg)
+{
+	switch (cmd) {
+	case MYCAM_IOC_RING_SETUP:
+		return mycam_ring_setup(file, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+// 除控制项变化外还支持帧起始事件，事件在 mycam_notify 中随sensor的帧起始发出
+static int mycam_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_FRAME_SYNC:
+		return v4l2_event_subscribe(fh, sub, MYCAM_FRAME_SYNC_EVENTS, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
 static const struct v4l2_ioctl_ops my_v4l2_ioctl_ops = {
 	.vidioc_querycap = mycam_querycap,
 	.vidioc_try_fmt_vid_cap = mycam_try_fmt_vid_cap,
 	.vidioc_s_fmt_vid_cap = mycam_s_fmt_vid_cap,
 	.vidioc_g_fmt_vid_cap = mycam_g_fmt_vid_cap,
+	.vidioc_try_fmt_vid_cap_mplane = mycam_try_fmt_vid_cap_mplane,
+	.vidioc_s_fmt_vid_cap_mplane = mycam_s_fmt_vid_cap_mplane,
+	.vidioc_g_fmt_vid_cap_mplane = mycam_g_fmt_vid_cap_mplane,
 	.vidioc_enum_fmt_vid_cap = mycam_enum_fmt_vid_cap,
+	.vidioc_enum_framesizes = mycam_enum_framesizes,
+	.vidioc_enum_frameintervals = mycam_enum_frameintervals,
+
+	.vidioc_g_parm = mycam_g_parm,
+	.vidioc_s_parm = mycam_s_parm,
 
 	.vidioc_g_std = mycam_g_std,
 	.vidioc_s_std = mycam_s_std,
@@ -563,28 +1745,197 @@ static const struct v4l2_ioctl_ops my_v4l2_ioctl_ops = {
 	.vidioc_s_input = mycam_s_input,
 
 	.vidioc_reqbufs 	= mycam_vb2_ioctl_reqbufs,
-	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_create_bufs = mycam_vb2_ioctl_create_bufs,
 	.vidioc_querybuf 	= mycam_vb2_ioctl_querybuf,
 	.vidioc_qbuf 		= mycam_vb2_ioctl_qbuf,
 	.vidioc_dqbuf 		= mycam_vb2_ioctl_dqbuf,
-	.vidioc_expbuf 		= vb2_ioctl_expbuf,
+	.vidioc_expbuf 		= mycam_vb2_ioctl_expbuf,
 	.vidioc_streamon 	= mycam_vb2_ioctl_streamon,
 	.vidioc_streamoff 	= mycam_vb2_ioctl_streamoff,
 
 	.vidioc_log_status = v4l2_ctrl_log_status,
-	.vidioc_subscribe_event = v4l2_ctrl_subscribe_event,
+	.vidioc_subscribe_event = mycam_subscribe_event,
 	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
+	.vidioc_default = mycam_vidioc_default,
 };
 
-// video_device 的 v4l2_file_operations 函数集全部都用 vb2 的
+static int mycam_init_client_controls(struct my_camera *mycam, struct mycam_client *client);
+static int mycam_queue_init(struct my_camera *mycam, struct mycam_queue *mq);
+
+// 共享模式下每次打开都分配一个独立的缓冲区队列
+static int mycam_fop_open(struct file *file)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct mycam_client *client;
+	int ret;
+
+	if (!mycam->shared)
+		return v4l2_fh_open(file);
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+
+	ret = mycam_queue_init(mycam, &client->q);
+	if (ret)
+		goto err_free;
+
+	ret = mycam_init_client_controls(mycam, client);
+	if (ret)
+		goto err_release_queue;
+
+	v4l2_fh_init(&client->fh, &mycam->vdev);
+	client->fh.ctrl_handler = &client->ctrl_handler;
+	file->private_data = &client->fh;
+	v4l2_fh_add(&client->fh);
+
+	mutex_lock(&mycam->lock);
+	list_add_tail(&client->node, &mycam->clients);
+	mutex_unlock(&mycam->lock);
+
+	return 0;
+
+err_release_queue:
+	vb2_queue_release(&client->q.queue);
+err_free:
+	kfree(client);
+	return ret;
+}
+
+static int mycam_fop_release(struct file *file)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct mycam_client *client;
+
+	if (!mycam->shared) {
+		int ret = vb2_fop_release(file);
+
+		// 本句柄出流时已经停流；缓冲区已经转给别的句柄并在出流时，完成环留到下一次设置或卸载驱动时释放
+		mutex_lock(&mycam->lock);
+		if (mycam->main.ring && mycam->main.ring->owner == file) {
+			if (vb2_is_streaming(&mycam->main.queue))
+				mycam->main.ring->owner = NULL;
+			else
+				mycam_ring_free(&mycam->main);
+		}
+		mutex_unlock(&mycam->lock);
+
+		return ret;
+	}
+
+	client = container_of(file->private_data, struct mycam_client, fh);
+
+	// 还在出流时会先停流，最后一个出流的句柄关闭时流水线随之停止
+	mutex_lock(&mycam->lock);
+	vb2_queue_release(&client->q.queue);
+	mycam_ring_free(&client->q);
+	list_del(&client->node);
+	mutex_unlock(&mycam->lock);
+
+	v4l2_ctrl_handler_free(&client->ctrl_handler);
+	v4l2_fh_del(&client->fh);
+	v4l2_fh_exit(&client->fh);
+	kfree(client);
+
+	return 0;
+}
+
+// 把完成环的共享页映射给打开它的句柄
+static int mycam_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct mycam_ring_ctx *ring;
+	int ret;
+
+	mutex_lock(&mycam->lock);
+	ring = mycam_file_queue(file)->ring;
+	if (!ring || ring->owner != file || vma->vm_end - vma->vm_start != PAGE_SIZE) {
+		ret = -EINVAL;
+	} else {
+		vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+		ret = vm_insert_page(vma, vma->vm_start, ring->page);
+	}
+	mutex_unlock(&mycam->lock);
+
+	return ret;
+}
+
+static int mycam_fop_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	if (vma->vm_pgoff == MYCAM_RING_MMAP_OFFSET >> PAGE_SHIFT)
+		return mycam_ring_mmap(file, vma);
+
+	if (mycam->shared)
+		return vb2_mmap(&mycam_file_queue(file)->queue, vma);
+
+	return vb2_fop_mmap(file, vma);
+}
+
+static ssize_t mycam_fop_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	struct my_camera *mycam = video_drvdata(file);
+
+	// read() 的缓冲区由vb2在节点唯一的队列上隐式申请，共享模式下没有这样的队列
+	if (mycam->shared)
+		return -EINVAL;
+
+	return vb2_fop_read(file, buf, count, ppos);
+}
+
+// 完成环打开并出流时，缓冲区不经过vb2，完成队列非空即可读；事件照常通过 POLLPRI 通知
+static __poll_t mycam_ring_poll(struct file *file, struct mycam_ring_ctx *ring, poll_table *wait)
+{
+	struct v4l2_fh *fh = file->private_data;
+	__poll_t ret = 0;
+
+	poll_wait(file, &ring->wait, wait);
+	if (READ_ONCE(ring->cq_head) != READ_ONCE(ring->shm->cq_tail))
+		ret |= EPOLLIN | EPOLLRDNORM;
+
+	if (v4l2_event_pending(fh))
+		ret |= EPOLLPRI;
+	else if (poll_requested_events(wait) & EPOLLPRI)
+		poll_wait(file, &fh->wait, wait);
+
+	return ret;
+}
+
+static __poll_t mycam_fop_poll(struct file *file, poll_table *wait)
+{
+	struct my_camera *mycam = video_drvdata(file);
+	struct mycam_queue *mq = mycam_file_queue(file);
+	__poll_t ret;
+
+	// 独占模式下所有句柄共用一个队列，只有打开完成环的句柄按完成环等待，其他句柄仍是 vb2 的语义
+	mutex_lock(&mycam->lock);
+	if (mq->ring && mq->ring->owner == file && vb2_is_streaming(&mq->queue)) {
+		ret = mycam_ring_poll(file, mq->ring, wait);
+		mutex_unlock(&mycam->lock);
+		return ret;
+	}
+	mutex_unlock(&mycam->lock);
+
+	if (!mycam->shared)
+		return vb2_fop_poll(file, wait);
+
+	mutex_lock(&mycam->lock);
+	ret = vb2_poll(&mycam_file_queue(file)->queue, file, wait);
+	mutex_unlock(&mycam->lock);
+
+	return ret;
+}
+
+// video_device 的 v4l2_file_operations 函数集，独占模式下全部都用 vb2 的；共享模式下不支持 read()
 static const struct v4l2_file_operations my_v4l2_fops = {
 	.owner = THIS_MODULE,
-	.open = v4l2_fh_open,
-	.release = vb2_fop_release,
+	.open = mycam_fop_open,
+	.release = mycam_fop_release,
 	.unlocked_ioctl = video_ioctl2,
-	.read = vb2_fop_read,
-	.mmap = vb2_fop_mmap,
-	.poll = vb2_fop_poll,
+	.read = mycam_fop_read,
+	.mmap = mycam_fop_mmap,
+	.poll = mycam_fop_poll,
 };
 
 void video_device_release(struct video_device *vdev)
@@ -665,6 +2016,10 @@ static int mycam_register_subdevs(struct platform_device *pdev)
 	cam_info("CSI subdev bound and registered: %s\n", mycsi->sd.name);
 	mycam->csi_subdev = &mycsi->sd;
 
+	// 3. 把本路的 CSI -> ISP -> video 串起来，各路流水线之间互不影响
+	my_csi_set_consumer(mycam->csi_subdev, mycam->isp_subdev);
+	my_isp_register_dma_cb(mycam->isp_subdev, mycam_simulate_dma_transfer, mycam);
+
 	cam_info("ok\n");
 
 	return 0;
@@ -689,7 +2044,7 @@ static int mycam_notifier_bound(struct v4l2_async_notifier *notifier,
 
 static int mycam_notifier_complete(struct v4l2_async_notifier *notifier)
 {
-    //struct my_camera *mycam = container_of(notifier, struct my_camera, notifier);
+    struct my_camera *mycam = container_of(notifier, struct my_camera, notifier);
     struct v4l2_device *v4l2_dev = notifier->v4l2_dev;
     struct v4l2_subdev *sd;
 	int ret = 0;
@@ -701,16 +2056,309 @@ static int mycam_notifier_complete(struct v4l2_async_notifier *notifier)
         cam_info("Found subdevice: %s\n", sd->name);
     }
 
+	// sensor到齐后所有实体都已注册，建立链路
+	ret = mycam_create_links(mycam);
+	if (ret) {
+		cam_err("Failed to create media links, ret=%d\n", ret);
+		return ret;
+	}
+
 	// 为所有子设备创建devnode，前提是子设备的sd.flags中设置了V4L2_SUBDEV_FL_HAS_DEVNODE
 	ret = v4l2_device_register_subdev_nodes(v4l2_dev);
 	if (ret) {
 		cam_err("Failed to register device node for subdevs\n");
 	}
 
+	// 注册媒体设备，media-ctl -p 可以查看拓扑
+	ret = media_device_register(&mycam->mdev);
+	if (ret) {
+		cam_err("Failed to register media device, ret=%d\n", ret);
+		return ret;
+	}
+
     // 在这里可以执行一些后续操作，比如启动流媒体或初始化硬件
     return 0;
 }
 
+static int mycam_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct my_camera *mycam = container_of(ctrl->handler, struct my_camera, ctrl_handler);
+
+	switch (ctrl->id) {
+	case MYCAM_CID_DROP_POLICY:
+		// 出流期间也可以切换，上游下一帧生效
+		WRITE_ONCE(mycam->drop_policy, ctrl->val);
+		return 0;
+	case MYCAM_CID_FRAME_DIVIDER:
+		// 出流期间也可以修改，ISP（旁路时是 video 节点）按到达的帧倒数过滤，sensor 和 CSI 始终全帧率运行
+		WRITE_ONCE(mycam->frame_divider, ctrl->val);
+		if (mycam->isp_subdev)
+			my_isp_set_frame_divider(mycam->isp_subdev, ctrl->val);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static int mycam_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct my_camera *mycam = container_of(ctrl->handler, struct my_camera, ctrl_handler);
+
+	switch (ctrl->id) {
+	case MYCAM_CID_DROPPED_SOURCE:
+		*ctrl->p_new.p_s64 = atomic64_read(&mycam->dropped_source);
+		return 0;
+	case MYCAM_CID_DROPPED_SINK:
+		*ctrl->p_new.p_s64 = atomic64_read(&mycam->dropped_sink);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_ctrl_ops mycam_ctrl_ops = {
+	.s_ctrl 		  = mycam_s_ctrl,
+	.g_volatile_ctrl  = mycam_g_volatile_ctrl,
+};
+
+static const char * const mycam_drop_policy_menu[] = {
+	"Drop at sink",
+	"Drop at source",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config mycam_drop_policy_cfg = {
+	.ops 	= &mycam_ctrl_ops,
+	.id 	= MYCAM_CID_DROP_POLICY,
+	.name 	= "drop_policy",
+	.type 	= V4L2_CTRL_TYPE_MENU,
+	.max 	= MYCAM_DROP_AT_SOURCE,
+	.def 	= MYCAM_DROP_AT_SOURCE,
+	.qmenu 	= mycam_drop_policy_menu,
+};
+
+static const struct v4l2_ctrl_config mycam_dropped_source_cfg = {
+	.ops 	= &mycam_ctrl_ops,
+	.id 	= MYCAM_CID_DROPPED_SOURCE,
+	.name 	= "frames_dropped_at_source",
+	.type 	= V4L2_CTRL_TYPE_INTEGER64,
+	.flags 	= V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min 	= 0,
+	.max 	= S64_MAX,
+	.step 	= 1,
+};
+
+static const struct v4l2_ctrl_config mycam_dropped_sink_cfg = {
+	.ops 	= &mycam_ctrl_ops,
+	.id 	= MYCAM_CID_DROPPED_SINK,
+	.name 	= "frames_dropped_at_sink",
+	.type 	= V4L2_CTRL_TYPE_INTEGER64,
+	.flags 	= V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min 	= 0,
+	.max 	= S64_MAX,
+	.step 	= 1,
+};
+
+static const struct v4l2_ctrl_config mycam_frame_divider_cfg = {
+	.ops 	= &mycam_ctrl_ops,
+	.id 	= MYCAM_CID_FRAME_DIVIDER,
+	.name 	= "frame_divider",
+	.type 	= V4L2_CTRL_TYPE_INTEGER,
+	.min 	= 1,
+	.max 	= 240,
+	.step 	= 1,
+	.def 	= 1,
+};
+
+// 注册 video 节点上的控制项：丢帧策略、两种丢帧计数和抽帧
+static int mycam_init_controls(struct my_camera *mycam)
+{
+	struct v4l2_ctrl_handler *hdl = &mycam->ctrl_handler;
+
+	v4l2_ctrl_handler_init(hdl, 4);
+	v4l2_ctrl_new_custom(hdl, &mycam_drop_policy_cfg, NULL);
+	v4l2_ctrl_new_custom(hdl, &mycam_dropped_source_cfg, NULL);
+	v4l2_ctrl_new_custom(hdl, &mycam_dropped_sink_cfg, NULL);
+	v4l2_ctrl_new_custom(hdl, &mycam_frame_divider_cfg, NULL);
+	if (hdl->error) {
+		int ret = hdl->error;
+
+		cam_err("Failed to register ctrl, error=%d\n", ret);
+		v4l2_ctrl_handler_free(hdl);
+		return ret;
+	}
+
+	mycam->drop_policy = MYCAM_DROP_AT_SOURCE;
+	mycam->frame_divider = 1;
+
+	return 0;
+}
+
+static int mycam_client_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct mycam_client *client = ctrl->priv;
+
+	switch (ctrl->id) {
+	case MYCAM_CID_CLIENT_DROPPED:
+		*ctrl->p_new.p_s64 = atomic64_read(&client->q.dropped);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_ctrl_ops mycam_client_ctrl_ops = {
+	.g_volatile_ctrl  = mycam_client_g_volatile_ctrl,
+};
+
+static const struct v4l2_ctrl_config mycam_client_dropped_cfg = {
+	.ops 	= &mycam_client_ctrl_ops,
+	.id 	= MYCAM_CID_CLIENT_DROPPED,
+	.name 	= "client_frames_dropped",
+	.type 	= V4L2_CTRL_TYPE_INTEGER64,
+	.flags 	= V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+	.min 	= 0,
+	.max 	= S64_MAX,
+	.step 	= 1,
+};
+
+// 共享模式下每个文件句柄的控制项：本句柄的丢帧计数，再加上设备的全部控制项
+static int mycam_init_client_controls(struct my_camera *mycam, struct mycam_client *client)
+{
+	struct v4l2_ctrl_handler *hdl = &client->ctrl_handler;
+	struct v4l2_ctrl *ctrl;
+
+	v4l2_ctrl_handler_init(hdl, 1);
+	ctrl = v4l2_ctrl_new_custom(hdl, &mycam_client_dropped_cfg, NULL);
+	if (ctrl)
+		ctrl->priv = client;
+	v4l2_ctrl_add_handler(hdl, &mycam->ctrl_handler, NULL, false);
+	if (hdl->error) {
+		int ret = hdl->error;
+
+		cam_err("Failed to register client ctrl, error=%d\n", ret);
+		v4l2_ctrl_handler_free(hdl);
+		return ret;
+	}
+
+	return 0;
+}
+
+// video 的输入pad只能有一条使能的链路：ISP:1 -> video 或 CSI:1 -> video（旁路ISP）
+static int mycam_link_setup(struct media_entity *entity, const struct media_pad *local,
+							const struct media_pad *remote, u32 flags)
+{
+	struct video_device *vdev = media_entity_to_video_device(entity);
+	struct my_camera *mycam = container_of(vdev, struct my_camera, vdev);
+	struct media_link *link;
+
+	if (!(flags & MEDIA_LNK_FL_ENABLED))
+		return 0;
+
+	// 缓冲区已按当前通路的格式分配，不能切换
+	if (mycam_queues_busy(mycam))
+		return -EBUSY;
+
+	list_for_each_entry(link, &entity->links, list) {
+		if (link->sink == local && link->source != remote && (link->flags & MEDIA_LNK_FL_ENABLED)) {
+			cam_err("%s is already linked from %s\n", vdev->name, link->source->entity->name);
+			return -EBUSY;
+		}
+	}
+
+	return 0;
+}
+
+// 出流前由 media_pipeline_start 调用，检查上游输出格式与 video 节点的格式一致
+static int mycam_link_validate(struct media_link *link)
+{
+	struct video_device *vdev = media_entity_to_video_device(link->sink->entity);
+	struct my_camera *mycam = container_of(vdev, struct my_camera, vdev);
+	struct v4l2_subdev *sd = media_entity_to_v4l2_subdev(link->source->entity);
+	const struct my_fmt_info *info = my_fmt_by_fourcc(mycam->format.pixelformat);
+	struct v4l2_subdev_format sd_fmt = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+		.pad   = link->source->index,
+	};
+	int ret;
+
+	ret = v4l2_subdev_call(sd, pad, get_fmt, NULL, &sd_fmt);
+	if (ret)
+		return ret;
+
+	if (sd_fmt.format.width != mycam->format.width || sd_fmt.format.height != mycam->format.height ||
+		!info || sd_fmt.format.code != info->code) {
+		cam_err("%s:%u is %ux%u/%#x, %s is %ux%u/%.4s\n", sd->name, sd_fmt.pad,
+				sd_fmt.format.width, sd_fmt.format.height, sd_fmt.format.code, vdev->name,
+				mycam->format.width, mycam->format.height, (char *)&mycam->format.pixelformat);
+		return -EPIPE;
+	}
+
+	return 0;
+}
+
+static const struct media_entity_operations mycam_entity_ops = {
+	.link_setup    = mycam_link_setup,
+	.link_validate = mycam_link_validate,
+};
+
+// 建立 sensor:0 -> CSI:0 -> CSI:1 -> ISP:0 -> ISP:1 -> video 的链路，另有一条默认关闭的 CSI:1 -> video 旁路
+static int mycam_create_links(struct my_camera *mycam)
+{
+	struct media_entity *video = &mycam->vdev.entity;
+	int ret;
+
+	ret = media_create_pad_link(&mycam->sensor_subdev->entity, 0,
+								&mycam->csi_subdev->entity, CSI_PAD_SINK,
+								MEDIA_LNK_FL_ENABLED | MEDIA_LNK_FL_IMMUTABLE);
+	if (ret)
+		return ret;
+
+	ret = media_create_pad_link(&mycam->csi_subdev->entity, CSI_PAD_SOURCE,
+								&mycam->isp_subdev->entity, ISP_PAD_SINK, MEDIA_LNK_FL_ENABLED);
+	if (ret)
+		return ret;
+
+	ret = media_create_pad_link(&mycam->isp_subdev->entity, ISP_PAD_SOURCE, video, 0, MEDIA_LNK_FL_ENABLED);
+	if (ret)
+		return ret;
+
+	return media_create_pad_link(&mycam->csi_subdev->entity, CSI_PAD_SOURCE, video, 0, 0);
+}
+
+/*
+ * 帧起始时给订阅了 V4L2_EVENT_FRAME_SYNC 的句柄发事件，用户通过 poll() 的 POLLPRI 得知，比 DQBUF 早一整条流水线。
+ * CSI 每收到一个帧起始分配一个帧序号，这里按同样的规则计数，事件中的帧序号就是这一帧 DQBUF 时的 sequence。
+ * v4l2_event_queue 只持有自旋锁，可在硬中断上下文中调用。
+ */
+static void mycam_queue_frame_sync(struct my_camera *mycam, const struct my_sensor_frame_start *fs)
+{
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_FRAME_SYNC,
+	};
+
+	// sensor 错过的帧也占用帧序号，和 CSI 一样先跳过它们
+	ev.u.frame_sync.frame_sequence = atomic_add_return(fs->missed + 1, &mycam->sof_sequence) - 1;
+	v4l2_event_queue(&mycam->vdev, &ev);
+	WRITE_ONCE(mycam->stats.frame_sync, mycam->stats.frame_sync + 1);
+}
+
+// 子设备发给主设备的通知，sensor的帧起始在这里转发给本路的CSI，可能在硬中断上下文中被调用
+static void mycam_notify(struct v4l2_subdev *sd, unsigned int notification, void *arg)
+{
+	struct my_camera *mycam = container_of(sd->v4l2_dev, struct my_camera, v4l2_dev);
+
+	switch (notification) {
+	case MY_SENSOR_NOTIFY_FRAME_START:
+		if (mycam->csi_subdev)
+			my_csi_frame_start(mycam->csi_subdev, arg);
+		mycam_queue_frame_sync(mycam, arg);
+		break;
+	default:
+		break;
+	}
+}
+
 static const struct v4l2_async_notifier_operations mycam_notifier_ops = {
     .bound = mycam_notifier_bound,
     .complete = mycam_notifier_complete,
@@ -800,12 +2448,88 @@ err_cleanup_notifier:
 	return ret;
 }
 
+// 各段延迟：每行一段，按CPU合并后输出样本数、p50/p99/最大值和平均值
+static int mycam_latency_show(struct seq_file *s, void *unused)
+{
+	struct my_camera *mycam = s->private;
+	struct my_hist h;
+	int i;
+
+	for (i = 0; i < MYCAM_LAT_NUM; i++) {
+		my_hist_pcpu_sum(&mycam->latency->stage[i], &h);
+		seq_printf(s, "%s: count=%llu p50_ns=%llu p99_ns=%llu max_ns=%llu avg_ns=%llu\n",
+				   mycam_lat_names[i], h.count, my_hist_percentile(&h, 50), my_hist_percentile(&h, 99),
+				   h.max_ns, h.count ? div64_u64(h.sum_ns, h.count) : 0);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mycam_latency);
+
+static int mycam_stats_show(struct seq_file *s, void *unused)
+{
+	struct my_camera *mycam = s->private;
+	struct mycam_queue *mq;
+	int queued = 0;
+
+	// 所有正在出流的队列中等待填充的缓冲区
+	mutex_lock(&mycam->streams_lock);
+	list_for_each_entry(mq, &mycam->streams, node)
+		queued += atomic_read(&mq->credits);
+	mutex_unlock(&mycam->streams_lock);
+
+	seq_printf(s, "qbuf: %llu\n", READ_ONCE(mycam->stats.qbuf));
+	seq_printf(s, "dqbuf: %llu\n", READ_ONCE(mycam->stats.dqbuf));
+	seq_printf(s, "buffers_done: %llu\n", READ_ONCE(mycam->stats.buffers_done));
+	seq_printf(s, "buffer_errors: %llu\n", READ_ONCE(mycam->stats.buffer_errors));
+	seq_printf(s, "frame_sync_events: %llu\n", READ_ONCE(mycam->stats.frame_sync));
+	seq_printf(s, "ring_returned: %llu\n", READ_ONCE(mycam->stats.ring_returned));
+	seq_printf(s, "ring_invalid: %llu\n", READ_ONCE(mycam->stats.ring_invalid));
+	seq_printf(s, "cache_syncs: %lld\n", atomic64_read(&mycam->stats.cache_syncs));
+	seq_printf(s, "cache_sync_skipped: %lld\n", atomic64_read(&mycam->stats.cache_sync_skipped));
+	seq_printf(s, "buffers_queued: %d\n", queued);
+	seq_printf(s, "streams: %u\n", READ_ONCE(mycam->stream_count));
+	seq_printf(s, "frames_dropped_at_source: %lld\n", (s64)atomic64_read(&mycam->dropped_source));
+	seq_printf(s, "frames_dropped_at_sink: %lld\n", (s64)atomic64_read(&mycam->dropped_sink));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mycam_stats);
+
+static int mycam_pmu_show(struct seq_file *s, void *unused)
+{
+	struct my_camera *mycam = s->private;
+
+	my_pmu_stage_show(s, "copy", &mycam->pmu_copy);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mycam_pmu);
+
+// 写入任意内容清零所有直方图
+static ssize_t mycam_latency_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct my_camera *mycam = file->private_data;
+	int i;
+
+	for (i = 0; i < MYCAM_LAT_NUM; i++)
+		my_hist_pcpu_reset(&mycam->latency->stage[i]);
+
+	return count;
+}
+
+static const struct file_operations mycam_latency_reset_fops = {
+	.owner  = THIS_MODULE,
+	.open   = simple_open,
+	.write  = mycam_latency_reset_write,
+	.llseek = noop_llseek,
+};
+
 static int my_camera_probe(struct platform_device *pdev)
 {
     int ret;
 	struct my_camera *mycam;
 	struct video_device *vdev;
-	struct vb2_queue *q;
 
 	cam_info("\n");
 
@@ -820,11 +2544,29 @@ static int my_camera_probe(struct platform_device *pdev)
 	// 初始化锁
 	mutex_init(&mycam->lock);
 
+	mycam->latency = alloc_percpu(struct mycam_latency);
+	if (!mycam->latency)
+		return -ENOMEM;
+
 	// 填充初始格式相关设置
-	mycam_fill_pix_format(mycam, &mycam->format);
+	mycam->multiplanar = multiplanar;
+	mycam->buf_type = multiplanar ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	mycam->shared = shared_stream;
+	INIT_LIST_HEAD(&mycam->clients);
+	INIT_LIST_HEAD(&mycam->streams);
+	mutex_init(&mycam->streams_lock);
+	mycam_apply_format(mycam, &my_formats[0], DEFAULT_WIDTH, DEFAULT_HEIGHT);
 	
+	// 初始化媒体设备，子设备和video节点注册时会把各自的实体加入其中
+	mycam->mdev.dev = &pdev->dev;
+	strscpy(mycam->mdev.model, "my_camera", sizeof(mycam->mdev.model));
+	snprintf(mycam->mdev.bus_info, sizeof(mycam->mdev.bus_info), "platform:%s", dev_name(&pdev->dev));
+	media_device_init(&mycam->mdev);
+
     // 注册 v4l2_device
     strscpy(mycam->v4l2_dev.name, "my_v4l2_device", sizeof(mycam->v4l2_dev.name));
+	mycam->v4l2_dev.notify = mycam_notify;
+	mycam->v4l2_dev.mdev = &mycam->mdev;
     ret = v4l2_device_register(&pdev->dev, &mycam->v4l2_dev);
     if (ret) {
         cam_err("Failed to register v4l2_device, ret=%d\n", ret);
@@ -839,27 +2581,17 @@ static int my_camera_probe(struct platform_device *pdev)
 		goto err_unregister_v4l2_dev;
 	}
 
-	// 初始化 vb2_queue
-	q = &mycam->queue;
-	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	q->io_modes = VB2_MMAP | VB2_DMABUF | VB2_READ;
-	q->dev = &pdev->dev;
-	q->drv_priv = mycam;
-	q->buf_struct_size = sizeof(struct mycam_buffer); // 很重要，__vb2_queue_alloc 中实际会按此大小分配内存
-	q->ops = &mycam_qops;
-	q->mem_ops = &vb2_dma_contig_memops;
-	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-	q->min_buffers_needed = 2;
-	q->lock = &mycam->lock;
-	q->gfp_flags = GFP_DMA32;
-	ret = vb2_queue_init(q);
+	// 初始化 vb2_queue，共享模式下它只用来承载节点级的格式，缓冲区在每个文件句柄自己的队列中
+	ret = mycam_queue_init(mycam, &mycam->main);
 	if (ret) {
 		cam_err("Failed to init vb2_queue, ret=%d\n", ret);
 		goto err_unregister_subdevs;
 	}
 
-	INIT_LIST_HEAD(&mycam->buf_list);
-	spin_lock_init(&mycam->qlock);
+	// 控制项：丢帧策略和丢帧计数
+	ret = mycam_init_controls(mycam);
+	if (ret)
+		goto err_release_vb2_queue;
 
     // 初始化 video_device 节点
     vdev = &mycam->vdev;
@@ -867,18 +2599,41 @@ static int my_camera_probe(struct platform_device *pdev)
 	vdev->release = video_device_release_empty;
     vdev->fops = &my_v4l2_fops;
 	vdev->ioctl_ops = &my_v4l2_ioctl_ops;
-	vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE | V4L2_CAP_STREAMING;
+	if (mycam->multiplanar)
+		vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_STREAMING;
+	else if (mycam->shared)
+		vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+	else
+		vdev->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE | V4L2_CAP_STREAMING;
     vdev->lock = &mycam->lock;	
-	vdev->queue = q;
+	// 共享模式下 vb2_fop_* 和 vb2_ioctl_* 都不能用，由各自的包装函数找到文件句柄的队列
+	vdev->queue = mycam->shared ? NULL : &mycam->main.queue;
+	vdev->ctrl_handler = &mycam->ctrl_handler;
+
+	// video节点的实体只有一个输入pad
+	mycam->pad.flags = MEDIA_PAD_FL_SINK;
+	vdev->entity.ops = &mycam_entity_ops;
+	ret = media_entity_pads_init(&vdev->entity, 1, &mycam->pad);
+	if (ret) {
+		cam_err("Failed to init video pad, ret=%d\n", ret);
+		goto err_free_ctrls;
+	}
 	vdev->v4l2_dev = &mycam->v4l2_dev;
 	video_set_drvdata(vdev, mycam);
     ret = video_register_device(vdev, VFL_TYPE_GRABBER, -1);
     if (ret) {
         cam_err("Failed to register video_device, ret=%d\n", ret);
-        goto err_release_vb2_queue;
+        goto err_free_ctrls;
     }
     cam_info("video_device registered: /dev/video%d\n", vdev->num);
 
+	// 在debugfs中导出各段延迟，目录以video节点编号命名
+	mycam->debugfs_dir = debugfs_create_dir(video_device_node_name(vdev), mycam_debugfs_root);
+	debugfs_create_file("latency", 0444, mycam->debugfs_dir, mycam, &mycam_latency_fops);
+	debugfs_create_file("latency_reset", 0200, mycam->debugfs_dir, mycam, &mycam_latency_reset_fops);
+	debugfs_create_file("stats", 0444, mycam->debugfs_dir, mycam, &mycam_stats_fops);
+	debugfs_create_file("pmu", 0444, mycam->debugfs_dir, mycam, &mycam_pmu_fops);
+
 	// 初始化异步通知链
 	ret = mycam_register_async_notifier(pdev);
 	if (ret) {
@@ -886,25 +2641,30 @@ static int my_camera_probe(struct platform_device *pdev)
 		goto err_cleanup_notifier;
 	}
 
-	g_mycam = mycam;
-
-	//my_csi_register_dma_cb(mycam_simulate_dma_transfer);
-	my_isp_register_dma_cb(mycam_simulate_dma_transfer);
-
 	cam_info("ok\n");
 
     return 0;
 
 err_cleanup_notifier:
 	v4l2_async_notifier_cleanup(&mycam->notifier);
+	debugfs_remove_recursive(mycam->debugfs_dir);
+err_free_ctrls:
+	v4l2_ctrl_handler_free(&mycam->ctrl_handler);
 err_release_vb2_queue:
-	vb2_queue_release(q);
+	vb2_queue_release(&mycam->main.queue);
 err_unregister_subdevs:
+	my_isp_register_dma_cb(mycam->isp_subdev, NULL, NULL);
+	my_isp_register_credit_cb(mycam->isp_subdev, NULL, NULL);
+	my_csi_register_dma_cb(mycam->csi_subdev, NULL, NULL);
+	my_csi_register_credit_cb(mycam->csi_subdev, NULL, NULL);
+	my_csi_set_consumer(mycam->csi_subdev, NULL);
 	v4l2_device_unregister_subdev(mycam->isp_subdev);
 	v4l2_device_unregister_subdev(mycam->csi_subdev);
 err_unregister_v4l2_dev:
 	v4l2_device_unregister(&mycam->v4l2_dev);
 err_exit:
+	media_device_cleanup(&mycam->mdev);
+	free_percpu(mycam->latency);
 	return ret;
 }
 
@@ -924,6 +2684,10 @@ static int my_camera_remove(struct platform_device *pdev)
 	v4l2_async_notifier_cleanup(&mycam->notifier);
 	cam_info("Unregistered and cleanup notifier\n");
 
+	media_device_unregister(&mycam->mdev);
+
+	debugfs_remove_recursive(mycam->debugfs_dir);
+
 	// 注销 video_device
 	if (video_is_registered(&mycam->vdev)) {
 		video_unregister_device(&mycam->vdev);
@@ -931,9 +2695,23 @@ static int my_camera_remove(struct platform_device *pdev)
 	}
 
 	// 释放 VB2 资源
-	vb2_queue_release(&mycam->queue);
+	vb2_queue_release(&mycam->main.queue);
+	mycam_ring_free(&mycam->main);
 	cam_info("Released vb2_queue\n");
 
+	v4l2_ctrl_handler_free(&mycam->ctrl_handler);
+
+	// 解除本路流水线的绑定
+	if (mycam->isp_subdev) {
+		my_isp_register_dma_cb(mycam->isp_subdev, NULL, NULL);
+		my_isp_register_credit_cb(mycam->isp_subdev, NULL, NULL);
+	}
+	if (mycam->csi_subdev) {
+		my_csi_register_dma_cb(mycam->csi_subdev, NULL, NULL);
+		my_csi_register_credit_cb(mycam->csi_subdev, NULL, NULL);
+		my_csi_set_consumer(mycam->csi_subdev, NULL);
+	}
+
 	if (mycam->isp_subdev) {
 		v4l2_device_unregister_subdev(mycam->isp_subdev);
 		cam_info("Unregistered isp_subdev\n");
@@ -948,7 +2726,9 @@ static int my_camera_remove(struct platform_device *pdev)
     v4l2_device_unregister(&mycam->v4l2_dev);
     cam_info("Unregistered v4l2_device: %s\n", mycam->v4l2_dev.name);
 
-	g_mycam = NULL;
+	media_device_cleanup(&mycam->mdev);
+	free_percpu(mycam->latency);
+	my_pmu_stage_release(&mycam->pmu_copy);
 
 	cam_info("ok\n");
 	
@@ -970,7 +2750,28 @@ static struct platform_driver my_camera_driver = {
     .remove = my_camera_remove,
 };
 
-module_platform_driver(my_camera_driver);
+// 各路的debugfs目录都放在 my_camera 下
+static int __init my_camera_init(void)
+{
+	int ret;
+
+	mycam_debugfs_root = debugfs_create_dir("my_camera", NULL);
+
+	ret = platform_driver_register(&my_camera_driver);
+	if (ret)
+		debugfs_remove_recursive(mycam_debugfs_root);
+
+	return ret;
+}
+
+static void __exit my_camera_exit(void)
+{
+	platform_driver_unregister(&my_camera_driver);
+	debugfs_remove_recursive(mycam_debugfs_root);
+}
+
+module_init(my_camera_init);
+module_exit(my_camera_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
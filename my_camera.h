@@ -1,6 +1,69 @@
 #ifndef __MY_CAMERA_H__
 #define __MY_CAMERA_H__
 
+/*
+ * video 节点的私有接口，驱动和用户程序共用，只能使用 uapi 类型。
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/videodev2.h>
 
-#endif /* __MY_CAMERA_H__ */
+/*
+ * 完成环：可选的共享内存出队/入队方式，省去每帧一对 DQBUF/QBUF。
+ *
+ * REQBUFS 并把缓冲区全部 QBUF 之后、STREAMON 之前用 MYCAM_IOC_RING_SETUP 打开，再以 MYCAM_RING_MMAP_OFFSET
+ * 映射一页共享内存（struct mycam_ring）。出流期间驱动把写好的缓冲区发布到完成队列（cq），不再交给vb2，
+ * DQBUF 取不到帧；用户处理完后把缓冲区编号写进提交队列（sq）归还，驱动在需要缓冲区时自己去取，不需要系统调用。
+ * poll() 在完成队列非空时返回 POLLIN。两个队列都是单生产者单消费者，head 由生产者、tail 由消费者推进，
+ * 都是自由增长的计数，下标取 % MYCAM_RING_ENTRIES；读对方推进的计数用 acquire，推进自己的计数用 release。
+ * 停流时所有缓冲区照常回到vb2，再次出流前需要重新 QBUF。
+ */
+#define MYCAM_RING_ENTRIES		32			// 不小于 VB2_MAX_FRAME，每个缓冲区同一时刻最多在队列中出现一次
+/*
+ * 完成环的映射偏移。vb2 从0开始依次为各缓冲区分配偏移，CREATE_BUFS 可以申请比 sizeimage 大得多的缓冲区，
+ * 32位以内的任何值都可能被缓冲区占到；v4l2_buffer.m.offset 只有32位，放在4GB处 vb2 永远够不着。
+ * 32位程序要用 mmap64（或 _FILE_OFFSET_BITS=64）映射。
+ */
+#define MYCAM_RING_MMAP_OFFSET	(1ULL << 32)
+
+#define MYCAM_RING_F_ERROR		0x00000001	// 缓冲区无效，本帧没有写入
+
+// 完成队列的一项
+struct mycam_ring_cqe {
+	__u32 index;				// vb2 缓冲区编号
+	__u32 sequence;				// 帧序号，同 v4l2_buffer.sequence
+	__u64 timestamp_ns;			// CLOCK_MONOTONIC，同 v4l2_buffer.timestamp
+	__u32 bytesused;			// 各平面数据量之和
+	__u32 flags;				// MYCAM_RING_F_*
+};
+
+struct mycam_ring {
+	__u32 cq_head;				// 驱动写
+	__u32 cq_tail;				// 用户写
+	__u32 reserved0[14];		// 两组计数分在不同的 cache line
+	__u32 sq_head;				// 用户写
+	__u32 sq_tail;				// 驱动写
+	__u32 reserved1[14];
+	struct mycam_ring_cqe cqes[MYCAM_RING_ENTRIES];
+	__u32 sqes[MYCAM_RING_ENTRIES];	// 归还的缓冲区编号
+};
 
+struct mycam_ring_setup {
+	__u32 enable;				// 输入：1 打开，0 关闭
+	__u32 entries;				// 输出：MYCAM_RING_ENTRIES
+	__u32 size;					// 输出：需要映射的长度
+	__u32 reserved;
+	__u64 mmap_offset;			// 输出：MYCAM_RING_MMAP_OFFSET
+};
+
+#define MYCAM_IOC_RING_SETUP	_IOWR('V', BASE_VIDIOC_PRIVATE + 0, struct mycam_ring_setup)
+
+/*
+ * 输出 fence：QBUF 时在 v4l2_buffer.flags 中带上本标志，驱动为这个缓冲区创建一个 sync_file，
+ * 返回时 fd 放在 v4l2_buffer.reserved2 中，flags 中保留本标志。缓冲区写完交还时 fence 发出信号，
+ * 消费者可以提前把工作挂在 fence 上，不必等 DQBUF；没有写入有效数据（出错、停流）时 fence 带错误状态。
+ * fd 由用户负责 close()。完成环打开时缓冲区不经过 QBUF，不支持本标志。
+ */
+#define MYCAM_BUF_FLAG_OUT_FENCE	0x00400000
+
+#endif /* __MY_CAMERA_H__ */
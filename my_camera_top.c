@@ -0,0 +1,492 @@
+/*
+ * my_camera_top：周期读取各模块 debugfs 中的统计，实时显示流水线的吞吐和队列深度，
+ * 也可以按 CSV 或 JSON（每行一个对象）记录下来，便于长时间运行后分析。
+ *
+ * 读取的文件（N 为实例编号，需要 root 并挂载 debugfs）：
+ *   /sys/kernel/debug/my_csi/csiN/stats
+ *   /sys/kernel/debug/my_isp/ispN/stats
+ *   /sys/kernel/debug/my_camera/videoN/stats
+ *   /sys/kernel/debug/my_camera/videoN/latency
+ * 某个文件不存在（如模块未加载、旁路ISP）时对应的列显示为 -，不影响其他列。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>  // 包含 strcasecmp
+#include <unistd.h>
+#include <errno.h>    // 包含 errno 宏
+#include <signal.h>   // 包含信号处理函数
+#include <time.h>     // 包含高精度时间函数
+
+#define DEBUGFS_ROOT	"/sys/kernel/debug"
+#define MAX_KEYS		32
+#define KEY_LEN			48
+
+// 与 my_camera.c 中 mycam_lat_names 的顺序一致
+static const char *lat_names[] = {
+	"sensor_to_csi", "csi_to_isp", "isp", "isp_to_vb2_done", "end_to_end",
+};
+#define LAT_NUM			(sizeof(lat_names) / sizeof(lat_names[0]))
+
+enum out_format {
+	OUT_NONE,
+	OUT_CSV,
+	OUT_JSON,
+};
+
+// 一个 stats 文件的内容，每行 "key: value"
+struct kv_file {
+	int valid;
+	int n;
+	char key[MAX_KEYS][KEY_LEN];
+	long long val[MAX_KEYS];
+};
+
+struct lat_stage {
+	int valid;
+	unsigned long long count, p50, p99, max, avg;
+};
+
+// 一次采样
+struct sample {
+	struct timespec ts;
+	struct kv_file csi;
+	struct kv_file isp;
+	struct kv_file cam;
+	struct lat_stage lat[LAT_NUM];
+};
+
+static volatile sig_atomic_t stop_flag = 0;
+
+static void signal_handler(int signo)
+{
+	(void)signo;
+	stop_flag = 1;
+}
+
+static int read_kv_file(const char *path, struct kv_file *f)
+{
+	char line[256];
+	FILE *fp;
+
+	memset(f, 0, sizeof(*f));
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (f->n < MAX_KEYS && fgets(line, sizeof(line), fp)) {
+		char *colon = strchr(line, ':');
+
+		if (!colon)
+			continue;
+		*colon = '\0';
+		snprintf(f->key[f->n], KEY_LEN, "%.*s", KEY_LEN - 1, line);
+		f->val[f->n] = strtoll(colon + 1, NULL, 10);
+		f->n++;
+	}
+
+	fclose(fp);
+	f->valid = 1;
+	return 0;
+}
+
+// 取一项的值，文件或该项不存在时返回 -1
+static long long kv_get(const struct kv_file *f, const char *key)
+{
+	int i;
+
+	if (!f->valid)
+		return -1;
+	for (i = 0; i < f->n; i++) {
+		if (!strcmp(f->key[i], key))
+			return f->val[i];
+	}
+	return -1;
+}
+
+// latency 文件每行：name: count=.. p50_ns=.. p99_ns=.. max_ns=.. avg_ns=..
+static int read_latency(const char *path, struct lat_stage *lat)
+{
+	char line[256], name[KEY_LEN];
+	struct lat_stage st;
+	unsigned int i;
+	FILE *fp;
+
+	memset(lat, 0, sizeof(*lat) * LAT_NUM);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		memset(&st, 0, sizeof(st));
+		if (sscanf(line, "%47[^:]: count=%llu p50_ns=%llu p99_ns=%llu max_ns=%llu avg_ns=%llu",
+				   name, &st.count, &st.p50, &st.p99, &st.max, &st.avg) != 6)
+			continue;
+		for (i = 0; i < LAT_NUM; i++) {
+			if (!strcmp(name, lat_names[i])) {
+				lat[i] = st;
+				lat[i].valid = 1;
+			}
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void take_sample(const char *root, int csi_id, int isp_id, int video_id, struct sample *s)
+{
+	char path[256];
+
+	clock_gettime(CLOCK_MONOTONIC, &s->ts);
+
+	snprintf(path, sizeof(path), "%s/my_csi/csi%d/stats", root, csi_id);
+	read_kv_file(path, &s->csi);
+	snprintf(path, sizeof(path), "%s/my_isp/isp%d/stats", root, isp_id);
+	read_kv_file(path, &s->isp);
+	snprintf(path, sizeof(path), "%s/my_camera/video%d/stats", root, video_id);
+	read_kv_file(path, &s->cam);
+	snprintf(path, sizeof(path), "%s/my_camera/video%d/latency", root, video_id);
+	read_latency(path, s->lat);
+}
+
+// 两次采样之间某个计数器的增量；出流时部分计数器会清零，变小时按清零处理，取当前值
+static long long kv_delta(const struct kv_file *cur, const struct kv_file *prev, const char *key)
+{
+	long long c = kv_get(cur, key);
+	long long p = kv_get(prev, key);
+
+	if (c < 0)
+		return -1;
+	if (p < 0 || c < p)
+		return c;
+	return c - p;
+}
+
+static double rate(long long delta, double dt)
+{
+	return (delta < 0 || dt <= 0) ? -1.0 : delta / dt;
+}
+
+// 一个区间的结果，-1 表示没有数据
+struct row {
+	double t;				// 距第一次采样的秒数
+	double sensor_fps;		// CSI 收到的帧起始
+	double csi_fps;			// CSI 写进 ring buffer
+	double isp_fps;			// ISP 处理
+	double done_fps;		// 交给 vb2
+	double dqbuf_fps;		// 用户取走
+	double drop_fps;		// ring 满 + 源头丢弃 + video 节点丢弃
+	double drop_pct;		// 丢帧占帧起始的比例
+	long long ring_occ;
+	long long ring_cap;
+	long long queued;		// 驱动手里等待填充的 vb2 缓冲区
+	long long qbuf;
+	long long dqbuf;
+	long long done;
+};
+
+static void compute_row(const struct sample *cur, const struct sample *prev, const struct sample *first,
+						struct row *r)
+{
+	double dt = (cur->ts.tv_sec - prev->ts.tv_sec) + (cur->ts.tv_nsec - prev->ts.tv_nsec) / 1e9;
+	long long signalled = kv_delta(&cur->csi, &prev->csi, "frames_signalled");
+	long long d1 = kv_delta(&cur->csi, &prev->csi, "frames_ring_full");
+	long long d2 = kv_delta(&cur->cam, &prev->cam, "frames_dropped_at_source");
+	long long d3 = kv_delta(&cur->cam, &prev->cam, "frames_dropped_at_sink");
+	long long drops = -1;
+
+	r->t = (cur->ts.tv_sec - first->ts.tv_sec) + (cur->ts.tv_nsec - first->ts.tv_nsec) / 1e9;
+	r->sensor_fps = rate(signalled, dt);
+	r->csi_fps    = rate(kv_delta(&cur->csi, &prev->csi, "frames_produced"), dt);
+	r->isp_fps    = rate(kv_delta(&cur->isp, &prev->isp, "frames_processed"), dt);
+	r->done_fps   = rate(kv_delta(&cur->cam, &prev->cam, "buffers_done"), dt);
+	r->dqbuf_fps  = rate(kv_delta(&cur->cam, &prev->cam, "dqbuf"), dt);
+
+	if (d1 >= 0 || d2 >= 0 || d3 >= 0)
+		drops = (d1 > 0 ? d1 : 0) + (d2 > 0 ? d2 : 0) + (d3 > 0 ? d3 : 0);
+	r->drop_fps = rate(drops, dt);
+	r->drop_pct = (drops >= 0 && signalled > 0) ? 100.0 * drops / signalled : -1.0;
+
+	r->ring_occ = kv_get(&cur->csi, "ring_occupancy");
+	r->ring_cap = kv_get(&cur->csi, "ring_capacity");
+	r->queued   = kv_get(&cur->cam, "buffers_queued");
+	r->qbuf     = kv_delta(&cur->cam, &prev->cam, "qbuf");
+	r->dqbuf    = kv_delta(&cur->cam, &prev->cam, "dqbuf");
+	r->done     = kv_delta(&cur->cam, &prev->cam, "buffers_done");
+}
+
+static void print_num(FILE *fp, double v, const char *fmt, int width)
+{
+	if (v < 0)
+		fprintf(fp, "%*s", width, "-");
+	else
+		fprintf(fp, fmt, width, v);
+}
+
+// 终端实时显示，每次刷新整屏
+static void show_live(const struct row *r, const struct sample *s, int csi_id, int isp_id, int video_id)
+{
+	unsigned int i;
+
+	printf("\033[H\033[2J");
+	printf("my_camera top    csi%d -> isp%d -> video%d    t=%.1fs    (Ctrl+C 退出)\n\n",
+		   csi_id, isp_id, video_id, r->t);
+
+	printf("%-14s%10s%10s%10s%10s%10s\n", "fps", "sensor", "csi", "isp", "vb2_done", "dqbuf");
+	printf("%-14s", "");
+	print_num(stdout, r->sensor_fps, "%*.1f", 10);
+	print_num(stdout, r->csi_fps, "%*.1f", 10);
+	print_num(stdout, r->isp_fps, "%*.1f", 10);
+	print_num(stdout, r->done_fps, "%*.1f", 10);
+	print_num(stdout, r->dqbuf_fps, "%*.1f", 10);
+	printf("\n\n");
+
+	printf("%-14s", "drops/s");
+	print_num(stdout, r->drop_fps, "%*.1f", 10);
+	printf("    (");
+	print_num(stdout, r->drop_pct, "%*.1f", 0);
+	printf("%%)\n");
+
+	printf("%-14s", "ring");
+	if (r->ring_occ < 0)
+		printf("%10s\n", "-");
+	else
+		printf("%6lld/%-3lld\n", r->ring_occ, r->ring_cap);
+
+	printf("%-14s", "vb2 queued");
+	print_num(stdout, r->queued, "%*.0f", 10);
+	printf("    qbuf ");
+	print_num(stdout, r->qbuf, "%*.0f", 0);
+	printf("  done ");
+	print_num(stdout, r->done, "%*.0f", 0);
+	printf("  dqbuf ");
+	print_num(stdout, r->dqbuf, "%*.0f", 0);
+	printf("  (本区间)\n\n");
+
+	printf("%-18s%12s%12s%12s%12s\n", "latency(us)", "samples", "p50", "p99", "max");
+	for (i = 0; i < LAT_NUM; i++) {
+		const struct lat_stage *l = &s->lat[i];
+
+		if (!l->valid) {
+			printf("%-18s%12s%12s%12s%12s\n", lat_names[i], "-", "-", "-", "-");
+			continue;
+		}
+		printf("%-18s%12llu%12.1f%12.1f%12.1f\n", lat_names[i], l->count,
+			   l->p50 / 1e3, l->p99 / 1e3, l->max / 1e3);
+	}
+	fflush(stdout);
+}
+
+static void log_header(FILE *fp, enum out_format fmt)
+{
+	unsigned int i;
+
+	if (fmt != OUT_CSV)
+		return;
+	fprintf(fp, "time_s,sensor_fps,csi_fps,isp_fps,vb2_done_fps,dqbuf_fps,drop_fps,drop_pct,"
+				"ring_occupancy,ring_capacity,vb2_queued,qbuf,buffers_done,dqbuf");
+	for (i = 0; i < LAT_NUM; i++)
+		fprintf(fp, ",%s_p50_ns,%s_p99_ns,%s_max_ns", lat_names[i], lat_names[i], lat_names[i]);
+	fprintf(fp, "\n");
+	fflush(fp);
+}
+
+// 没有数据的项：CSV 留空，JSON 写 null；prec 为小数位数，计数写0
+static void log_num(FILE *fp, enum out_format fmt, const char *key, double v, int prec, int first)
+{
+	if (fmt == OUT_CSV) {
+		if (!first)
+			fputc(',', fp);
+		if (v >= 0)
+			fprintf(fp, "%.*f", prec, v);
+	} else {
+		fprintf(fp, "%s\"%s\":", first ? "" : ",", key);
+		if (v >= 0)
+			fprintf(fp, "%.*f", prec, v);
+		else
+			fprintf(fp, "null");
+	}
+}
+
+static void log_row(FILE *fp, enum out_format fmt, const struct row *r, const struct sample *s)
+{
+	char key[KEY_LEN + 16];
+	unsigned int i;
+
+	if (fmt == OUT_JSON)
+		fputc('{', fp);
+
+	log_num(fp, fmt, "time_s", r->t, 3, 1);
+	log_num(fp, fmt, "sensor_fps", r->sensor_fps, 3, 0);
+	log_num(fp, fmt, "csi_fps", r->csi_fps, 3, 0);
+	log_num(fp, fmt, "isp_fps", r->isp_fps, 3, 0);
+	log_num(fp, fmt, "vb2_done_fps", r->done_fps, 3, 0);
+	log_num(fp, fmt, "dqbuf_fps", r->dqbuf_fps, 3, 0);
+	log_num(fp, fmt, "drop_fps", r->drop_fps, 3, 0);
+	log_num(fp, fmt, "drop_pct", r->drop_pct, 3, 0);
+	log_num(fp, fmt, "ring_occupancy", r->ring_occ, 0, 0);
+	log_num(fp, fmt, "ring_capacity", r->ring_cap, 0, 0);
+	log_num(fp, fmt, "vb2_queued", r->queued, 0, 0);
+	log_num(fp, fmt, "qbuf", r->qbuf, 0, 0);
+	log_num(fp, fmt, "buffers_done", r->done, 0, 0);
+	log_num(fp, fmt, "dqbuf", r->dqbuf, 0, 0);
+
+	for (i = 0; i < LAT_NUM; i++) {
+		const struct lat_stage *l = &s->lat[i];
+
+		snprintf(key, sizeof(key), "%s_p50_ns", lat_names[i]);
+		log_num(fp, fmt, key, l->valid ? (double)l->p50 : -1, 0, 0);
+		snprintf(key, sizeof(key), "%s_p99_ns", lat_names[i]);
+		log_num(fp, fmt, key, l->valid ? (double)l->p99 : -1, 0, 0);
+		snprintf(key, sizeof(key), "%s_max_ns", lat_names[i]);
+		log_num(fp, fmt, key, l->valid ? (double)l->max : -1, 0, 0);
+	}
+
+	if (fmt == OUT_JSON)
+		fputc('}', fp);
+	fputc('\n', fp);
+	fflush(fp);
+}
+
+static void usage(const char *prog)
+{
+	printf("用法: %s [选项]\n", prog);
+	printf("  -i ms      刷新间隔（毫秒），默认1000\n");
+	printf("  -n N       采样N个区间后退出，默认一直运行\n");
+	printf("  -c N       CSI 实例编号（csiN），默认0\n");
+	printf("  -p N       ISP 实例编号（ispN），默认与 -c 相同\n");
+	printf("  -v N       video 节点编号（videoN），默认与 -c 相同\n");
+	printf("  -o fmt     记录格式：csv 或 json（每行一个对象）\n");
+	printf("  -f file    记录写入文件，同时在终端实时显示；不指定时记录写到标准输出，不显示\n");
+	printf("  -r         开始前清零 video 节点的延迟直方图\n");
+	printf("  -d dir     debugfs 挂载点，默认 %s\n", DEBUGFS_ROOT);
+	printf("  -h         显示帮助\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *root = DEBUGFS_ROOT;
+	const char *log_path = NULL;
+	enum out_format fmt = OUT_NONE;
+	int interval_ms = 1000;
+	int iterations = 0;
+	int csi_id = 0, isp_id = -1, video_id = -1;
+	int reset_latency = 0;
+	int live = 1;
+	FILE *log_fp = NULL;
+	struct sample first, prev, cur;
+	struct row r;
+	char path[256];
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "i:n:c:p:v:o:f:rd:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'c':
+			csi_id = atoi(optarg);
+			break;
+		case 'p':
+			isp_id = atoi(optarg);
+			break;
+		case 'v':
+			video_id = atoi(optarg);
+			break;
+		case 'o':
+			if (!strcasecmp(optarg, "csv"))
+				fmt = OUT_CSV;
+			else if (!strcasecmp(optarg, "json"))
+				fmt = OUT_JSON;
+			else {
+				fprintf(stderr, "不支持的记录格式: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			log_path = optarg;
+			break;
+		case 'r':
+			reset_latency = 1;
+			break;
+		case 'd':
+			root = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (interval_ms <= 0) {
+		fprintf(stderr, "刷新间隔必须大于0\n");
+		return EXIT_FAILURE;
+	}
+	if (isp_id < 0)
+		isp_id = csi_id;
+	if (video_id < 0)
+		video_id = csi_id;
+
+	if (fmt != OUT_NONE) {
+		if (log_path) {
+			log_fp = fopen(log_path, "w");
+			if (!log_fp) {
+				perror("打开记录文件失败");
+				return EXIT_FAILURE;
+			}
+		} else {
+			log_fp = stdout;
+			live = 0;
+		}
+	}
+
+	if (reset_latency) {
+		FILE *fp;
+
+		snprintf(path, sizeof(path), "%s/my_camera/video%d/latency_reset", root, video_id);
+		fp = fopen(path, "w");
+		if (!fp || fputs("1\n", fp) < 0)
+			fprintf(stderr, "清零延迟直方图失败: %s\n", strerror(errno));
+		if (fp)
+			fclose(fp);
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	take_sample(root, csi_id, isp_id, video_id, &first);
+	if (!first.csi.valid && !first.isp.valid && !first.cam.valid) {
+		fprintf(stderr, "读不到 %s 下的统计文件，请确认已挂载 debugfs、模块已加载并以 root 运行\n", root);
+		if (log_fp && log_fp != stdout)
+			fclose(log_fp);
+		return EXIT_FAILURE;
+	}
+	prev = first;
+
+	if (log_fp)
+		log_header(log_fp, fmt);
+
+	for (n = 0; !stop_flag && (!iterations || n < iterations); n++) {
+		usleep(interval_ms * 1000);
+		if (stop_flag)
+			break;
+
+		take_sample(root, csi_id, isp_id, video_id, &cur);
+		compute_row(&cur, &prev, &first, &r);
+		if (live)
+			show_live(&r, &cur, csi_id, isp_id, video_id);
+		if (log_fp)
+			log_row(log_fp, fmt, &r, &cur);
+		prev = cur;
+	}
+
+	if (log_fp && log_fp != stdout)
+		fclose(log_fp);
+
+	return EXIT_SUCCESS;
+}
@@ -5,8 +5,14 @@
 #include <linux/export.h>
 #include <linux/kthread.h>
 #include <linux/dma-mapping.h>
+#include <linux/debugfs.h>
+#include <linux/idr.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
 #include <media/videobuf2-core.h>
 #include "my_csi.h"
+#include "my_isp.h"
+#include "my_stats.h"
 
 // 定义 TAG
 #define TAG "[my_csi_drv]: "
@@ -18,18 +24,13 @@
 #define csi_err(fmt, ...) \
     pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-#define FRAME_WIDTH			1280
-#define FRAME_HEIGHT		720
-#define FPS 				30
-#define BYTES_PER_PIX_YUYV	2
+// 每帧都会经过的路径只用 dynamic debug，默认不输出
+#define csi_dbg(fmt, ...) \
+    pr_debug(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-static struct wait_queue_head csi_wait_queue;
-static struct task_struct *csi_thread = NULL;
-static bool frame_ready = false;
-static struct my_csi *g_mycsi = NULL;
-
-extern void my_isp_sync_ring_buffer(struct my_ring_buffer *rb);
-extern void my_isp_wake_up_consumer(void);
+// 实例编号，用于区分各路流水线的线程名和debugfs目录
+static DEFINE_IDA(csi_ida);
+static struct dentry *csi_debugfs_root = NULL;
 
 // CSI 子设备的操作函数
 static int csi_s_power(struct v4l2_subdev *sd, int on)
@@ -38,12 +39,138 @@ static int csi_s_power(struct v4l2_subdev *sd, int on)
     return 0;
 }
 
+// 停流后ring buffer保留的时间，期间再次出流可以省去分配；0表示停流即释放，负数表示一直保留
+static int keep_warm_ms = 2000;
+module_param(keep_warm_ms, int, 0644);
+MODULE_PARM_DESC(keep_warm_ms, "Keep the ring buffer allocated for this long after stream off (ms, <0: forever)");
+
+// 出流时预先填充ring buffer，缩短出流到第一帧的时间
+static bool prefill = true;
+module_param(prefill, bool, 0644);
+MODULE_PARM_DESC(prefill, "Prefill the ring buffer on stream on (default: true)");
+
 static int csi_s_stream(struct v4l2_subdev *sd, int enable)
 {
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_csi *mycsi = platform_get_drvdata(pdev);
+	int ret;
+
     csi_info("CSI: s_stream called with enable=%d\n", enable);
+
+	// 取消尚未执行的释放，不能持锁等待，释放过程本身要拿锁
+	if (enable)
+		cancel_delayed_work_sync(&mycsi->release_work);
+
+	// 持锁可保证CSI线程当前没有在生产帧
+	mutex_lock(&mycsi->lock);
+
+	if (mycsi->streaming == !!enable) {
+		mutex_unlock(&mycsi->lock);
+		return 0;
+	}
+
+	// 按协商好的格式分配ring buffer，上次出流留下的同样大小的缓冲区直接复用
+	if (enable) {
+		ret = my_ring_buffer_alloc(&pdev->dev, &mycsi->rb);
+		if (ret) {
+			csi_err("Failed to alloc ring buffer, ret=%d\n", ret);
+			mutex_unlock(&mycsi->lock);
+			return ret;
+		}
+
+		// sensor 还没有开始出帧，提前生成图像，第一帧不用再等图像生成
+		if (prefill)
+			my_ring_buffer_prefill(&mycsi->rb);
+	}
+
+	// 丢弃上一次出流残留的帧起始和未读的帧，帧序号从0开始
+	atomic_set(&mycsi->frames_pending, 0);
+	atomic_set(&mycsi->frames_missed, 0);
+	my_ring_buffer_reset(&mycsi->rb);
+	mycsi->sequence  = 0;
+	mycsi->streaming = enable;
+
+	mutex_unlock(&mycsi->lock);
+
+	// 线程只在出流期间运行，停流后停放，空闲时没有任何唤醒。
+	// 停放要在锁外进行，线程可能正持锁生产帧
+	if (enable) {
+		kthread_unpark(mycsi->thread);
+	} else {
+		kthread_park(mycsi->thread);
+		if (keep_warm_ms >= 0)
+			schedule_delayed_work(&mycsi->release_work, msecs_to_jiffies(keep_warm_ms));
+	}
+
     return 0;
 }
 
+static int csi_get_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+					   struct v4l2_subdev_format *format)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_csi *mycsi = platform_get_drvdata(pdev);
+
+	if (format->pad >= CSI_PAD_NUM)
+		return -EINVAL;
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		format->format = *v4l2_subdev_get_try_format(sd, cfg, format->pad);
+		return 0;
+	}
+
+	// CSI不做格式转换，输入输出pad的格式相同
+	mutex_lock(&mycsi->lock);
+	format->format = mycsi->fmt;
+	mutex_unlock(&mycsi->lock);
+
+	return 0;
+}
+
+static int csi_set_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+					   struct v4l2_subdev_format *format)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_csi *mycsi = platform_get_drvdata(pdev);
+	struct v4l2_mbus_framefmt *mf = &format->format;
+	struct v4l2_pix_format pix;
+	int ret = 0;
+
+	if (format->pad >= CSI_PAD_NUM)
+		return -EINVAL;
+
+	// 输出pad的格式跟随输入pad，不能单独设置
+	if (format->pad == CSI_PAD_SOURCE)
+		return csi_get_fmt(sd, cfg, format);
+
+	my_adjust_mbus_format(mf);
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_format(sd, cfg, CSI_PAD_SINK) = *mf;
+		*v4l2_subdev_get_try_format(sd, cfg, CSI_PAD_SOURCE) = *mf;
+		return 0;
+	}
+
+	csi_info("CSI: set_fmt %ux%u, code=%#x\n", mf->width, mf->height, mf->code);
+
+	mutex_lock(&mycsi->lock);
+
+	if (mycsi->streaming) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	// 只记录新的帧格式，下一次出流时按新的帧大小分配ring buffer
+	my_mbus_to_pix_format(mf, &pix);
+	my_ring_buffer_set_format(&mycsi->rb, &pix);
+	mycsi->fmt = *mf;
+
+unlock:
+	mutex_unlock(&mycsi->lock);
+
+	return ret;
+}
+
 static const struct v4l2_subdev_core_ops csi_core_ops = {
     .s_power = csi_s_power,
 };
@@ -52,65 +179,259 @@ static const struct v4l2_subdev_video_ops csi_video_ops = {
     .s_stream = csi_s_stream,
 };
 
+static const struct v4l2_subdev_pad_ops csi_pad_ops = {
+    .get_fmt = csi_get_fmt,
+    .set_fmt = csi_set_fmt,
+};
+
+// 出流前由 media_pipeline_start 调用，检查 sensor 输出与 CSI 输入的格式一致
+static const struct media_entity_operations csi_entity_ops = {
+	.link_validate = v4l2_subdev_link_validate,
+};
+
 static const struct v4l2_subdev_ops csi_subdev_ops = {
     .core 	= &csi_core_ops,
     .video 	= &csi_video_ops,
+    .pad 	= &csi_pad_ops,
 };
 
-void notify_csi_frame_ready(void)
+// 处理积压帧的策略：默认只生成最新一帧并记录跳过的帧数，置1时逐帧补齐
+static bool catch_up = false;
+module_param(catch_up, bool, 0644);
+MODULE_PARM_DESC(catch_up, "Produce every pending frame instead of skipping coalesced ones (default: false)");
+
+// 由主设备转发sensor的帧起始通知，可能在hrtimer的硬中断上下文中被调用，只能做不会睡眠的操作
+void my_csi_frame_start(struct v4l2_subdev *sd, const struct my_sensor_frame_start *fs)
 {
-	frame_ready = true;
-	wake_up_interruptible(&csi_wait_queue);
+	struct my_csi *mycsi = to_my_csi(sd);
+
+	WRITE_ONCE(mycsi->frame_sof_ts, fs->sof_ts);
+	if (fs->missed)
+		atomic_add(fs->missed, &mycsi->frames_missed);
+	// atomic_inc_return 自带完整内存屏障，保证时间戳和错过的帧数先于计数可见
+	atomic_inc_return(&mycsi->frames_pending);
+	wake_up_interruptible(&mycsi->wait_queue);
 }
-EXPORT_SYMBOL(notify_csi_frame_ready);
+EXPORT_SYMBOL(my_csi_frame_start);
 
-void my_csi_register_dma_cb(void *cb)
+// 由主设备在绑定流水线时调用，把本CSI的ring buffer交给下游ISP，isp_sd 为 NULL 表示解除绑定
+void my_csi_set_consumer(struct v4l2_subdev *sd, struct v4l2_subdev *isp_sd)
 {
-	if (!g_mycsi || !cb) {
-		csi_err("Invlid pointer\n");
-	} else {
-		g_mycsi->post_to_dma_cb = cb;
-		csi_info("Registered post_to_dma_cb\n");
-	}
+	struct my_csi *mycsi = to_my_csi(sd);
+
+	mutex_lock(&mycsi->lock);
+	if (mycsi->isp_sd)
+		my_isp_set_ring_buffer(mycsi->isp_sd, NULL);
+	mycsi->isp_sd = isp_sd;
+	if (isp_sd)
+		my_isp_set_ring_buffer(isp_sd, &mycsi->rb);
+	mutex_unlock(&mycsi->lock);
+
+	csi_info("%s consumer %s\n", isp_sd ? "Bound" : "Unbound", isp_sd ? isp_sd->name : "");
+}
+EXPORT_SYMBOL(my_csi_set_consumer);
+
+void my_csi_register_dma_cb(struct v4l2_subdev *sd, void (*cb)(void *priv, struct my_frame *frame),
+							void *priv)
+{
+	struct my_csi *mycsi = to_my_csi(sd);
+
+	mutex_lock(&mycsi->lock);
+	mycsi->post_to_dma_cb = cb;
+	mycsi->cb_priv = priv;
+	mutex_unlock(&mycsi->lock);
+
+	csi_info("%s post_to_dma_cb\n", cb ? "Registered" : "Unregistered");
 }
 EXPORT_SYMBOL(my_csi_register_dma_cb);
 
+// 由主设备注册，cb 为 NULL 表示不做流控
+void my_csi_register_credit_cb(struct v4l2_subdev *sd, bool (*cb)(void *priv), void *priv)
+{
+	struct my_csi *mycsi = to_my_csi(sd);
+
+	mutex_lock(&mycsi->lock);
+	mycsi->credit_cb = cb;
+	mycsi->credit_priv = priv;
+	mutex_unlock(&mycsi->lock);
+}
+EXPORT_SYMBOL(my_csi_register_credit_cb);
+
+// 生成一帧并交给ISP，旁路ISP时直接交给主设备
+static void csi_produce_frame(struct my_csi *mycsi, u32 sequence, ktime_t sof_ts)
+{
+	struct my_frame *frame;
+	int ret;
+
+	// 下游已经没有空闲缓冲区，这一帧注定被丢弃，不再生成；帧序号照常占用
+	if (mycsi->credit_cb && !mycsi->credit_cb(mycsi->credit_priv)) {
+		mycsi->stats.no_credit++;
+		return;
+	}
+
+	ret = my_ring_buffer_write(&mycsi->rb, sequence, sof_ts);
+	if (ret) {
+		mycsi->stats.ring_full++;
+		return;
+	}
+	mycsi->stats.produced++;
+
+	if (mycsi->post_to_dma_cb) {
+		// 自己就是消费者，写入后立刻取出，不经过ISP线程
+		frame = my_ring_buffer_read(&mycsi->rb);
+		if (frame) {
+			frame->post_ts = ktime_get();
+			mycsi->post_to_dma_cb(mycsi->cb_priv, frame);
+		}
+	} else if (mycsi->isp_sd) {
+		my_isp_wake_up_consumer(mycsi->isp_sd);
+	}
+}
+
 static int csi_thread_fn(void *data)
 {
 	struct my_csi *mycsi = (struct my_csi *)data;
-	static u64 i = 0;
-	struct vb2_buffer *vb = NULL;
-	void *vaddr = NULL;
+	ktime_t sof_ts;
+	u32 first_seq;
+	int pending, missed;
 
-	if (!mycsi || !mycsi->fbuffer) {
+	if (!mycsi) {
 		csi_err("Invalid pointer\n");
 		return -EINVAL;
 	}
 	
 	while (!kthread_should_stop()) {
 
-		wait_event_interruptible_timeout(csi_wait_queue, 
-										 frame_ready || kthread_should_stop(), 
-										 msecs_to_jiffies(1000));
-		if (frame_ready) {
-			
-			csi_info("Frame is ready, id=%d\n", i);
-			
-			frame_ready = false;
+		// 停流时在这里停放，直到下一次出流
+		if (kthread_should_park()) {
+			kthread_parkme();
+			continue;
+		}
+
+		wait_event_interruptible(mycsi->wait_queue,
+								 atomic_read(&mycsi->frames_pending) ||
+								 kthread_should_park() || kthread_should_stop());
+
+		// 一次取走所有积压的帧起始，大于1说明CSI线程没赶上sensor的节拍
+		pending = atomic_xchg(&mycsi->frames_pending, 0);
+		if (!pending)
+			continue;
+		missed = atomic_xchg(&mycsi->frames_missed, 0);
+
+		csi_dbg("Frame is ready, pending=%d\n", pending);
 
-			my_ring_buffer_write(&mycsi->rb, NULL, (FRAME_WIDTH * FRAME_HEIGHT * BYTES_PER_PIX_YUYV));
+		// 统计从定时器到期到CSI开始处理的延迟（以最近一次帧起始为准）
+		sof_ts = READ_ONCE(mycsi->frame_sof_ts);
+		my_hist_record(&mycsi->sof_latency, ktime_to_ns(ktime_sub(ktime_get(), sof_ts)));
 
-			my_isp_wake_up_consumer();
-			
+		mutex_lock(&mycsi->lock);
+
+		if (!mycsi->streaming) {
+			mutex_unlock(&mycsi->lock);
+			continue;
+		}
+
+		// 每个帧起始占用一个帧序号，跳过的帧会在序号上留下空洞；sensor 错过的帧排在这些帧起始之前，同样只占序号
+		first_seq = mycsi->sequence + missed;
+		mycsi->sequence += missed + pending;
+
+		mycsi->stats.sensor_missed += missed;
+		mycsi->stats.signalled += pending;
+		if (pending > 1)
+			mycsi->stats.coalesced_events++;
+
+		if (catch_up) {
+			// 逐帧补齐，超出ring buffer容量的部分会计入ring_full
+			while (pending-- > 0 && !kthread_should_stop())
+				csi_produce_frame(mycsi, first_seq++, sof_ts);
+		} else {
+			// 只生成最新的一帧，其余的如实记录为跳过
+			mycsi->stats.skipped += pending - 1;
+			csi_produce_frame(mycsi, mycsi->sequence - 1, sof_ts);
 		}
+
+		mutex_unlock(&mycsi->lock);
 	}
 
 	return 0;
 }
 
+// 停流超过 keep_warm_ms 后释放ring buffer
+static void csi_release_work(struct work_struct *work)
+{
+	struct my_csi *mycsi = container_of(to_delayed_work(work), struct my_csi, release_work);
+
+	mutex_lock(&mycsi->lock);
+	if (!mycsi->streaming && mycsi->rb.alloc_size) {
+		// 重新绑定一次，借ISP的锁等它处理完手上的帧，之后ISP不会再访问这些缓冲区
+		if (mycsi->isp_sd)
+			my_isp_set_ring_buffer(mycsi->isp_sd, &mycsi->rb);
+		my_ring_buffer_free(&mycsi->pdev->dev, &mycsi->rb);
+		csi_info("Released ring buffer\n");
+	}
+	mutex_unlock(&mycsi->lock);
+}
+
+/*
+ * CSI ring buffer 当前占用的DMA内存：/sys/devices/platform/<csi节点>/ring_dma_bytes
+ * 只统计本CSI的ring buffer，不含主设备的 vb2 捕获缓冲区，那部分由 vb2 分配，CSI 看不到。
+ */
+static ssize_t ring_dma_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct my_csi *mycsi = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", my_ring_buffer_dma_bytes(&mycsi->rb));
+}
+static DEVICE_ATTR_RO(ring_dma_bytes);
+
+static int csi_stats_show(struct seq_file *s, void *unused)
+{
+	struct my_csi *mycsi = s->private;
+
+	seq_printf(s, "frames_signalled: %llu\n", READ_ONCE(mycsi->stats.signalled));
+	seq_printf(s, "frames_produced: %llu\n", READ_ONCE(mycsi->stats.produced));
+	seq_printf(s, "frames_skipped: %llu\n", READ_ONCE(mycsi->stats.skipped));
+	seq_printf(s, "frames_ring_full: %llu\n", READ_ONCE(mycsi->stats.ring_full));
+	seq_printf(s, "coalesced_events: %llu\n", READ_ONCE(mycsi->stats.coalesced_events));
+	seq_printf(s, "frames_no_credit: %llu\n", READ_ONCE(mycsi->stats.no_credit));
+	seq_printf(s, "frames_sensor_missed: %llu\n", READ_ONCE(mycsi->stats.sensor_missed));
+	seq_printf(s, "frames_pending: %d\n", atomic_read(&mycsi->frames_pending));
+	seq_printf(s, "ring_writes: %llu\n", READ_ONCE(mycsi->rb.stats.writes));
+	seq_printf(s, "ring_reads: %llu\n", READ_ONCE(mycsi->rb.stats.reads));
+	seq_printf(s, "ring_empty: %llu\n", READ_ONCE(mycsi->rb.stats.empty));
+	seq_printf(s, "ring_occupancy: %d\n", my_ring_buffer_count(&mycsi->rb));
+	seq_printf(s, "ring_capacity: %d\n", MAX_FRAMES - 1);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(csi_stats);
+
+static int csi_sof_latency_show(struct seq_file *s, void *unused)
+{
+	struct my_csi *mycsi = s->private;
+
+	my_hist_show(s, &mycsi->sof_latency);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(csi_sof_latency);
+
+static int csi_pmu_show(struct seq_file *s, void *unused)
+{
+	struct my_csi *mycsi = s->private;
+
+	my_pmu_stage_show(s, "fill", &mycsi->rb.pmu_fill);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(csi_pmu);
+
 static int my_csi_probe(struct platform_device *pdev)
 {
 	struct my_csi *mycsi;
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+	struct v4l2_pix_format pix;
+	char name[16];
 	int ret = 0;
 	
     csi_info("\n");
@@ -127,44 +448,74 @@ static int my_csi_probe(struct platform_device *pdev)
 	// 初始化 v4l2_subdev
     v4l2_subdev_init(&mycsi->sd, &csi_subdev_ops);
     mycsi->sd.owner = THIS_MODULE;
+    mycsi->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
     snprintf(mycsi->sd.name, sizeof(mycsi->sd.name), "my_csi_subdev");
+	mycsi->sd.entity.function = MEDIA_ENT_F_VID_IF_BRIDGE;
+	mycsi->sd.entity.ops = &csi_entity_ops;
+
+	// 初始化pad，0为输入、1为输出
+	mycsi->pads[CSI_PAD_SINK].flags   = MEDIA_PAD_FL_SINK;
+	mycsi->pads[CSI_PAD_SOURCE].flags = MEDIA_PAD_FL_SOURCE;
+	ret = media_entity_pads_init(&mycsi->sd.entity, CSI_PAD_NUM, mycsi->pads);
+	if (ret) {
+		csi_err("Failed to init pads, ret=%d\n", ret);
+		return ret;
+	}
 
 	// 将私有数据与subdev关联
 	v4l2_set_subdevdata(&mycsi->sd, pdev);
 
+	// 初始化锁和默认格式
+	mutex_init(&mycsi->lock);
+	my_default_mbus_format(&mycsi->fmt);
+	my_mbus_to_pix_format(&mycsi->fmt, &pix);
+
 	// 初始化等待队列
-    init_waitqueue_head(&csi_wait_queue);
-	
-	// 给fbuffer分配内存，使用DMA共享内存，YUV422，每像素占2Byte
-	mycsi->fbuffer = dma_alloc_coherent(&pdev->dev, (FRAME_WIDTH * FRAME_HEIGHT * BYTES_PER_PIX_YUYV), &mycsi->dma_handle, GFP_KERNEL);
-	if (!mycsi->fbuffer) {
-    	csi_err("Failed to allocate DMA buffer\n");
-    	return -ENOMEM;
-	}
-	csi_info("Allocate DMA buffer ok\n");
+    init_waitqueue_head(&mycsi->wait_queue);
+	atomic_set(&mycsi->frames_pending, 0);
+	atomic_set(&mycsi->frames_missed, 0);
 
-	// ring buffer 初始化
-	ret = my_ring_buffer_init(&pdev->dev, &mycsi->rb, (FRAME_WIDTH * FRAME_HEIGHT * BYTES_PER_PIX_YUYV));
-	if (ret) {
-    	csi_err("Failed to init ring buffer\n");
-    	return -ENOMEM;
-	}
-	csi_info("Inited ring buffer ok\n");
-	// 将 ring buffer 地址告诉 ISP
-	my_isp_sync_ring_buffer(&mycsi->rb);
-
-	// 启动内核线程
-    csi_thread = kthread_run(csi_thread_fn, mycsi, "csi_thread");
-    if (IS_ERR(csi_thread)) {
-        csi_err("Failed to start CSI thread\n");
-        return PTR_ERR(csi_thread);
+	mycsi->id = ida_alloc(&csi_ida, GFP_KERNEL);
+	if (mycsi->id < 0)
+		return mycsi->id;
+	
+	// ring buffer 只记录格式，出流时才分配，由主设备绑定给ISP
+	my_ring_buffer_init(&mycsi->rb, &pix);
+	INIT_DELAYED_WORK(&mycsi->release_work, csi_release_work);
+
+	// 创建内核线程，每个实例一个，出流时才开始运行
+    mycsi->thread = kthread_create(csi_thread_fn, mycsi, "csi_thread%d", mycsi->id);
+    if (IS_ERR(mycsi->thread)) {
+        csi_err("Failed to create CSI thread\n");
+        ret = PTR_ERR(mycsi->thread);
+		goto err_free_id;
     }
 
-	g_mycsi = mycsi;
+	// 帧起始由hrtimer直接唤醒，CSI线程使用实时优先级以减小唤醒延迟的抖动
+	sched_setscheduler_nocheck(mycsi->thread, SCHED_FIFO, &param);
+
+	// 新建的线程在进入线程函数之前就停放，由 s_stream 解除
+	kthread_park(mycsi->thread);
+
+	// 在debugfs中导出帧起始延迟直方图，每个实例一个目录
+	snprintf(name, sizeof(name), "csi%d", mycsi->id);
+	mycsi->debugfs_dir = debugfs_create_dir(name, csi_debugfs_root);
+	debugfs_create_file("frame_start_latency", 0444, mycsi->debugfs_dir, mycsi, &csi_sof_latency_fops);
+	debugfs_create_file("stats", 0444, mycsi->debugfs_dir, mycsi, &csi_stats_fops);
+	debugfs_create_file("pmu", 0444, mycsi->debugfs_dir, mycsi, &csi_pmu_fops);
+
+	// 在sysfs中导出DMA内存占用，失败不影响出流
+	ret = device_create_file(&pdev->dev, &dev_attr_ring_dma_bytes);
+	if (ret)
+		csi_err("Failed to create ring_dma_bytes, ret=%d\n", ret);
 	
 	csi_info("ok\n");
 	
     return 0;
+
+err_free_id:
+	ida_free(&csi_ida, mycsi->id);
+	return ret;
 }
 
 static int my_csi_remove(struct platform_device *pdev)
@@ -181,17 +532,21 @@ static int my_csi_remove(struct platform_device *pdev)
 	// 清理私有数据
 	v4l2_set_subdevdata(&mycsi->sd, NULL);
 
-	// 停掉内核线程
-	if (csi_thread) {
-        kthread_stop(csi_thread);
+	debugfs_remove_recursive(mycsi->debugfs_dir);
+
+	// 停掉内核线程，停放状态下也可以直接停止
+	if (mycsi->thread) {
+        kthread_stop(mycsi->thread);
         csi_info("CSI thread stopped\n");
     }
+	my_pmu_stage_release(&mycsi->rb.pmu_fill);
 	
-	// 手动释放dma内存
-	if (mycsi->fbuffer) {
-        dma_free_coherent(&pdev->dev, (FRAME_WIDTH * FRAME_HEIGHT * BYTES_PER_PIX_YUYV), mycsi->fbuffer, mycsi->dma_handle);
-        csi_info("DMA buffer freed\n");
-    }
+	// 手动释放dma内存，等待中的延迟释放先取消
+	device_remove_file(&pdev->dev, &dev_attr_ring_dma_bytes);
+	cancel_delayed_work_sync(&mycsi->release_work);
+	my_ring_buffer_free(&pdev->dev, &mycsi->rb);
+
+	ida_free(&csi_ida, mycsi->id);
 
 	csi_info("ok\n");
 	
@@ -213,7 +568,28 @@ static struct platform_driver my_csi_driver = {
     .remove = my_csi_remove,
 };
 
-module_platform_driver(my_csi_driver);
+// 各实例的debugfs目录都放在 my_csi 下
+static int __init my_csi_init(void)
+{
+	int ret;
+
+	csi_debugfs_root = debugfs_create_dir("my_csi", NULL);
+
+	ret = platform_driver_register(&my_csi_driver);
+	if (ret)
+		debugfs_remove_recursive(csi_debugfs_root);
+
+	return ret;
+}
+
+static void __exit my_csi_exit(void)
+{
+	platform_driver_unregister(&my_csi_driver);
+	debugfs_remove_recursive(csi_debugfs_root);
+}
+
+module_init(my_csi_init);
+module_exit(my_csi_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
@@ -1,19 +1,68 @@
 #ifndef __MY_CSI_H__
 #define __MY_CSI_H__
 
+#include <linux/workqueue.h>
 #include <media/v4l2-subdev.h>
 #include "my_ringbuffer.h"
+#include "my_sensor.h"
+#include "my_stats.h"
+
+// 帧计数统计，只由CSI线程写
+struct my_csi_stats {
+	u64 signalled;			// 收到的帧起始总数
+	u64 produced;			// 成功写入ring buffer的帧数
+	u64 skipped;			// 因帧起始合并而跳过的帧数
+	u64 ring_full;			// 因ring buffer满而丢弃的帧数
+	u64 coalesced_events;	// 一次唤醒处理了多个帧起始的次数
+	u64 no_credit;			// 下游没有空闲缓冲区而不生成的帧数
+	u64 sensor_missed;		// sensor 定时器滞后而没有发出帧起始的帧数，只占用帧序号
+};
+
+// pad编号
+enum {
+	CSI_PAD_SINK,					// 接sensor
+	CSI_PAD_SOURCE,					// 接ISP
+	CSI_PAD_NUM,
+};
 
 // 私有数据结构
 struct my_csi {
     struct platform_device *pdev;
     struct v4l2_subdev sd; 			// 子设备的 v4l2_subdev
+    struct media_pad pads[CSI_PAD_NUM];
     void *priv_data;       			// 其他私有数据（如寄存器基地址、硬件资源等）
-    u8 *fbuffer;					// 存放一帧数据
-    dma_addr_t dma_handle;			// 存放DMA物理地址
-    void (*post_to_dma_cb)(u8 *fbuffer, int len);
-	struct my_ring_buffer rb;		// ring buffer
+    int id;							// 实例编号
+    struct task_struct *thread;		// CSI处理线程
+    struct wait_queue_head wait_queue;	// 等待帧起始
+    atomic_t frames_pending;		// 已到达但CSI尚未处理的帧起始个数
+    atomic_t frames_missed;			// sensor 报告错过、CSI尚未计入帧序号的帧数
+    ktime_t frame_sof_ts;			// sensor帧起始时间，用于统计定时器到CSI开始处理的延迟
+    struct v4l2_subdev *isp_sd;		// 下游ISP，由主设备绑定
+    void (*post_to_dma_cb)(void *priv, struct my_frame *frame);
+    void *cb_priv;					// post_to_dma_cb 的私有数据
+    bool (*credit_cb)(void *priv);	// 下游是否还有空闲缓冲区，返回false时本帧在源头丢弃
+    void *credit_priv;				// credit_cb 的私有数据
+    struct dentry *debugfs_dir;
+	struct my_ring_buffer rb;		// ring buffer，出流时才分配
+	struct delayed_work release_work;	// 停流一段时间后释放ring buffer
+	struct mutex lock;				// 保护格式、出流状态和帧生产过程
+	struct v4l2_mbus_framefmt fmt;	// 当前格式，决定ring buffer中每帧的大小
+	bool streaming;					// 是否正在出流
+	u32 sequence;					// 下一个帧起始对应的帧序号
+	struct my_hist sof_latency;		// 定时器到期 -> CSI开始处理 的延迟直方图
+	struct my_csi_stats stats;		// 帧计数统计
 };
 
+static inline struct my_csi *to_my_csi(struct v4l2_subdev *sd)
+{
+	return container_of(sd, struct my_csi, sd);
+}
+
+void my_csi_frame_start(struct v4l2_subdev *sd, const struct my_sensor_frame_start *fs);
+void my_csi_set_consumer(struct v4l2_subdev *sd, struct v4l2_subdev *isp_sd);
+void my_csi_register_dma_cb(struct v4l2_subdev *sd, void (*cb)(void *priv, struct my_frame *frame),
+							void *priv);
+void my_csi_register_credit_cb(struct v4l2_subdev *sd, bool (*cb)(void *priv), void *priv);
+
 #endif /* __MY_CSI_H__ */
 
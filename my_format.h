@@ -0,0 +1,191 @@
+#ifndef __MY_FORMAT_H__
+#define __MY_FORMAT_H__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/videodev2.h>
+#include <media/v4l2-common.h>
+#include <media/v4l2-mediabus.h>
+
+// 默认图像格式
+#define DEFAULT_WIDTH		1280
+#define DEFAULT_HEIGHT		720
+
+// 分辨率范围，宽按16像素对齐、高按2行对齐（NV12的色度平面是半高）
+#define MIN_WIDTH			160
+#define MAX_WIDTH			3840
+#define MIN_HEIGHT			120
+#define MAX_HEIGHT			2160
+#define WIDTH_ALIGN			4		// log2(16)
+#define HEIGHT_ALIGN		1		// log2(2)
+
+// 一种像素格式在总线上和内存中的描述
+struct my_fmt_info {
+	u32 fourcc;				// V4L2_PIX_FMT_*
+	u32 code;				// MEDIA_BUS_FMT_*
+	u8 num_planes;			// 平面个数
+	u8 mem_planes;			// 内存平面个数，1表示所有平面在同一块缓冲区中连续存放
+	u8 bpp[2];				// 每个平面每像素占的字节数（水平方向）
+	u8 vsub[2];				// 每个平面的垂直下采样
+};
+
+static const struct my_fmt_info my_formats[] = {
+	{
+		.fourcc 	= V4L2_PIX_FMT_YUYV,
+		.code 		= MEDIA_BUS_FMT_YUYV8_2X8,
+		.num_planes = 1,
+		.mem_planes = 1,
+		.bpp 		= { 2 },
+		.vsub 		= { 1 },
+	}, {
+		.fourcc 	= V4L2_PIX_FMT_NV12,
+		.code 		= MEDIA_BUS_FMT_YUYV8_1_5X8,
+		.num_planes = 2,
+		.mem_planes = 1,
+		.bpp 		= { 1, 1 },		// Y平面；UV交织，两个像素共用一对UV
+		.vsub 		= { 1, 2 },
+	}, {
+		.fourcc 	= V4L2_PIX_FMT_GREY,
+		.code 		= MEDIA_BUS_FMT_Y8_1X8,
+		.num_planes = 1,
+		.mem_planes = 1,
+		.bpp 		= { 1 },
+		.vsub 		= { 1 },
+	}, {
+		// 总线上与NV12相同，Y和UV各占一块独立的缓冲区，只能通过多平面接口使用
+		.fourcc 	= V4L2_PIX_FMT_NV12M,
+		.code 		= MEDIA_BUS_FMT_YUYV8_1_5X8,
+		.num_planes = 2,
+		.mem_planes = 2,
+		.bpp 		= { 1, 1 },
+		.vsub 		= { 1, 2 },
+	},
+};
+
+static inline const struct my_fmt_info *my_fmt_by_index(unsigned int index)
+{
+	return index < ARRAY_SIZE(my_formats) ? &my_formats[index] : NULL;
+}
+
+static inline const struct my_fmt_info *my_fmt_by_fourcc(u32 fourcc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(my_formats); i++) {
+		if (my_formats[i].fourcc == fourcc)
+			return &my_formats[i];
+	}
+
+	return NULL;
+}
+
+static inline const struct my_fmt_info *my_fmt_by_code(u32 code)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(my_formats); i++) {
+		if (my_formats[i].code == code)
+			return &my_formats[i];
+	}
+
+	return NULL;
+}
+
+// 第 index 个不同的总线格式，内存布局不同但总线格式相同的只算一个
+static inline const struct my_fmt_info *my_fmt_by_code_index(unsigned int index)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(my_formats); i++) {
+		if (my_fmt_by_code(my_formats[i].code) != &my_formats[i])
+			continue;
+		if (index-- == 0)
+			return &my_formats[i];
+	}
+
+	return NULL;
+}
+
+// 第 plane 个平面的大小
+static inline u32 my_fmt_plane_size(const struct my_fmt_info *info, unsigned int plane, u32 width, u32 height)
+{
+	return width * info->bpp[plane] * (height / info->vsub[plane]);
+}
+
+// 按格式计算行宽和帧大小
+static inline void my_fill_pix_format(const struct my_fmt_info *info, u32 width, u32 height,
+									  struct v4l2_pix_format *pix)
+{
+	unsigned int p;
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width        = width;
+	pix->height       = height;
+	pix->pixelformat  = info->fourcc;
+	pix->field        = V4L2_FIELD_NONE;
+	pix->colorspace   = V4L2_COLORSPACE_SRGB;
+	pix->bytesperline = width * info->bpp[0];
+	for (p = 0; p < info->num_planes; p++)
+		pix->sizeimage += my_fmt_plane_size(info, p, width, height);
+}
+
+// 多平面接口下的帧格式，mem_planes 为1时所有平面放在同一块缓冲区中
+static inline void my_fill_pix_format_mplane(const struct my_fmt_info *info, u32 width, u32 height,
+											 struct v4l2_pix_format_mplane *pix_mp)
+{
+	unsigned int p;
+
+	memset(pix_mp, 0, sizeof(*pix_mp));
+	pix_mp->width       = width;
+	pix_mp->height      = height;
+	pix_mp->pixelformat = info->fourcc;
+	pix_mp->field       = V4L2_FIELD_NONE;
+	pix_mp->colorspace  = V4L2_COLORSPACE_SRGB;
+	pix_mp->num_planes  = info->mem_planes;
+
+	for (p = 0; p < info->num_planes; p++) {
+		struct v4l2_plane_pix_format *plane = &pix_mp->plane_fmt[info->mem_planes > 1 ? p : 0];
+
+		if (!plane->bytesperline)
+			plane->bytesperline = width * info->bpp[p];
+		plane->sizeimage += my_fmt_plane_size(info, p, width, height);
+	}
+}
+
+// 由媒体总线格式得到内存中的帧格式，各级按此分配缓冲区
+static inline void my_mbus_to_pix_format(const struct v4l2_mbus_framefmt *mf, struct v4l2_pix_format *pix)
+{
+	const struct my_fmt_info *info = my_fmt_by_code(mf->code);
+
+	my_fill_pix_format(info ? info : &my_formats[0], mf->width, mf->height, pix);
+}
+
+// 把请求的格式调整为支持的格式：不支持的编码换成默认编码，分辨率限幅并对齐
+static inline void my_adjust_mbus_format(struct v4l2_mbus_framefmt *mf)
+{
+	if (!my_fmt_by_code(mf->code))
+		mf->code = my_formats[0].code;
+
+	v4l_bound_align_image(&mf->width, MIN_WIDTH, MAX_WIDTH, WIDTH_ALIGN,
+						  &mf->height, MIN_HEIGHT, MAX_HEIGHT, HEIGHT_ALIGN, 0);
+
+	mf->field        = V4L2_FIELD_NONE;
+	mf->colorspace   = V4L2_COLORSPACE_SRGB;
+	mf->ycbcr_enc    = V4L2_YCBCR_ENC_DEFAULT;
+	mf->quantization = V4L2_QUANTIZATION_DEFAULT;
+	mf->xfer_func    = V4L2_XFER_FUNC_DEFAULT;
+}
+
+// 默认的媒体总线格式
+static inline void my_default_mbus_format(struct v4l2_mbus_framefmt *mf)
+{
+	memset(mf, 0, sizeof(*mf));
+	mf->width      = DEFAULT_WIDTH;
+	mf->height     = DEFAULT_HEIGHT;
+	mf->code       = MEDIA_BUS_FMT_YUYV8_2X8;
+	mf->field      = V4L2_FIELD_NONE;
+	mf->colorspace = V4L2_COLORSPACE_SRGB;
+}
+
+#endif /* __MY_FORMAT_H__ */
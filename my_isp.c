@@ -2,8 +2,12 @@
 #include <linux/platform_device.h>
 #include <linux/of.h>
 #include <linux/string.h>
-#include <linux/delay.h>
+#include <linux/kthread.h>
+#include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "my_isp.h"
+#include "my_trace.h"
 
 // 定义 TAG
 #define TAG "[my_isp_drv]: "
@@ -15,18 +19,16 @@
 #define isp_err(fmt, ...) \
     pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
+// 每帧都会经过的路径只用 dynamic debug，默认不输出；出错路径限速
 #define isp_dbg(fmt, ...) \
+    pr_debug(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-#define FRAME_WIDTH			1280
-#define FRAME_HEIGHT		720
-#define FPS 				30
-#define BYTES_PER_PIX_YUYV	2
-
-static struct task_struct *isp_thread = NULL;
-static struct my_ring_buffer *isp_rb = NULL;
-static wait_queue_head_t consumer_wq;
-static struct my_isp *g_myisp = NULL;
+#define isp_err_ratelimited(fmt, ...) \
+    pr_err_ratelimited(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
+// 实例编号，用于区分各路流水线的线程名和debugfs目录
+static DEFINE_IDA(isp_ida);
+static struct dentry *isp_debugfs_root = NULL;
 
 // ISP 子设备的操作函数
 static int isp_s_power(struct v4l2_subdev *sd, int on)
@@ -37,15 +39,85 @@ static int isp_s_power(struct v4l2_subdev *sd, int on)
 
 static int isp_s_stream(struct v4l2_subdev *sd, int enable)
 {
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_isp *myisp = platform_get_drvdata(pdev);
+
     isp_info("ISP: s_stream called with enable=%d\n", enable);
+
+	// 持锁可保证ISP线程当前没有在提交帧，停流后不再访问ring buffer中的数据
+	mutex_lock(&myisp->lock);
+	if (myisp->streaming == !!enable) {
+		mutex_unlock(&myisp->lock);
+		return 0;
+	}
+	myisp->streaming = enable;
+	myisp->divider_skip = 0;
+	mutex_unlock(&myisp->lock);
+
+	// 线程只在出流期间运行，停流后停放；旁路ISP时不会调用到这里，线程一直停放
+	if (enable)
+		kthread_unpark(myisp->thread);
+	else
+		kthread_park(myisp->thread);
+
     return 0;
 }
 
+static int isp_get_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+                       struct v4l2_subdev_format *format)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_isp *myisp = platform_get_drvdata(pdev);
+
+	if (format->pad >= ISP_PAD_NUM)
+		return -EINVAL;
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		format->format = *v4l2_subdev_get_try_format(sd, cfg, format->pad);
+		return 0;
+	}
+
+	// 目前ISP不做格式转换，输出与输入一致
+	mutex_lock(&myisp->lock);
+	format->format = myisp->fmt;
+	mutex_unlock(&myisp->lock);
+
+	return 0;
+}
+
 static int isp_set_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
                        struct v4l2_subdev_format *format)
 {
-    isp_info("ISP: set_fmt called\n");
-    return 0;
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_isp *myisp = platform_get_drvdata(pdev);
+	struct v4l2_mbus_framefmt *mf = &format->format;
+	int ret = 0;
+
+	if (format->pad >= ISP_PAD_NUM)
+		return -EINVAL;
+
+	// 输出pad的格式跟随输入pad，不能单独设置
+	if (format->pad == ISP_PAD_SOURCE)
+		return isp_get_fmt(sd, cfg, format);
+
+	my_adjust_mbus_format(mf);
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_format(sd, cfg, ISP_PAD_SINK) = *mf;
+		*v4l2_subdev_get_try_format(sd, cfg, ISP_PAD_SOURCE) = *mf;
+		return 0;
+	}
+
+    isp_info("ISP: set_fmt %ux%u, code=%#x\n", mf->width, mf->height, mf->code);
+
+	mutex_lock(&myisp->lock);
+	if (myisp->streaming)
+		ret = -EBUSY;
+	else
+		myisp->fmt = *mf;
+	mutex_unlock(&myisp->lock);
+
+    return ret;
 }
 
 static const struct v4l2_subdev_core_ops isp_core_ops = {
@@ -57,44 +129,90 @@ static const struct v4l2_subdev_video_ops isp_video_ops = {
 };
 
 static const struct v4l2_subdev_pad_ops isp_pad_ops = {
+    .get_fmt = isp_get_fmt,
     .set_fmt = isp_set_fmt,
 };
 
+// 出流前由 media_pipeline_start 调用，检查 CSI 输出与 ISP 输入的格式一致
+static const struct media_entity_operations isp_entity_ops = {
+	.link_validate = v4l2_subdev_link_validate,
+};
+
 static const struct v4l2_subdev_ops isp_subdev_ops = {
     .core 	= &isp_core_ops,
     .video 	= &isp_video_ops,
     .pad 	= &isp_pad_ops,
 };
 
-void my_isp_sync_ring_buffer(struct my_ring_buffer *rb)
+// 由主设备在绑定流水线时调用，rb 为 NULL 表示解除绑定
+void my_isp_set_ring_buffer(struct v4l2_subdev *sd, struct my_ring_buffer *rb)
 {
-	isp_rb = rb;
-	isp_dbg("isp_rb=%p\n", isp_rb);
+	struct my_isp *myisp = to_my_isp(sd);
+
+	// 持锁保证ISP线程当前没有在读旧的ring buffer
+	mutex_lock(&myisp->lock);
+	WRITE_ONCE(myisp->rb, rb);
+	mutex_unlock(&myisp->lock);
+	wake_up_interruptible(&myisp->consumer_wq);
+	isp_dbg("rb=%p\n", rb);
 }
-EXPORT_SYMBOL(my_isp_sync_ring_buffer);
+EXPORT_SYMBOL(my_isp_set_ring_buffer);
 
-void my_isp_wake_up_consumer(void)
+// CSI写入一帧后调用
+void my_isp_wake_up_consumer(struct v4l2_subdev *sd)
 {
-	wake_up_interruptible(&consumer_wq);
+	wake_up_interruptible(&to_my_isp(sd)->consumer_wq);
 }
 EXPORT_SYMBOL(my_isp_wake_up_consumer);
 
-void my_isp_register_dma_cb(void *cb)
+void my_isp_register_dma_cb(struct v4l2_subdev *sd, void (*cb)(void *priv, struct my_frame *frame),
+							void *priv)
 {
-	if (!g_myisp || !cb) {
-		isp_err("Invlid pointer\n");
-	} else {
-		g_myisp->post_to_dma_cb = cb;
-		isp_info("Registered post_to_dma_cb\n");
-	}
+	struct my_isp *myisp = to_my_isp(sd);
+
+	// 持锁保证ISP线程不会用到一半注册的回调
+	mutex_lock(&myisp->lock);
+	myisp->post_to_dma_cb = cb;
+	myisp->cb_priv = priv;
+	mutex_unlock(&myisp->lock);
+
+	isp_info("%s post_to_dma_cb\n", cb ? "Registered" : "Unregistered");
 }
 EXPORT_SYMBOL(my_isp_register_dma_cb);
 
+// 由主设备设置，divider 为1表示每一帧都处理
+void my_isp_set_frame_divider(struct v4l2_subdev *sd, u32 divider)
+{
+	struct my_isp *myisp = to_my_isp(sd);
+
+	WRITE_ONCE(myisp->frame_divider, max_t(u32, divider, 1));
+}
+EXPORT_SYMBOL(my_isp_set_frame_divider);
+
+// 由主设备注册，cb 为 NULL 表示不做流控
+void my_isp_register_credit_cb(struct v4l2_subdev *sd, bool (*cb)(void *priv), void *priv)
+{
+	struct my_isp *myisp = to_my_isp(sd);
+
+	mutex_lock(&myisp->lock);
+	myisp->credit_cb = cb;
+	myisp->credit_priv = priv;
+	mutex_unlock(&myisp->lock);
+}
+EXPORT_SYMBOL(my_isp_register_credit_cb);
+
+// ring buffer 已绑定且有数据
+static bool isp_frame_available(struct my_isp *myisp)
+{
+	struct my_ring_buffer *rb = READ_ONCE(myisp->rb);
+
+	return rb && !my_ring_buffer_empty_lock(rb);
+}
+
 static int isp_thread_fn(void *data)
 {
 	struct my_isp *myisp = (struct my_isp *)data;
-	void *frame_data;
-	int i = 0;
+	struct my_frame *frame;
 
 	if (!myisp) {
 		isp_err("Invalid pointer\n");
@@ -105,35 +223,67 @@ static int isp_thread_fn(void *data)
 	
 	while (!kthread_should_stop()) {
 
-		if (!isp_rb) {
-			isp_err("isp_rb is null\n");
-			msleep(10);
+		// 停流时在这里停放，直到下一次出流
+		if (kthread_should_park()) {
+			kthread_parkme();
 			continue;
 		}
 
 		// 阻塞等待，直到环形缓冲区有数据
-        wait_event_interruptible(consumer_wq, kthread_should_stop() || !my_ring_buffer_empty_lock(isp_rb));
+        wait_event_interruptible(myisp->consumer_wq, kthread_should_stop() || kthread_should_park() ||
+								 isp_frame_available(myisp));
 
-		if (kthread_should_stop())
+		if (kthread_should_stop() || kthread_should_park())
 			continue;
 		
-		// 调用 read 函数读取数据
-        frame_data = my_ring_buffer_read(isp_rb);
-        if (!frame_data) {
-            isp_err("Failed to read data from ring buffer.\n");
+		mutex_lock(&myisp->lock);
+
+		// 调用 read 函数读取数据，解除绑定后 rb 为 NULL
+		frame = myisp->rb ? my_ring_buffer_read(myisp->rb) : NULL;
+        if (!frame) {
+			mutex_unlock(&myisp->lock);
             continue; // 读取失败，继续下一次循环
         }
 
+		// 已停流，丢弃残留的帧
+		if (!myisp->streaming) {
+			myisp->stats.stale++;
+			mutex_unlock(&myisp->lock);
+			continue;
+		}
+
+		// 抽帧：不需要送给用户的帧不处理
+		if (my_frame_divider_skip(&myisp->divider_skip, READ_ONCE(myisp->frame_divider))) {
+			myisp->stats.divided++;
+			mutex_unlock(&myisp->lock);
+			continue;
+		}
+
+		// 下游已经没有空闲缓冲区，处理了也会被丢弃
+		if (myisp->credit_cb && !myisp->credit_cb(myisp->credit_priv)) {
+			myisp->stats.no_credit++;
+			mutex_unlock(&myisp->lock);
+			continue;
+		}
+
+		trace_my_isp_begin(myisp->id, frame->sequence, my_ring_buffer_index(myisp->rb, frame));
         // TODO: 处理数据
-        isp_info("Processing frame data...\n");
+        isp_dbg("Processing frame %u\n", frame->sequence);
+
+		trace_my_isp_end(myisp->id, frame->sequence, my_ring_buffer_index(myisp->rb, frame));
 
 		// TODO: 处理完成，提交给DMA
 		if (!myisp->post_to_dma_cb) {
-			isp_err("Invalid callback\n");
+			myisp->stats.no_callback++;
+			isp_err_ratelimited("Invalid callback\n");
 		} else {
-			myisp->post_to_dma_cb((u8 *)frame_data, (FRAME_WIDTH * FRAME_HEIGHT * BYTES_PER_PIX_YUYV));
+			frame->post_ts = ktime_get();
+			myisp->post_to_dma_cb(myisp->cb_priv, frame);
+			myisp->stats.processed++;
 		}
 
+		mutex_unlock(&myisp->lock);
+
 	}
 
 	isp_info("ISP thread exit\n");
@@ -141,9 +291,25 @@ static int isp_thread_fn(void *data)
 	return 0;
 }
 
+static int isp_stats_show(struct seq_file *s, void *unused)
+{
+	struct my_isp *myisp = s->private;
+
+	seq_printf(s, "frames_processed: %llu\n", READ_ONCE(myisp->stats.processed));
+	seq_printf(s, "frames_divided: %llu\n", READ_ONCE(myisp->stats.divided));
+	seq_printf(s, "frames_no_credit: %llu\n", READ_ONCE(myisp->stats.no_credit));
+	seq_printf(s, "frames_stale: %llu\n", READ_ONCE(myisp->stats.stale));
+	seq_printf(s, "frames_no_callback: %llu\n", READ_ONCE(myisp->stats.no_callback));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(isp_stats);
+
 static int my_isp_probe(struct platform_device *pdev)
 {
+	char name[16];
 	struct my_isp *myisp;
+	int ret;
 	
     isp_info("\n");
 
@@ -159,22 +325,54 @@ static int my_isp_probe(struct platform_device *pdev)
 	// 初始化 v4l2_subdev
 	v4l2_subdev_init(&myisp->sd, &isp_subdev_ops);
 	myisp->sd.owner = THIS_MODULE;
+	myisp->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
 	snprintf(myisp->sd.name, sizeof(myisp->sd.name), "my_isp_subdev");
+#ifdef MEDIA_ENT_F_PROC_VIDEO_ISP
+	myisp->sd.entity.function = MEDIA_ENT_F_PROC_VIDEO_ISP;
+#else
+	myisp->sd.entity.function = MEDIA_ENT_F_PROC_VIDEO_PIXEL_FORMATTER;
+#endif
+	myisp->sd.entity.ops = &isp_entity_ops;
+
+	// 初始化pad，0为输入、1为输出
+	myisp->pads[ISP_PAD_SINK].flags   = MEDIA_PAD_FL_SINK;
+	myisp->pads[ISP_PAD_SOURCE].flags = MEDIA_PAD_FL_SOURCE;
+	ret = media_entity_pads_init(&myisp->sd.entity, ISP_PAD_NUM, myisp->pads);
+	if (ret) {
+		isp_err("Failed to init pads, ret=%d\n", ret);
+		return ret;
+	}
 
 	// 将私有数据与subdev关联
 	v4l2_set_subdevdata(&myisp->sd, pdev);
 
-	// 启动内核线程
-    isp_thread = kthread_run(isp_thread_fn, myisp, "isp_thread");
-    if (IS_ERR(isp_thread)) {
-        isp_err("Failed to start ISP thread\n");
-        return PTR_ERR(isp_thread);
+	// 初始化锁和默认格式
+	mutex_init(&myisp->lock);
+	my_default_mbus_format(&myisp->fmt);
+	myisp->frame_divider = 1;
+
+	// 初始化消费者等待队列，必须在线程启动之前
+	init_waitqueue_head(&myisp->consumer_wq);
+
+	myisp->id = ida_alloc(&isp_ida, GFP_KERNEL);
+	if (myisp->id < 0)
+		return myisp->id;
+
+	// 创建内核线程，每个实例一个，出流时才开始运行
+    myisp->thread = kthread_create(isp_thread_fn, myisp, "isp_thread%d", myisp->id);
+    if (IS_ERR(myisp->thread)) {
+        isp_err("Failed to create ISP thread\n");
+		ida_free(&isp_ida, myisp->id);
+        return PTR_ERR(myisp->thread);
     }
 
-	// 初始化消费者等待队列
-	init_waitqueue_head(&consumer_wq);
+	// 新建的线程在进入线程函数之前就停放，由 s_stream 解除
+	kthread_park(myisp->thread);
 
-	g_myisp = myisp;
+	// 在debugfs中导出帧计数，每个实例一个目录
+	snprintf(name, sizeof(name), "isp%d", myisp->id);
+	myisp->debugfs_dir = debugfs_create_dir(name, isp_debugfs_root);
+	debugfs_create_file("stats", 0444, myisp->debugfs_dir, myisp, &isp_stats_fops);
 	
 	isp_info("ok\n");
 	
@@ -193,10 +391,12 @@ static int my_isp_remove(struct platform_device *pdev)
 	}
 
 	// 停掉内核线程
-	if (isp_thread) {
-		wake_up_interruptible(&consumer_wq);
-        kthread_stop(isp_thread);
+	if (myisp->thread) {
+		wake_up_interruptible(&myisp->consumer_wq);
+        kthread_stop(myisp->thread);
     }
+	ida_free(&isp_ida, myisp->id);
+	debugfs_remove_recursive(myisp->debugfs_dir);
 
 	// 清理私有数据
 	v4l2_set_subdevdata(&myisp->sd, NULL);
@@ -221,7 +421,28 @@ static struct platform_driver my_isp_driver = {
     .remove = my_isp_remove,
 };
 
-module_platform_driver(my_isp_driver);
+// 各实例的debugfs目录都放在 my_isp 下
+static int __init my_isp_init(void)
+{
+	int ret;
+
+	isp_debugfs_root = debugfs_create_dir("my_isp", NULL);
+
+	ret = platform_driver_register(&my_isp_driver);
+	if (ret)
+		debugfs_remove_recursive(isp_debugfs_root);
+
+	return ret;
+}
+
+static void __exit my_isp_exit(void)
+{
+	platform_driver_unregister(&my_isp_driver);
+	debugfs_remove_recursive(isp_debugfs_root);
+}
+
+module_init(my_isp_init);
+module_exit(my_isp_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
@@ -4,13 +4,56 @@
 #include <media/v4l2-subdev.h>
 #include "my_ringbuffer.h"
 
+// pad编号
+enum {
+	ISP_PAD_SINK,					// 接CSI
+	ISP_PAD_SOURCE,					// 接video设备
+	ISP_PAD_NUM,
+};
+
+// 帧计数统计，只由ISP线程在 lock 内更新
+struct my_isp_stats {
+	u64 processed;			// 处理完并交给 video 节点的帧数
+	u64 divided;			// 抽帧跳过的帧数
+	u64 no_credit;			// 下游没有空闲缓冲区而不处理的帧数
+	u64 stale;				// 停流后读到的残留帧数
+	u64 no_callback;		// 没有注册 post_to_dma_cb 而丢弃的帧数
+};
+
 // 私有数据结构
 struct my_isp {
     struct platform_device *pdev;
     struct v4l2_subdev sd; 			// 子设备的 v4l2_subdev
+    struct media_pad pads[ISP_PAD_NUM];
     void *priv_data;       			// 其他私有数据（如寄存器基地址、硬件资源等）
-    void (*post_to_dma_cb)(u8 *fbuffer, int len);
+    int id;							// 实例编号
+    struct task_struct *thread;		// ISP处理线程
+    struct my_ring_buffer *rb;		// 上游CSI的ring buffer，由主设备绑定
+    wait_queue_head_t consumer_wq;	// 等待ring buffer中有数据
+    void (*post_to_dma_cb)(void *priv, struct my_frame *frame);
+    void *cb_priv;					// post_to_dma_cb 的私有数据
+    bool (*credit_cb)(void *priv);	// 下游是否还有空闲缓冲区，返回false时本帧不处理直接丢弃
+    void *credit_priv;				// credit_cb 的私有数据
+    struct mutex lock;				// 保护格式、出流状态和帧提交过程
+    struct v4l2_mbus_framefmt fmt;	// 当前格式
+    bool streaming;					// 是否正在出流
+    u32 frame_divider;				// 每 frame_divider 个到达的帧处理一个，其余直接跳过
+    u32 divider_skip;				// 抽帧倒数，出流时清零，只由ISP线程访问
+    struct my_isp_stats stats;		// 帧计数统计
+    struct dentry *debugfs_dir;
 };
 
+static inline struct my_isp *to_my_isp(struct v4l2_subdev *sd)
+{
+	return container_of(sd, struct my_isp, sd);
+}
+
+void my_isp_set_ring_buffer(struct v4l2_subdev *sd, struct my_ring_buffer *rb);
+void my_isp_wake_up_consumer(struct v4l2_subdev *sd);
+void my_isp_register_dma_cb(struct v4l2_subdev *sd, void (*cb)(void *priv, struct my_frame *frame),
+							void *priv);
+void my_isp_set_frame_divider(struct v4l2_subdev *sd, u32 divider);
+void my_isp_register_credit_cb(struct v4l2_subdev *sd, bool (*cb)(void *priv), void *priv);
+
 #endif /* __MY_ISP_H__ */
 
@@ -0,0 +1,73 @@
+#ifndef __MY_PMU_H__
+#define __MY_PMU_H__
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+
+struct perf_event;
+struct task_struct;
+
+/*
+ * 按级统计每帧的 CPU 开销：在一级处理一帧的前后读取内核 perf 计数器，累加差值。
+ * 由 my_ringbuffer 的 pmu 模块参数打开，关闭时各级只多一条不跳转的nop。
+ * 实现在 my_ringbuffer.c 中。
+ */
+enum {
+	MY_PMU_CYCLES,
+	MY_PMU_INSTRUCTIONS,
+	MY_PMU_LLC_MISSES,
+	MY_PMU_NUM,
+};
+
+// 一级的计数器和累计值；同一时刻只有一个线程使用，计数器绑定在该线程上，换了线程（如切换旁路ISP）时重新创建
+struct my_pmu_stage {
+	struct task_struct *task;			// 计数器绑定的线程
+	struct perf_event *ev[MY_PMU_NUM];	// 创建失败（没有PMU或不支持该事件）时为 NULL
+	u64 frames;
+	u64 bytes;							// 处理的数据量，用于计算 bytes/cycle
+	u64 ns;
+	u64 val[MY_PMU_NUM];
+};
+
+// 一帧开始时的快照
+struct my_pmu_snap {
+	ktime_t ts;
+	u64 val[MY_PMU_NUM];
+};
+
+DECLARE_STATIC_KEY_FALSE(my_pmu_key);
+
+static inline bool my_pmu_enabled(void)
+{
+	return static_branch_unlikely(&my_pmu_key);
+}
+
+void my_pmu_stage_begin(struct my_pmu_stage *st, struct my_pmu_snap *snap);
+void my_pmu_stage_end(struct my_pmu_stage *st, const struct my_pmu_snap *snap, size_t bytes);
+// 释放计数器，累计值保留；调用时不能有线程在使用这一级
+void my_pmu_stage_release(struct my_pmu_stage *st);
+
+static inline void my_pmu_stage_show(struct seq_file *s, const char *name, const struct my_pmu_stage *st)
+{
+	u64 frames = READ_ONCE(st->frames);
+	u64 cycles = READ_ONCE(st->val[MY_PMU_CYCLES]);
+	u64 bytes  = READ_ONCE(st->bytes);
+
+	seq_printf(s, "%s: frames=%llu ns/frame=%llu cycles/frame=%llu instructions/frame=%llu llc_misses/frame=%llu",
+			   name, frames,
+			   frames ? div64_u64(READ_ONCE(st->ns), frames) : 0,
+			   frames ? div64_u64(cycles, frames) : 0,
+			   frames ? div64_u64(READ_ONCE(st->val[MY_PMU_INSTRUCTIONS]), frames) : 0,
+			   frames ? div64_u64(READ_ONCE(st->val[MY_PMU_LLC_MISSES]), frames) : 0);
+	// 没有浮点，bytes/cycle 保留三位小数
+	if (cycles)
+		seq_printf(s, " bytes/cycle=%llu.%03llu\n", div64_u64(bytes, cycles),
+				   div64_u64(bytes * 1000, cycles) % 1000);
+	else
+		seq_puts(s, " bytes/cycle=-\n");
+}
+
+#endif /* __MY_PMU_H__ */
@@ -1,6 +1,21 @@
 #include <linux/module.h>
 #include <linux/dma-mapping.h>
+#include <linux/string.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
 #include "my_ringbuffer.h"
+#include "my_pmu.h"
+
+// 流水线各级的 tracepoint 都在这里定义，其他模块都依赖本模块
+#define CREATE_TRACE_POINTS
+#include "my_trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_sensor_frame_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_isp_begin);
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_isp_end);
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_vb2_buf_done);
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_vb2_qbuf);
+EXPORT_TRACEPOINT_SYMBOL_GPL(my_vb2_dqbuf);
 
 // 定义 TAG
 #define TAG "[my_ring_buf]: "
@@ -12,51 +27,88 @@
 #define rbuf_err(fmt, ...) \
     pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-// 定义图像格式
-#define FRAME_WIDTH			1280
-#define FRAME_HEIGHT		720
-#define BYTES_PER_PIX_YUYV	2
+// 每帧都会经过的路径只用 dynamic debug，默认不输出
+#define rbuf_dbg(fmt, ...) \
+    pr_debug(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
 // 初始化环形缓冲区
-int my_ring_buffer_init(struct device *dev, struct my_ring_buffer *rb, size_t size)
+void my_ring_buffer_init(struct my_ring_buffer *rb, const struct v4l2_pix_format *fmt)
+{
+    if (!rb || !fmt) {
+		rbuf_err("Invalid pointer\n");
+        return;
+    }
+
+    memset(rb, 0, sizeof(*rb));
+    rb->fmt = *fmt;
+    spin_lock_init(&rb->lock);
+}
+EXPORT_SYMBOL(my_ring_buffer_init);
+
+// 修改帧格式
+void my_ring_buffer_set_format(struct my_ring_buffer *rb, const struct v4l2_pix_format *fmt)
 {
     int i;
 
-    if (!dev || !rb) {
+    if (!rb || !fmt) {
+		rbuf_err("Invalid pointer\n");
+        return;
+    }
+
+    rb->fmt = *fmt;
+    for (i = 0; i < MAX_FRAMES; i++)
+        rb->frames[i].prefilled = false;
+}
+EXPORT_SYMBOL(my_ring_buffer_set_format);
+
+// 分配环形缓冲区，大小由协商好的格式决定
+int my_ring_buffer_alloc(struct device *dev, struct my_ring_buffer *rb)
+{
+    u32 size;
+    int i;
+
+    if (!dev || !rb || !rb->fmt.sizeimage) {
 		rbuf_err("Invalid pointer\n");
         return -EINVAL;
     }
 
-    rb->write_idx = 0;
-    rb->read_idx = 0;
+    size = rb->fmt.sizeimage;
+    if (rb->alloc_size == size)
+        return 0;
+
+    // 格式变了，先释放按旧大小分配的缓冲区
+    my_ring_buffer_free(dev, rb);
 
-    // 分配 DMA 缓冲区
     for (i = 0; i < MAX_FRAMES; i++) {
-        rb->buffers[i] = dma_alloc_coherent(dev,
-                                            size,
-                                            &rb->dma_handles[i],
-                                            GFP_KERNEL);
-        if (!rb->buffers[i]) {
-            rbuf_err("Failed to allocate DMA buffer %d\n", i);
+        rb->frames[i].vaddr = dma_alloc_coherent(dev, size, &rb->frames[i].dma_handle, GFP_KERNEL);
+        if (!rb->frames[i].vaddr) {
+            rbuf_err("Failed to allocate DMA buffer %d, size=%u\n", i, size);
             goto err_alloc;
         }
+        rb->frames[i].len = size;
+        rb->frames[i].prefilled = false;
     }
 
-    spin_lock_init(&rb->lock);
+    rb->write_idx = 0;
+    rb->read_idx = 0;
+    WRITE_ONCE(rb->alloc_size, size);
+
+    rbuf_info("%ux%u, size=%u\n", rb->fmt.width, rb->fmt.height, size);
 
     return 0;
 
 err_alloc:
     for (i--; i >= 0; i--) {
-        dma_free_coherent(dev, size, rb->buffers[i], rb->dma_handles[i]);
+        dma_free_coherent(dev, size, rb->frames[i].vaddr, rb->frames[i].dma_handle);
+        rb->frames[i].vaddr = NULL;
 		rbuf_err("Free DMA buffer %d\n", i);
     }
     return -ENOMEM;
 }
-EXPORT_SYMBOL(my_ring_buffer_init);
+EXPORT_SYMBOL(my_ring_buffer_alloc);
 
 // 释放环形缓冲区
-void my_ring_buffer_free(struct device *dev, struct my_ring_buffer *rb, size_t size)
+void my_ring_buffer_free(struct device *dev, struct my_ring_buffer *rb)
 {
     int i;
 
@@ -66,14 +118,30 @@ void my_ring_buffer_free(struct device *dev, struct my_ring_buffer *rb, size_t s
     }
 
     for (i = 0; i < MAX_FRAMES; i++) {
-        if (rb->buffers[i]) {
-            dma_free_coherent(dev, size, rb->buffers[i], rb->dma_handles[i]);
+        if (rb->frames[i].vaddr) {
+            dma_free_coherent(dev, rb->alloc_size, rb->frames[i].vaddr, rb->frames[i].dma_handle);
+            rb->frames[i].vaddr = NULL;
 			rbuf_info("Free DMA buffer %d\n", i);
         }
     }
+    WRITE_ONCE(rb->alloc_size, 0);
 }
 EXPORT_SYMBOL(my_ring_buffer_free);
 
+// 清空环形缓冲区中未读的帧
+void my_ring_buffer_reset(struct my_ring_buffer *rb)
+{
+	if (!rb) {
+		rbuf_err("Invalid pointer\n");
+		return;
+	}
+
+	spin_lock(&rb->lock);
+	rb->read_idx = rb->write_idx;
+	spin_unlock(&rb->lock);
+}
+EXPORT_SYMBOL(my_ring_buffer_reset);
+
 // 带锁的，给外部用
 bool my_ring_buffer_empty_lock(struct my_ring_buffer *rb)
 {
@@ -115,14 +183,17 @@ static bool my_ring_buffer_full(struct my_ring_buffer *rb)
     return is_full;
 }
 
-// 生成一帧 YUV422 数据（YUYV 排布）
-static void generate_one_frame_yuyv(uint8_t *buffer)
+// 生成一帧纯色图像，按格式分别填充：YUYV、NV12（Y平面 + UV交织平面）、GREY
+static void generate_one_frame(struct my_ring_buffer *rb, uint8_t *buffer)
 {	
-	int c, r;
+	const struct v4l2_pix_format *fmt = &rb->fmt;
+	u32 r;
 	u8 Y, U, V;
-	static u64 i = 0;
+	u32 pattern;
+	u8 *uv;
 
-	switch (i++ % 9) {
+	// 颜色序列按实例各自推进，多个CSI同时出流时互不影响
+	switch (rb->pattern++ % 9) {
 		case 0:
 			Y=235; U=128; V=128; break;	// white
 		case 1:
@@ -143,44 +214,111 @@ static void generate_one_frame_yuyv(uint8_t *buffer)
 			Y=16; U=128; V=128; break;	// black
 	}
 
-	for (r = 0; r < FRAME_HEIGHT; r++) {
-        for (c = 0; c < FRAME_WIDTH; c += 2) {
-            buffer[r * FRAME_WIDTH * 2 + c * 2] = Y;     // Y0
-            buffer[r * FRAME_WIDTH * 2 + c * 2 + 2] = Y; // Y1
-            buffer[r * FRAME_WIDTH * 2 + c * 2 + 1] = U; // U
-            buffer[r * FRAME_WIDTH * 2 + c * 2 + 3] = V; // V
-        }
+	switch (fmt->pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+		// Y平面之后紧跟半高的UV交织平面，行宽相同
+		memset(buffer, Y, fmt->bytesperline * fmt->height);
+		uv = buffer + fmt->bytesperline * fmt->height;
+		memset16((u16 *)uv, (__force u16)cpu_to_le16(U | (V << 8)), fmt->bytesperline * fmt->height / 2 / 2);
+		break;
+
+	case V4L2_PIX_FMT_GREY:
+		memset(buffer, Y, fmt->bytesperline * fmt->height);
+		break;
+
+	case V4L2_PIX_FMT_YUYV:
+	default:
+		// 两个像素 Y0 U Y1 V 正好是一个32位字，按字填充，4K下比逐字节写快得多
+		pattern = (__force u32)cpu_to_le32(Y | (U << 8) | (Y << 16) | ((u32)V << 24));
+
+		if (fmt->bytesperline == fmt->width * 2) {
+			memset32((u32 *)buffer, pattern, fmt->sizeimage / 4);
+			break;
+		}
+
+		// 行尾有填充时逐行填充
+		for (r = 0; r < fmt->height; r++)
+			memset32((u32 *)(buffer + r * fmt->bytesperline), pattern, fmt->width / 2);
+		break;
+	}
+}
+
+// 预先填充，只能在生产者未运行时调用
+void my_ring_buffer_prefill(struct my_ring_buffer *rb)
+{
+    int i;
+
+    if (!rb || !rb->alloc_size) {
+		rbuf_err("Invalid pointer\n");
+        return;
     }
 
+    for (i = 0; i < MAX_FRAMES; i++) {
+        if (rb->frames[i].prefilled)
+            continue;
+        generate_one_frame(rb, rb->frames[i].vaddr);
+        rb->frames[i].prefilled = true;
+    }
 }
+EXPORT_SYMBOL(my_ring_buffer_prefill);
 
 // 向环形缓冲区写入数据
-int my_ring_buffer_write(struct my_ring_buffer *rb, void *frame_data, size_t size)
+int my_ring_buffer_write(struct my_ring_buffer *rb, u32 sequence, ktime_t sof_ts)
 {
+    struct my_frame *frame;
+
     if (!rb) {
         rbuf_err("Invalid pointer\n");
         return -EINVAL;
     }
 
+	// 缓冲区还没有分配
+	if (!rb->alloc_size)
+		return -ENOMEM;
+
 	spin_lock(&rb->lock);
 	
     if (my_ring_buffer_full(rb)) {
 		// 缓冲区已满，不等空buffer，会阻塞生产者线程，直接丢弃当前帧
-		rbuf_err("Ring buffer is full, dropping frame...\n");
+		rb->stats.full++;
         spin_unlock(&rb->lock);
+		rbuf_dbg("Ring buffer is full, dropping frame %u\n", sequence);
         return -ENOBUFS;
 	}
 
-    rbuf_info("write_idx=%d\n", rb->write_idx);
+    rbuf_dbg("write_idx=%d\n", rb->write_idx);
+
+    // 只有一个生产者，写指针所指的空闲缓冲区在提交前不会被读者访问，
+    // 填充过程放在锁外，避免高分辨率下长时间持有自旋锁
+    frame = &rb->frames[rb->write_idx];
+    spin_unlock(&rb->lock);
+
+    frame->csi_ts = ktime_get();
 
     // TODO: 使用DMA将CSI输出的数据传输到缓冲区
     
-    // 没有实际硬件，使用模拟的数据填充缓冲区
-    generate_one_frame_yuyv(rb->buffers[rb->write_idx]);
-	
+    // 没有实际硬件，使用模拟的数据填充缓冲区，已预先填充的直接使用
+    if (!frame->prefilled) {
+        struct my_pmu_snap snap;
+        bool pmu = my_pmu_enabled();
+
+        if (pmu)
+            my_pmu_stage_begin(&rb->pmu_fill, &snap);
+        generate_one_frame(rb, frame->vaddr);
+        if (pmu)
+            my_pmu_stage_end(&rb->pmu_fill, &snap, rb->fmt.sizeimage);
+    }
+    frame->prefilled = false;
+    frame->len      = rb->fmt.sizeimage;
+    frame->sequence = sequence;
+    frame->sof_ts   = sof_ts;
+
+    // 提交
+    frame->write_ts = ktime_get();
+    spin_lock(&rb->lock);
+    trace_my_ring_write(rb, sequence, rb->write_idx);
     rb->write_idx = (rb->write_idx + 1) % MAX_FRAMES;
-
-    // 手动释放锁
+    rb->stats.writes++;
     spin_unlock(&rb->lock);
 
     return 0;
@@ -188,9 +326,9 @@ int my_ring_buffer_write(struct my_ring_buffer *rb, void *frame_data, size_t siz
 EXPORT_SYMBOL(my_ring_buffer_write);
 
 // 从环形缓冲区读取数据
-void *my_ring_buffer_read(struct my_ring_buffer *rb)
+struct my_frame *my_ring_buffer_read(struct my_ring_buffer *rb)
 {
-    void *frame_data;
+    struct my_frame *frame;
 
     if (!rb) {
         rbuf_err("Invalid pointer\n");
@@ -201,24 +339,145 @@ void *my_ring_buffer_read(struct my_ring_buffer *rb)
 
     if (my_ring_buffer_empty(rb)) {
 		// 缓冲区空
-		rbuf_err("Ring buffer is empty\n");
+		rb->stats.empty++;
         spin_unlock(&rb->lock);
+		rbuf_dbg("Ring buffer is empty\n");
         return NULL;
 	}
 
-    rbuf_info("read_idx=%d\n", rb->read_idx);
+    rbuf_dbg("read_idx=%d\n", rb->read_idx);
 
     // 从缓冲区中读取数据
-    frame_data = rb->buffers[rb->read_idx];
+    frame = &rb->frames[rb->read_idx];
+    frame->read_ts = ktime_get();
+    trace_my_ring_read(rb, frame->sequence, rb->read_idx);
     rb->read_idx = (rb->read_idx + 1) % MAX_FRAMES;
+    rb->stats.reads++;
 
     // 手动释放锁
     spin_unlock(&rb->lock);
 
-    return frame_data;
+    return frame;
 }
 EXPORT_SYMBOL(my_ring_buffer_read);
 
+/*
+ * PMU 计数
+ */
+DEFINE_STATIC_KEY_FALSE(my_pmu_key);
+EXPORT_SYMBOL_GPL(my_pmu_key);
+
+static const u64 my_pmu_configs[MY_PMU_NUM] = {
+	[MY_PMU_CYCLES] 		= PERF_COUNT_HW_CPU_CYCLES,
+	[MY_PMU_INSTRUCTIONS] 	= PERF_COUNT_HW_INSTRUCTIONS,
+	[MY_PMU_LLC_MISSES] 	= PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int my_pmu_set(const char *val, const struct kernel_param *kp)
+{
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(val, &enable);
+	if (ret)
+		return ret;
+
+	if (enable)
+		static_branch_enable(&my_pmu_key);
+	else
+		static_branch_disable(&my_pmu_key);
+
+	return 0;
+}
+
+static int my_pmu_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%c\n", my_pmu_enabled() ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops my_pmu_param_ops = {
+	.set = my_pmu_set,
+	.get = my_pmu_get,
+};
+
+// 打开后各级在处理每一帧前后读取 perf 计数器，结果在各自的 debugfs pmu 文件中
+module_param_cb(pmu, &my_pmu_param_ops, NULL, 0644);
+MODULE_PARM_DESC(pmu, "Sample cycles/instructions/LLC misses around each pipeline stage (default: N)");
+
+void my_pmu_stage_release(struct my_pmu_stage *st)
+{
+	int i;
+
+	for (i = 0; i < MY_PMU_NUM; i++) {
+		if (st->ev[i])
+			perf_event_release_kernel(st->ev[i]);
+		st->ev[i] = NULL;
+	}
+	st->task = NULL;
+}
+EXPORT_SYMBOL(my_pmu_stage_release);
+
+// 计数器只统计绑定的线程，第一次使用或换了线程时在当前线程上创建
+static void my_pmu_stage_bind(struct my_pmu_stage *st)
+{
+	struct perf_event_attr attr = {
+		.type   = PERF_TYPE_HARDWARE,
+		.size   = sizeof(attr),
+		.pinned = 1,
+	};
+	struct perf_event *ev;
+	int i;
+
+	my_pmu_stage_release(st);
+	st->task = current;
+
+	for (i = 0; i < MY_PMU_NUM; i++) {
+		attr.config = my_pmu_configs[i];
+		ev = perf_event_create_kernel_counter(&attr, -1, current, NULL, NULL);
+		if (IS_ERR(ev)) {
+			// 不再重试，这一项保持为0
+			rbuf_err("Failed to create counter %llu for %s, ret=%ld\n", attr.config, current->comm, PTR_ERR(ev));
+			continue;
+		}
+		st->ev[i] = ev;
+	}
+}
+
+static void my_pmu_read(struct my_pmu_stage *st, u64 *val)
+{
+	u64 enabled, running;
+	int i;
+
+	for (i = 0; i < MY_PMU_NUM; i++)
+		val[i] = st->ev[i] ? perf_event_read_value(st->ev[i], &enabled, &running) : 0;
+}
+
+void my_pmu_stage_begin(struct my_pmu_stage *st, struct my_pmu_snap *snap)
+{
+	if (st->task != current)
+		my_pmu_stage_bind(st);
+
+	my_pmu_read(st, snap->val);
+	snap->ts = ktime_get();
+}
+EXPORT_SYMBOL(my_pmu_stage_begin);
+
+void my_pmu_stage_end(struct my_pmu_stage *st, const struct my_pmu_snap *snap, size_t bytes)
+{
+	ktime_t now = ktime_get();
+	u64 val[MY_PMU_NUM];
+	int i;
+
+	my_pmu_read(st, val);
+
+	for (i = 0; i < MY_PMU_NUM; i++)
+		WRITE_ONCE(st->val[i], st->val[i] + val[i] - snap->val[i]);
+	WRITE_ONCE(st->ns, st->ns + ktime_to_ns(ktime_sub(now, snap->ts)));
+	WRITE_ONCE(st->bytes, st->bytes + bytes);
+	WRITE_ONCE(st->frames, st->frames + 1);
+}
+EXPORT_SYMBOL(my_pmu_stage_end);
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("My Ringbuffer Module");
@@ -2,35 +2,111 @@
 #define __MY_RINGBUFFER_H__
 
 #include <linux/types.h>
+#include <linux/ktime.h>
 #include <linux/spinlock_types.h>
 #include <linux/wait.h>
 #include <linux/device.h>
+#include <linux/videodev2.h>
+#include "my_format.h"
+#include "my_pmu.h"
 
 // 环形缓冲区的最大帧数
 #define MAX_FRAMES 			3
 
+// 环形缓冲区中的一帧，读出后随帧数据一起在流水线中传递
+struct my_frame {
+    void *vaddr;                    	// 帧数据虚拟地址
+    dma_addr_t dma_handle;          	// 帧数据物理地址
+    size_t len;                     	// 有效数据长度
+    u32 sequence;                   	// 帧序号，跳过/丢弃的帧同样占用序号
+    ktime_t sof_ts;                 	// 帧起始时间
+    ktime_t csi_ts;                 	// CSI 开始写入这一帧的时间
+    ktime_t write_ts;               	// 写入完成、提交到 ring buffer 的时间
+    ktime_t read_ts;                	// 消费者从 ring buffer 取出的时间
+    ktime_t post_ts;                	// 交给 video 节点（post_to_dma_cb）的时间
+    bool prefilled;                 	// 已预先填充好图像，写入时不必再生成
+};
+
+// 读写计数，都在 lock 内更新
+struct my_ring_buffer_stats {
+    u64 writes;                     	// 提交的帧数
+    u64 reads;                      	// 读出的帧数
+    u64 full;                       	// 写入时已满而丢弃的帧数
+    u64 empty;                      	// 读取时为空的次数
+};
+
 struct my_ring_buffer {
-    void *buffers[MAX_FRAMES];      	// 缓冲区数组
-    dma_addr_t dma_handles[MAX_FRAMES]; // 每个缓冲区的物理地址
+    struct my_frame frames[MAX_FRAMES]; // 缓冲区数组
+    struct v4l2_pix_format fmt;     	// 缓冲区中帧数据的格式，决定每个缓冲区的大小
+    u32 alloc_size;                 	// 已分配的每个缓冲区的大小，0表示尚未分配
     int write_idx;                  	// 写指针
     int read_idx;                   	// 读指针
     spinlock_t lock;                	// 保护缓冲区的锁
+    u32 pattern;                    	// 下一帧用的颜色，只有本实例的生产者（或出流前的预填充）访问
+    struct my_ring_buffer_stats stats;	// 读写计数，只在初始化时清零
+    struct my_pmu_stage pmu_fill;   	// 生成一帧图像的 PMU 计数，使用者在不再写入后调用 my_pmu_stage_release
 };
 
-// 初始化环形缓冲区
-int my_ring_buffer_init(struct device *dev, struct my_ring_buffer *rb, size_t size);
+// 初始化环形缓冲区，只记录格式，不分配内存
+void my_ring_buffer_init(struct my_ring_buffer *rb, const struct v4l2_pix_format *fmt);
+
+// 修改帧格式，预先填充的图像随之作废，缓冲区在下一次分配时按新的大小重新分配
+void my_ring_buffer_set_format(struct my_ring_buffer *rb, const struct v4l2_pix_format *fmt);
+
+// 按当前格式分配缓冲区，已按相同大小分配过时直接复用
+int my_ring_buffer_alloc(struct device *dev, struct my_ring_buffer *rb);
+
+// 释放缓冲区，格式保留，之后可以再次分配
+void my_ring_buffer_free(struct device *dev, struct my_ring_buffer *rb);
 
-// 释放环形缓冲区
-void my_ring_buffer_free(struct device *dev, struct my_ring_buffer *rb, size_t size);
+// 预先为所有空闲缓冲区生成图像，出流后的前几帧写入时只需更新帧信息
+void my_ring_buffer_prefill(struct my_ring_buffer *rb);
+
+// 缓冲区当前占用的DMA内存字节数
+static inline size_t my_ring_buffer_dma_bytes(const struct my_ring_buffer *rb)
+{
+	return (size_t)READ_ONCE(rb->alloc_size) * MAX_FRAMES;
+}
+
+// 帧在环形缓冲区中的下标
+static inline int my_ring_buffer_index(const struct my_ring_buffer *rb, const struct my_frame *frame)
+{
+	return frame - rb->frames;
+}
+
+// 环形缓冲区中未读的帧数，不加锁，只用于统计；最多 MAX_FRAMES - 1
+static inline int my_ring_buffer_count(const struct my_ring_buffer *rb)
+{
+	return (READ_ONCE(rb->write_idx) - READ_ONCE(rb->read_idx) + MAX_FRAMES) % MAX_FRAMES;
+}
+
+/*
+ * 抽帧倒数：每 divider 个实际到达的帧放行一个，第一帧放行，返回 true 表示这一帧应跳过。
+ * 按到达的帧计数而不是按帧序号取模：帧序号上有空洞（sensor 错过、源头丢弃）时送出的帧率也不会低于 1/divider。
+ * 出流期间调小 divider 时剩余的倒数按新值截断。*skip 出流时清零，只由一个线程访问。
+ */
+static inline bool my_frame_divider_skip(u32 *skip, u32 divider)
+{
+	if (*skip >= divider)
+		*skip = divider - 1;
+	if (*skip) {
+		(*skip)--;
+		return true;
+	}
+	*skip = divider - 1;
+	return false;
+}
+
+// 清空环形缓冲区中未读的帧
+void my_ring_buffer_reset(struct my_ring_buffer *rb);
 
 // 判断环形缓冲区是否空
 bool my_ring_buffer_empty_lock(struct my_ring_buffer *rb);
 
-// 向环形缓冲区写入数据
-int my_ring_buffer_write(struct my_ring_buffer *rb, void *frame_data, size_t size);
+// 向环形缓冲区写入一帧数据
+int my_ring_buffer_write(struct my_ring_buffer *rb, u32 sequence, ktime_t sof_ts);
 
-// 从环形缓冲区读取数据
-void *my_ring_buffer_read(struct my_ring_buffer *rb);
+// 从环形缓冲区读取一帧数据
+struct my_frame *my_ring_buffer_read(struct my_ring_buffer *rb);
 
 #endif /* __MY_RINGBUFFER_H__ */
-
@@ -4,8 +4,14 @@
 #include <linux/string.h>
 #include <linux/hrtimer.h>
 #include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/idr.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
 #include <media/v4l2-ctrls.h>
 #include "my_sensor.h"
+#include "my_format.h"
+#include "my_trace.h"
 
 // 定义 TAG
 #define TAG "[my_sensor_drv]: "
@@ -17,36 +23,86 @@
 #define sensor_err(fmt, ...) \
     pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
 
-// 定义图像格式
-#define FRAME_WIDTH			1280
-#define FRAME_HEIGHT		720
-#define FPS 				30
-#define BYTES_PER_PIX_YUYV	2
 #define NSECS_PER_SEC 		1000000000
 
-extern void notify_csi_frame_ready(void);
 
-static void sensor_work_handler(struct work_struct *work)
+// 默认帧率
+#define DEFAULT_FPS			30
+
+// 支持的帧率，枚举帧间隔时按此顺序返回
+static const u32 sensor_fps_list[] = { 15, 24, 25, 30, 50, 60, 120, 240 };
+
+// 实例编号，用于区分各路sensor的worker
+static DEFINE_IDA(sensor_ida);
+
+// 通过主设备把帧起始转发给本路流水线的CSI，v4l2_subdev_notify 不会睡眠，可在硬中断上下文中调用
+static void sensor_notify_frame_start(struct my_sensor *mysen, ktime_t sof_ts)
 {
-	//struct my_sensor *mysen = container_of(work, struct my_sensor, work);
+	struct my_sensor_frame_start fs = {
+		.sof_ts = sof_ts,
+		.missed = atomic_xchg(&mysen->missed_pending, 0),	// worker 模式下和定时器回调并发
+	};
 
-	//sensor_info("\n");
+	v4l2_subdev_notify(&mysen->sd, MY_SENSOR_NOTIFY_FRAME_START, &fs);
+}
+
+// 帧起始直通模式：在hrtimer回调中直接唤醒CSI，关闭后退回到专用高优先级worker
+static bool direct_frame_start = true;
+module_param(direct_frame_start, bool, 0644);
+MODULE_PARM_DESC(direct_frame_start, "Signal frame start to CSI directly from the hrtimer (default: true)");
+
+// 快速出流：出流时立即产生第一个帧起始，不必等一个完整的帧周期，后续帧仍按网格到达
+static bool fast_start = true;
+module_param(fast_start, bool, 0644);
+MODULE_PARM_DESC(fast_start, "Signal the first frame start immediately on stream on (default: true)");
+
+static void sensor_work_handler(struct kthread_work *work)
+{
+	struct my_sensor *mysen = container_of(work, struct my_sensor, work);
 
 	// 通知csi
-    notify_csi_frame_ready();
+    sensor_notify_frame_start(mysen, READ_ONCE(mysen->sof_ts));
+}
+
+// 第n帧在绝对时间网格上的起始时间，直接由起点计算，不会累积误差
+static ktime_t sensor_frame_time(struct my_sensor *mysen, u64 n)
+{
+	return ktime_add_ns(mysen->grid_start,
+						div_u64(n * NSECS_PER_SEC * mysen->interval.numerator, mysen->interval.denominator));
 }
 
 static enum hrtimer_restart sensor_timer_callback(struct hrtimer *timer)
 {
 	struct my_sensor *mysen = container_of(timer, struct my_sensor, timer);
-	
-    //sensor_info("\n");
+	ktime_t sof_ts = hrtimer_get_expires(timer);	// 以理论到期时间作为帧起始时间
+	ktime_t now, next;
+	u64 frame;
+
+	trace_my_sensor_frame_start(mysen->id, mysen->grid_frame, sof_ts);
 
-	// 使用work来处理业务逻辑，避免占用定时器周期 
-	schedule_work(&mysen->work);
+	if (direct_frame_start) {
+		// 直接唤醒CSI线程，wake_up可在硬中断上下文中调用，省去工作队列这一次调度
+		sensor_notify_frame_start(mysen, sof_ts);
+	} else {
+		// 交给专用的SCHED_FIFO worker处理，避免在系统公共工作队列中排队
+		WRITE_ONCE(mysen->sof_ts, sof_ts);
+		kthread_queue_work(mysen->worker, &mysen->work);
+	}
 
-    // 重新启动定时器以实现周期性触发
-    hrtimer_forward_now(timer, ktime_set(0, NSECS_PER_SEC / FPS));
+	// 按绝对时间网格计算下一帧的到期时间，而不是相对当前时间再加一个周期
+	frame = ++mysen->grid_frame;
+	next  = sensor_frame_time(mysen, frame);
+	now   = hrtimer_cb_get_time(timer);
+	if (ktime_before(next, now)) {
+		// 定时器严重滞后，跳到当前时间之后的第一个网格点，并记录错过的帧数
+		frame = div64_u64((u64)ktime_to_ns(ktime_sub(now, mysen->grid_start)) * mysen->interval.denominator,
+						  (u64)NSECS_PER_SEC * mysen->interval.numerator) + 1;
+		mysen->missed_ticks += frame - mysen->grid_frame;
+		atomic_add(frame - mysen->grid_frame, &mysen->missed_pending);
+		mysen->grid_frame = frame;
+		next = sensor_frame_time(mysen, frame);
+	}
+	hrtimer_set_expires(timer, next);
 	
     return HRTIMER_RESTART;
 }
@@ -56,28 +112,220 @@ static int sensor_s_stream(struct v4l2_subdev *sd, int enable)
 	struct platform_device *pdev = v4l2_get_subdevdata(sd);
 	struct my_sensor *mysen = platform_get_drvdata(pdev);
 	
-    sensor_info("enable=%d\n", enable);
+    sensor_info("enable=%d, fps=%u/%u\n", enable,
+				mysen->interval.denominator, mysen->interval.numerator);
+
+	mutex_lock(&mysen->lock);
 
 	if (enable) {
-		// 启动内核定时器，模拟帧中断
-		hrtimer_start(&mysen->timer, ktime_set(0, NSECS_PER_SEC / FPS), HRTIMER_MODE_REL);
+		// 以当前时间为网格起点，第一帧在一个周期后到达
+		mysen->grid_start   = ktime_get();
+		mysen->grid_frame   = 1;
+		mysen->missed_ticks = 0;
+		atomic_set(&mysen->missed_pending, 0);
+		mysen->streaming    = true;
+
+		// 启动内核定时器，模拟帧中断，使用绝对时间避免漂移
+		hrtimer_start(&mysen->timer, sensor_frame_time(mysen, 1), HRTIMER_MODE_ABS);
+
+		// 网格起点本身作为第0帧，下游已经就绪，直接在这里通知
+		if (fast_start) {
+			trace_my_sensor_frame_start(mysen->id, 0, mysen->grid_start);
+			sensor_notify_frame_start(mysen, mysen->grid_start);
+		}
 	} else {
 		// 强制停掉定时器，返回1-当前处于active但是关闭成功；0-当前未active
 		hrtimer_cancel(&mysen->timer);
 		
-		// 确保工作队列中正在被调度的任务完成，挂起未被调度的不受影响
-		flush_work(&mysen->work);
+		// 确保worker中挂起或正在执行的任务完成
+		kthread_flush_work(&mysen->work);
+
+		mysen->streaming = false;
+		sensor_info("missed_ticks=%llu\n", mysen->missed_ticks);
 	}
+
+	mutex_unlock(&mysen->lock);
 	
     return 0;
 }
 
+static int sensor_g_frame_interval(struct v4l2_subdev *sd, struct v4l2_subdev_frame_interval *fi)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_sensor *mysen = platform_get_drvdata(pdev);
+
+	mutex_lock(&mysen->lock);
+	fi->interval = mysen->interval;
+	mutex_unlock(&mysen->lock);
+
+	return 0;
+}
+
+static int sensor_s_frame_interval(struct v4l2_subdev *sd, struct v4l2_subdev_frame_interval *fi)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_sensor *mysen = platform_get_drvdata(pdev);
+	u32 req_fps, best_fps = DEFAULT_FPS;
+	u32 best_diff = U32_MAX;
+	int i;
+
+	// 分子或分母为0时使用默认帧率
+	if (fi->interval.numerator && fi->interval.denominator)
+		req_fps = DIV_ROUND_CLOSEST(fi->interval.denominator, fi->interval.numerator);
+	else
+		req_fps = DEFAULT_FPS;
+
+	// 选择最接近的支持帧率
+	for (i = 0; i < ARRAY_SIZE(sensor_fps_list); i++) {
+		u32 diff = abs((int)sensor_fps_list[i] - (int)req_fps);
+
+		if (diff < best_diff) {
+			best_diff = diff;
+			best_fps  = sensor_fps_list[i];
+		}
+	}
+
+	mutex_lock(&mysen->lock);
+
+	// 出流过程中不允许修改帧率
+	if (mysen->streaming) {
+		mutex_unlock(&mysen->lock);
+		return -EBUSY;
+	}
+
+	mysen->interval.numerator   = 1;
+	mysen->interval.denominator = best_fps;
+	fi->interval = mysen->interval;
+
+	mutex_unlock(&mysen->lock);
+
+	sensor_info("fps=%u\n", best_fps);
+
+	return 0;
+}
+
+// 分辨率在范围内并且满足对齐要求
+static bool sensor_size_supported(u32 width, u32 height)
+{
+	return width >= MIN_WIDTH && width <= MAX_WIDTH && IS_ALIGNED(width, 1 << WIDTH_ALIGN) &&
+		   height >= MIN_HEIGHT && height <= MAX_HEIGHT && IS_ALIGNED(height, 1 << HEIGHT_ALIGN);
+}
+
+static int sensor_enum_mbus_code(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+								 struct v4l2_subdev_mbus_code_enum *code)
+{
+	const struct my_fmt_info *info = my_fmt_by_code_index(code->index);
+
+	if (code->pad != 0 || !info)
+		return -EINVAL;
+
+	code->code = info->code;
+
+	return 0;
+}
+
+// 分辨率是连续可调的，只返回一个范围
+static int sensor_enum_frame_size(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+								  struct v4l2_subdev_frame_size_enum *fse)
+{
+	if (fse->pad != 0 || fse->index > 0)
+		return -EINVAL;
+
+	if (!my_fmt_by_code(fse->code))
+		return -EINVAL;
+
+	fse->min_width  = MIN_WIDTH;
+	fse->max_width  = MAX_WIDTH;
+	fse->min_height = MIN_HEIGHT;
+	fse->max_height = MAX_HEIGHT;
+
+	return 0;
+}
+
+static int sensor_get_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+						  struct v4l2_subdev_format *format)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_sensor *mysen = platform_get_drvdata(pdev);
+
+	if (format->pad != 0)
+		return -EINVAL;
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		format->format = *v4l2_subdev_get_try_format(sd, cfg, format->pad);
+		return 0;
+	}
+
+	mutex_lock(&mysen->lock);
+	format->format = mysen->fmt;
+	mutex_unlock(&mysen->lock);
+
+	return 0;
+}
+
+static int sensor_set_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+						  struct v4l2_subdev_format *format)
+{
+	struct platform_device *pdev = v4l2_get_subdevdata(sd);
+	struct my_sensor *mysen = platform_get_drvdata(pdev);
+	struct v4l2_mbus_framefmt *mf = &format->format;
+	int ret = 0;
+
+	if (format->pad != 0)
+		return -EINVAL;
+
+	// 不支持的编码换成默认编码，分辨率限幅并对齐
+	my_adjust_mbus_format(mf);
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_format(sd, cfg, format->pad) = *mf;
+		return 0;
+	}
+
+	mutex_lock(&mysen->lock);
+	if (mysen->streaming)
+		ret = -EBUSY;
+	else
+		mysen->fmt = *mf;
+	mutex_unlock(&mysen->lock);
+
+	sensor_info("%ux%u, code=%#x, ret=%d\n", mf->width, mf->height, mf->code, ret);
+
+	return ret;
+}
+
+static int sensor_enum_frame_interval(struct v4l2_subdev *sd, struct v4l2_subdev_pad_config *cfg,
+									  struct v4l2_subdev_frame_interval_enum *fie)
+{
+	if (fie->pad != 0 || fie->index >= ARRAY_SIZE(sensor_fps_list))
+		return -EINVAL;
+
+	if (!sensor_size_supported(fie->width, fie->height))
+		return -EINVAL;
+
+	fie->interval.numerator   = 1;
+	fie->interval.denominator = sensor_fps_list[fie->index];
+
+	return 0;
+}
+
 static const struct v4l2_subdev_video_ops sensor_video_ops = {
-    .s_stream = sensor_s_stream,
+    .s_stream 			= sensor_s_stream,
+    .g_frame_interval 	= sensor_g_frame_interval,
+    .s_frame_interval 	= sensor_s_frame_interval,
+};
+
+static const struct v4l2_subdev_pad_ops sensor_pad_ops = {
+    .enum_mbus_code 	 = sensor_enum_mbus_code,
+    .enum_frame_size 	 = sensor_enum_frame_size,
+    .enum_frame_interval = sensor_enum_frame_interval,
+    .get_fmt 			 = sensor_get_fmt,
+    .set_fmt 			 = sensor_set_fmt,
 };
 
 static const struct v4l2_subdev_ops sensor_subdev_ops = {
     .video 	= &sensor_video_ops,
+    .pad 	= &sensor_pad_ops,
 };
 
 static int sensor_s_ctrl(struct v4l2_ctrl *ctrl)
@@ -117,6 +365,7 @@ static const struct v4l2_ctrl_config sensor_onoff_cfg = {
 static int my_sensor_probe(struct platform_device *pdev)
 {
 	struct my_sensor *mysen;
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
 	int ret = 0;
 	
     sensor_info("\n");
@@ -130,6 +379,12 @@ static int my_sensor_probe(struct platform_device *pdev)
 	mysen->pdev = pdev;
 	platform_set_drvdata(pdev, mysen);
 
+	// 初始化锁和默认帧率
+	mutex_init(&mysen->lock);
+	mysen->interval.numerator   = 1;
+	mysen->interval.denominator = DEFAULT_FPS;
+	my_default_mbus_format(&mysen->fmt);
+
 	// 初始化控制项处理器，分配1个控制项空间
 	v4l2_ctrl_handler_init(&mysen->ctrl_handler, 1);
 
@@ -148,30 +403,56 @@ static int my_sensor_probe(struct platform_device *pdev)
 	mysen->sd.flags |= V4L2_SUBDEV_FL_HAS_DEVNODE;
 	mysen->sd.dev = &pdev->dev; // 非常重要，否则不会触发match
 	snprintf(mysen->sd.name, sizeof(mysen->sd.name), "my_sensor_subdev");
+	mysen->sd.entity.function = MEDIA_ENT_F_CAM_SENSOR;
+
+	// 初始化pad，sensor只有一个输出pad
+	mysen->pad.flags = MEDIA_PAD_FL_SOURCE;
+	ret = media_entity_pads_init(&mysen->sd.entity, 1, &mysen->pad);
+	if (ret) {
+		sensor_err("Failed to init pads, ret=%d\n", ret);
+		return ret;
+	}
 
 	// 将私有数据与subdev关联
 	v4l2_set_subdevdata(&mysen->sd, pdev);
 
-	// 注册为异步子设备
-	ret = v4l2_async_register_subdev(&mysen->sd);
-    if (ret) {
-        sensor_err("Failed to register async subdev, ret=%d\n", ret);
-        return ret;
-    }
-    sensor_info("Async subdev registered\n");
-
 	// 初始化内核定时器
-	hrtimer_init(&mysen->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_init(&mysen->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	mysen->timer.function = sensor_timer_callback;
 	sensor_info("Timer inited\n");
 
-	// 初始化工作队列
-	INIT_WORK(&mysen->work, sensor_work_handler);
+	// 创建专用worker，并提升为实时优先级，避免与系统其它work竞争
+	mysen->id = ida_alloc(&sensor_ida, GFP_KERNEL);
+	if (mysen->id < 0)
+		return mysen->id;
+	mysen->worker = kthread_create_worker(0, "sensor_sof%d", mysen->id);
+	if (IS_ERR(mysen->worker)) {
+		sensor_err("Failed to create worker\n");
+		ret = PTR_ERR(mysen->worker);
+		goto err_free_id;
+	}
+	sched_setscheduler_nocheck(mysen->worker->task, SCHED_FIFO, &param);
+	kthread_init_work(&mysen->work, sensor_work_handler);
 	sensor_info("Work inited\n");
 
+	// 注册为异步子设备，放在最后：注册时主设备的 notifier 可能立即完成并注册 video 节点，随后就可能出流，
+	// 定时器和worker必须已经就绪；注册失败时子设备也不会被绑定，不用注销
+	ret = v4l2_async_register_subdev(&mysen->sd);
+    if (ret) {
+        sensor_err("Failed to register async subdev, ret=%d\n", ret);
+        goto err_destroy_worker;
+    }
+    sensor_info("Async subdev registered\n");
+
 	sensor_info("ok\n");
 	
     return 0;
+
+err_destroy_worker:
+	kthread_destroy_worker(mysen->worker);
+err_free_id:
+	ida_free(&sensor_ida, mysen->id);
+	return ret;
 }
 
 static int my_sensor_remove(struct platform_device *pdev)
@@ -189,8 +470,9 @@ static int my_sensor_remove(struct platform_device *pdev)
 	// 强制停掉定时器，返回1-当前处于active但是关闭成功；0-当前未active
 	hrtimer_cancel(&mysen->timer);
 
-	// 确保工作队列中正在被调度的任务完成，取消挂起的
-	cancel_work_sync(&mysen->work);
+	// 销毁worker，会先等待其中的任务执行完
+	kthread_destroy_worker(mysen->worker);
+	ida_free(&sensor_ida, mysen->id);
 
 	// 释放控制器申请的资源
 	v4l2_ctrl_handler_free(&mysen->ctrl_handler);
@@ -1,15 +1,37 @@
 #ifndef __MY_SENSOR_H__
 #define __MY_SENSOR_H__
 
+#include <linux/kthread.h>
 #include <media/v4l2-subdev.h>
 
+// MY_SENSOR_NOTIFY_FRAME_START 的参数
+struct my_sensor_frame_start {
+	ktime_t sof_ts;					// 帧起始时间
+	u32 missed;						// 上一个帧起始之后定时器滞后错过的帧数，下游据此在帧序号上留出空洞
+};
+
+// 通过 v4l2_subdev_notify 发给主设备的通知，arg 指向 struct my_sensor_frame_start，可能在硬中断上下文中发出
+#define MY_SENSOR_NOTIFY_FRAME_START	_IOW('s', 1, struct my_sensor_frame_start)
+
 // 私有数据结构
 struct my_sensor {
     struct platform_device *pdev;
+    int id;							// 实例编号
     struct v4l2_subdev sd; 			// 子设备的 v4l2_subdev
+    struct media_pad pad;			// 输出pad
     void *priv_data;       			// 其他私有数据（如寄存器基地址、硬件资源等）
     struct hrtimer timer;			// 定时器
-    struct work_struct work;		// 工作项
+    struct kthread_worker *worker;	// 专用高优先级worker，直通模式关闭时使用
+    struct kthread_work work;		// 工作项
+    ktime_t sof_ts;					// 最近一次帧起始（定时器到期）时间
+    struct mutex lock;				// 保护格式、帧率和出流状态
+    struct v4l2_mbus_framefmt fmt;	// 当前输出格式
+    struct v4l2_fract interval;		// 帧间隔，即 1/帧率
+    bool streaming;					// 是否正在出流
+    ktime_t grid_start;				// 绝对时间网格的起点（出流时刻）
+    u64 grid_frame;					// 下一次到期对应的网格帧号
+    u64 missed_ticks;				// 定时器滞后超过一个周期而错过的帧数
+    atomic_t missed_pending;		// 已错过、还没随帧起始通知下游的帧数
     struct v4l2_ctrl_handler ctrl_handler;	// 控制项句柄
     struct v4l2_ctrl *sensor_onoff_ctrl;	// sensor开关控制项
 };
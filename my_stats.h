@@ -0,0 +1,129 @@
+#ifndef __MY_STATS_H__
+#define __MY_STATS_H__
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+
+// 延迟直方图的桶个数，按微秒取 log2 分桶：桶0为<1us，桶i为[2^(i-1), 2^i)us，最后一个桶兜底
+#define MY_HIST_BUCKETS		24
+
+// 延迟直方图，只允许单个写者（各级流水线线程），读者容忍不一致
+struct my_hist {
+	u64 buckets[MY_HIST_BUCKETS];
+	u64 count;
+	u64 sum_ns;
+	u64 min_ns;
+	u64 max_ns;
+};
+
+static inline void my_hist_record(struct my_hist *h, s64 ns)
+{
+	u64 us;
+	int idx;
+
+	if (ns < 0)
+		ns = 0;
+
+	us  = (u64)ns / NSEC_PER_USEC;
+	idx = us ? ilog2(us) + 1 : 0;
+	if (idx >= MY_HIST_BUCKETS)
+		idx = MY_HIST_BUCKETS - 1;
+
+	WRITE_ONCE(h->buckets[idx], h->buckets[idx] + 1);
+	WRITE_ONCE(h->sum_ns, h->sum_ns + ns);
+	if (!h->count || ns < h->min_ns)
+		WRITE_ONCE(h->min_ns, ns);
+	if (ns > h->max_ns)
+		WRITE_ONCE(h->max_ns, ns);
+	WRITE_ONCE(h->count, h->count + 1);
+}
+
+static inline void my_hist_show(struct seq_file *s, const struct my_hist *h)
+{
+	u64 count = READ_ONCE(h->count);
+	int i;
+
+	seq_printf(s, "count: %llu\n", count);
+	seq_printf(s, "min_ns: %llu\n", count ? READ_ONCE(h->min_ns) : 0);
+	seq_printf(s, "avg_ns: %llu\n", count ? div64_u64(READ_ONCE(h->sum_ns), count) : 0);
+	seq_printf(s, "max_ns: %llu\n", READ_ONCE(h->max_ns));
+
+	for (i = 0; i < MY_HIST_BUCKETS; i++) {
+		u64 n = READ_ONCE(h->buckets[i]);
+
+		if (!n)
+			continue;
+		if (i == 0)
+			seq_printf(s, "[0, 1)us: %llu\n", n);
+		else if (i == MY_HIST_BUCKETS - 1)
+			seq_printf(s, "[%lu, inf)us: %llu\n", 1UL << (i - 1), n);
+		else
+			seq_printf(s, "[%lu, %lu)us: %llu\n", 1UL << (i - 1), 1UL << i, n);
+	}
+}
+
+// 第 pct 百分位所在桶的上界（纳秒），不超过最大值；桶是按 log2 划分的，结果最多偏大一倍
+static inline u64 my_hist_percentile(const struct my_hist *h, unsigned int pct)
+{
+	u64 target, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	target = div_u64(h->count * pct + 99, 100);
+	for (i = 0; i < MY_HIST_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return min_t(u64, (u64)NSEC_PER_USEC << i, h->max_ns);
+	}
+
+	return h->max_ns;
+}
+
+/*
+ * 每CPU一份的直方图：每个CPU上同一时刻只有一个写者（关抢占期间），记录时不需要锁也没有原子操作，
+ * 读的时候把各CPU的合并起来。不能在中断上下文中记录同一个直方图。
+ */
+static inline void my_hist_pcpu_record(struct my_hist __percpu *h, s64 ns)
+{
+	my_hist_record(get_cpu_ptr(h), ns);
+	put_cpu_ptr(h);
+}
+
+static inline void my_hist_pcpu_sum(struct my_hist __percpu *h, struct my_hist *sum)
+{
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		const struct my_hist *p = per_cpu_ptr(h, cpu);
+		u64 count = READ_ONCE(p->count);
+
+		if (!count)
+			continue;
+		for (i = 0; i < MY_HIST_BUCKETS; i++)
+			sum->buckets[i] += READ_ONCE(p->buckets[i]);
+		if (!sum->count || READ_ONCE(p->min_ns) < sum->min_ns)
+			sum->min_ns = READ_ONCE(p->min_ns);
+		sum->max_ns  = max_t(u64, sum->max_ns, READ_ONCE(p->max_ns));
+		sum->sum_ns += READ_ONCE(p->sum_ns);
+		sum->count  += count;
+	}
+}
+
+// 清零不与写者同步，清零瞬间正在记录的一个样本可能残留
+static inline void my_hist_pcpu_reset(struct my_hist __percpu *h)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(h, cpu), 0, sizeof(struct my_hist));
+}
+
+#endif /* __MY_STATS_H__ */
@@ -0,0 +1,137 @@
+/*
+ * 流水线各级的 tracepoint，每一帧经过一级就记录一次帧序号和缓冲区编号，
+ * 用 perf/trace-cmd 抓取后可以还原每一帧的时间线；未打开时只是一条不跳转的nop。
+ *
+ * 所有 tracepoint 在 my_ringbuffer.c 中定义并导出，其他模块只包含本头文件。
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM my_camera
+
+#if !defined(__MY_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __MY_TRACE_H__
+
+#include <linux/types.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+// sensor 发出帧起始，sequence 为时间网格上的帧号
+TRACE_EVENT(my_sensor_frame_start,
+	TP_PROTO(int id, u32 sequence, ktime_t sof_ts),
+	TP_ARGS(id, sequence, sof_ts),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u32, sequence)
+		__field(s64, sof_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id       = id;
+		__entry->sequence = sequence;
+		__entry->sof_ns   = ktime_to_ns(sof_ts);
+	),
+
+	TP_printk("sensor=%d seq=%u sof_ns=%lld", __entry->id, __entry->sequence, __entry->sof_ns)
+);
+
+// ring buffer 中一个缓冲区的写入/读出，index 为缓冲区在 ring 中的下标
+DECLARE_EVENT_CLASS(my_ring_frame,
+	TP_PROTO(const void *rb, u32 sequence, int index),
+	TP_ARGS(rb, sequence, index),
+
+	TP_STRUCT__entry(
+		__field(const void *, rb)
+		__field(u32, sequence)
+		__field(int, index)
+	),
+
+	TP_fast_assign(
+		__entry->rb       = rb;
+		__entry->sequence = sequence;
+		__entry->index    = index;
+	),
+
+	TP_printk("rb=%p seq=%u index=%d", __entry->rb, __entry->sequence, __entry->index)
+);
+
+// CSI 把一帧写进 ring buffer 并提交
+DEFINE_EVENT(my_ring_frame, my_ring_write,
+	TP_PROTO(const void *rb, u32 sequence, int index),
+	TP_ARGS(rb, sequence, index)
+);
+
+// 消费者（ISP，或旁路时的 CSI 自己）从 ring buffer 取出一帧
+DEFINE_EVENT(my_ring_frame, my_ring_read,
+	TP_PROTO(const void *rb, u32 sequence, int index),
+	TP_ARGS(rb, sequence, index)
+);
+
+// 某一级处理一帧，id 为该级的实例编号（ISP 为 isp_thread<N> 的 N，video 节点为 /dev/video<N> 的 N）
+DECLARE_EVENT_CLASS(my_stage_frame,
+	TP_PROTO(int id, u32 sequence, int index),
+	TP_ARGS(id, sequence, index),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u32, sequence)
+		__field(int, index)
+	),
+
+	TP_fast_assign(
+		__entry->id       = id;
+		__entry->sequence = sequence;
+		__entry->index    = index;
+	),
+
+	TP_printk("id=%d seq=%u index=%d", __entry->id, __entry->sequence, __entry->index)
+);
+
+// ISP 开始/结束处理一帧，index 为 ring buffer 下标
+DEFINE_EVENT(my_stage_frame, my_isp_begin,
+	TP_PROTO(int id, u32 sequence, int index),
+	TP_ARGS(id, sequence, index)
+);
+
+DEFINE_EVENT(my_stage_frame, my_isp_end,
+	TP_PROTO(int id, u32 sequence, int index),
+	TP_ARGS(id, sequence, index)
+);
+
+// 一帧写进 vb2 缓冲区并交还给vb2，index 为 vb2 缓冲区编号
+DEFINE_EVENT(my_stage_frame, my_vb2_buf_done,
+	TP_PROTO(int id, u32 sequence, int index),
+	TP_ARGS(id, sequence, index)
+);
+
+// 用户 DQBUF 取到一帧
+DEFINE_EVENT(my_stage_frame, my_vb2_dqbuf,
+	TP_PROTO(int id, u32 sequence, int index),
+	TP_ARGS(id, sequence, index)
+);
+
+// 用户 QBUF 归还一个缓冲区，此时还没有帧序号
+TRACE_EVENT(my_vb2_qbuf,
+	TP_PROTO(int id, int index),
+	TP_ARGS(id, index),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(int, index)
+	),
+
+	TP_fast_assign(
+		__entry->id    = id;
+		__entry->index = index;
+	),
+
+	TP_printk("id=%d index=%d", __entry->id, __entry->index)
+);
+
+#endif /* __MY_TRACE_H__ */
+
+// 本头文件不在内核的 include/trace/events 下，由 Makefile 为定义 tracepoint 的 my_ringbuffer.o 加上 -I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE my_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,514 @@
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/refcount.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
+#include <media/videobuf2-memops.h>
+#include "my_vb2_mem.h"
+
+// 定义 TAG
+#define TAG "[my_vb2_mem]: "
+
+// 封装打印函数
+#define mem_info(fmt, ...) \
+    pr_info(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
+
+#define mem_err(fmt, ...) \
+    pr_err(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
+
+#define mem_dbg(fmt, ...) \
+    pr_debug(TAG "%s: " fmt, __func__, ##__VA_ARGS__)
+
+#define MY_HUGE_ORDER		(MY_VB2_HUGE_SHIFT - PAGE_SHIFT)
+
+/*
+ * 流式映射的方向固定为双向：同一个缓冲区既要在 QBUF 时写回（for_device），又要在 DQBUF 时作废（for_cpu），
+ * DMA API 要求同步的方向与映射时一致。
+ */
+#define MY_VB2_DMA_DIR		DMA_BIDIRECTIONAL
+
+struct my_vb2_buf {
+	struct device *dev;
+	void *vaddr;						// 所有块 vmap 成的内核地址
+	unsigned long size;					// 按块大小向上取整
+	unsigned int order;					// 每块的阶，大页模式为 MY_HUGE_ORDER，可缓存模式为0
+	unsigned int nr_chunks;
+	struct page **chunks;				// 每块的首页，阶大于0时是复合页
+	struct page **pages;				// 所有 4KB 页，vmap 和缺页映射用；USERPTR 时指向 vec 中的页
+	struct frame_vector *vec;			// USERPTR 时 pin 住的用户页，MMAP 时为 NULL
+	struct sg_table sgt;				// 已对 dev 做流式映射，cache 维护用
+	refcount_t refcount;				// vb2 持有一个，每个用户映射、导出的 dmabuf 各一个
+};
+
+static void my_vb2_buf_free(struct my_vb2_buf *buf)
+{
+	unsigned int i;
+
+	if (buf->sgt.nents)
+		dma_unmap_sg_attrs(buf->dev, buf->sgt.sgl, buf->sgt.orig_nents, MY_VB2_DMA_DIR, DMA_ATTR_SKIP_CPU_SYNC);
+	sg_free_table(&buf->sgt);
+	if (buf->vaddr)
+		vunmap(buf->vaddr);
+	for (i = 0; buf->chunks && i < buf->nr_chunks; i++) {
+		if (buf->chunks[i])
+			__free_pages(buf->chunks[i], buf->order);
+	}
+	if (buf->vec) {
+		// 生产者经内核映射写过这些页，解除 pin 之前标脏，页缓存或交换才不会丢掉写入的内容
+		for (i = 0; buf->pages && i < frame_vector_count(buf->vec); i++)
+			set_page_dirty_lock(buf->pages[i]);
+		vb2_destroy_framevec(buf->vec);
+	} else {
+		kvfree(buf->pages);
+	}
+	kvfree(buf->chunks);
+	put_device(buf->dev);
+	kfree(buf);
+}
+
+static void my_vb2_buf_put(void *buf_priv)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	if (refcount_dec_and_test(&buf->refcount))
+		my_vb2_buf_free(buf);
+}
+
+static void *my_vb2_buf_alloc(struct device *dev, unsigned long size, gfp_t gfp_flags, unsigned int order)
+{
+	struct my_vb2_buf *buf;
+	unsigned long chunk_size = PAGE_SIZE << order;
+	unsigned long nr_pages;
+	unsigned int i, j;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	buf->dev = get_device(dev);
+	buf->order = order;
+	buf->size = ALIGN(size, chunk_size);
+	buf->nr_chunks = buf->size / chunk_size;
+	nr_pages = buf->size >> PAGE_SHIFT;
+	buf->chunks = kvcalloc(buf->nr_chunks, sizeof(*buf->chunks), GFP_KERNEL);
+	buf->pages = kvmalloc_array(nr_pages, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->chunks || !buf->pages)
+		goto err;
+
+	// 伙伴系统按阶对齐，每块的物理地址天然是块大小的整数倍；队列要求的区域（如 GFP_DMA32）照样遵守
+	for (i = 0; i < buf->nr_chunks; i++) {
+		buf->chunks[i] = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_ZERO | __GFP_NOWARN |
+									 (gfp_flags & (GFP_DMA | GFP_DMA32)), order);
+		if (!buf->chunks[i]) {
+			mem_err("Failed to allocate chunk %u/%u, order=%u\n", i, buf->nr_chunks, order);
+			goto err;
+		}
+		for (j = 0; j < (1U << order); j++)
+			buf->pages[(i << order) + j] = buf->chunks[i] + j;
+	}
+
+	// 内核侧和用户侧都是可缓存的映射，生产者写完、消费者读之前由驱动通过 sgt 做 cache 维护
+	buf->vaddr = vmap(buf->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!buf->vaddr)
+		goto err;
+
+	if (sg_alloc_table_from_pages(&buf->sgt, buf->pages, nr_pages, 0, buf->size, GFP_KERNEL))
+		goto err;
+	buf->sgt.nents = dma_map_sg_attrs(dev, buf->sgt.sgl, buf->sgt.orig_nents, MY_VB2_DMA_DIR,
+									  DMA_ATTR_SKIP_CPU_SYNC);
+	if (!buf->sgt.nents) {
+		mem_err("Failed to map %u sg entries\n", buf->sgt.orig_nents);
+		goto err;
+	}
+
+	refcount_set(&buf->refcount, 1);
+	mem_dbg("size=%lu, chunks=%u, order=%u, sg_nents=%u\n", buf->size, buf->nr_chunks, order, buf->sgt.nents);
+
+	return buf;
+
+err:
+	my_vb2_buf_free(buf);
+	return ERR_PTR(-ENOMEM);
+}
+
+static void *my_vb2_huge_alloc(struct device *dev, unsigned long attrs, unsigned long size,
+							   enum dma_data_direction dma_dir, gfp_t gfp_flags)
+{
+	return my_vb2_buf_alloc(dev, size, gfp_flags, MY_HUGE_ORDER);
+}
+
+static void *my_vb2_cached_alloc(struct device *dev, unsigned long attrs, unsigned long size,
+								 enum dma_data_direction dma_dir, gfp_t gfp_flags)
+{
+	return my_vb2_buf_alloc(dev, size, gfp_flags, 0);
+}
+
+/*
+ * USERPTR：缓冲区是用户自己的内存，用户映射也是用户自己建的。用 MAP_HUGETLB 分配时 hugetlbfs 本身就用 PMD 映射，
+ * 消费者拿到大页的 TLB 覆盖，驱动这边不需要 PMD 映射自己的页。这里只把页 pin 住、vmap 给生产者写入，
+ * cache 维护和 MMAP 的缓冲区一样，由驱动通过 sgt 在 QBUF/DQBUF 时做。
+ */
+static void *my_vb2_buf_get_userptr(struct device *dev, unsigned long vaddr, unsigned long size,
+									enum dma_data_direction dma_dir)
+{
+	struct my_vb2_buf *buf;
+	unsigned int nr_pages, i;
+	u64 dma_limit = dma_get_mask(dev);
+	int ret = -ENOMEM;
+
+	// 生产者从缓冲区开头按帧写入，要求页对齐
+	if (vaddr & ~PAGE_MASK)
+		return ERR_PTR(-EINVAL);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	buf->dev = get_device(dev);
+	buf->vec = vb2_create_framevec(vaddr, size);
+	if (IS_ERR(buf->vec)) {
+		ret = PTR_ERR(buf->vec);
+		buf->vec = NULL;
+		goto err;
+	}
+
+	// VM_PFNMAP 之类没有 struct page 的内存不能 vmap
+	if (frame_vector_to_pages(buf->vec) < 0) {
+		ret = -EINVAL;
+		goto err;
+	}
+	buf->pages = frame_vector_pages(buf->vec);
+	nr_pages = frame_vector_count(buf->vec);
+	buf->size = (unsigned long)nr_pages << PAGE_SHIFT;
+
+	/*
+	 * 设备够不着的页会经 swiotlb 弹跳，sync_for_cpu 时弹跳缓冲区的旧内容会盖掉生产者经 CPU 写入的帧，
+	 * 和 MMAP 缓冲区遵守队列的 GFP_DMA32 一样，这里直接拒绝。
+	 */
+	for (i = 0; i < nr_pages; i++) {
+		if (page_to_phys(buf->pages[i]) + PAGE_SIZE - 1 > dma_limit) {
+			mem_err("Page %u above the DMA mask %#llx\n", i, dma_limit);
+			ret = -EINVAL;
+			goto err;
+		}
+	}
+
+	buf->vaddr = vmap(buf->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!buf->vaddr)
+		goto err;
+
+	if (sg_alloc_table_from_pages(&buf->sgt, buf->pages, nr_pages, 0, buf->size, GFP_KERNEL))
+		goto err;
+	buf->sgt.nents = dma_map_sg_attrs(dev, buf->sgt.sgl, buf->sgt.orig_nents, MY_VB2_DMA_DIR,
+									  DMA_ATTR_SKIP_CPU_SYNC);
+	if (!buf->sgt.nents) {
+		mem_err("Failed to map %u sg entries\n", buf->sgt.orig_nents);
+		goto err;
+	}
+
+	refcount_set(&buf->refcount, 1);
+	mem_dbg("uaddr=%#lx, size=%lu, sg_nents=%u\n", vaddr, buf->size, buf->sgt.nents);
+
+	return buf;
+
+err:
+	my_vb2_buf_free(buf);
+	return ERR_PTR(ret);
+}
+
+static void *my_vb2_buf_vaddr(void *buf_priv)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	return buf->vaddr;
+}
+
+static unsigned int my_vb2_buf_num_users(void *buf_priv)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	return refcount_read(&buf->refcount);
+}
+
+// CPU 读之前作废 cache 中的旧数据，设备写入的内容才能被看到
+void my_vb2_mem_sync_for_cpu(void *buf_priv)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	dma_sync_sg_for_cpu(buf->dev, buf->sgt.sgl, buf->sgt.orig_nents, MY_VB2_DMA_DIR);
+}
+EXPORT_SYMBOL(my_vb2_mem_sync_for_cpu);
+
+// 交给设备之前把 CPU 写过的脏数据写回内存，之后被逐出时不会盖掉设备写入的内容
+void my_vb2_mem_sync_for_device(void *buf_priv)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	dma_sync_sg_for_device(buf->dev, buf->sgt.sgl, buf->sgt.orig_nents, MY_VB2_DMA_DIR);
+}
+EXPORT_SYMBOL(my_vb2_mem_sync_for_device);
+
+static void my_vb2_buf_vm_open(struct vm_area_struct *vma)
+{
+	struct my_vb2_buf *buf = vma->vm_private_data;
+
+	refcount_inc(&buf->refcount);
+}
+
+static void my_vb2_buf_vm_close(struct vm_area_struct *vma)
+{
+	my_vb2_buf_put(vma->vm_private_data);
+}
+
+/*
+ * 用户映射只用 4KB 的 PFN 映射，两种模式都一样。5.4 上不能把驱动自己的页用 PMD 映射给用户：
+ * zap_huge_pmd()/copy_huge_pmd() 会把非 DAX 的 PMD 当成普通透明大页处理，munmap、fork 时去动页的 rmap 和引用计数。
+ */
+static vm_fault_t my_vb2_buf_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct my_vb2_buf *buf = vma->vm_private_data;
+
+	// vmf->pgoff 已经算上了 vm_pgoff：munmap/mprotect 拆分映射后，后一半的 vm_start 和 vm_pgoff 一起后移
+	if (vmf->pgoff >= buf->size >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	return vmf_insert_pfn(vma, vmf->address & PAGE_MASK, page_to_pfn(buf->pages[vmf->pgoff]));
+}
+
+static const struct vm_operations_struct my_vb2_buf_vm_ops = {
+	.open		= my_vb2_buf_vm_open,
+	.close		= my_vb2_buf_vm_close,
+	.fault		= my_vb2_buf_vm_fault,
+};
+
+static int my_vb2_buf_mmap(void *buf_priv, struct vm_area_struct *vma)
+{
+	struct my_vb2_buf *buf = buf_priv;
+
+	if (!buf)
+		return -EINVAL;
+
+	if (vma->vm_end - vma->vm_start > buf->size)
+		return -EINVAL;
+
+	// PFN 映射不能写时复制，MAP_PRIVATE 会在第一次缺页时触发 vmf_insert_pfn() 中的 BUG_ON；vb2 自己检查过，导出的 dmabuf 没有
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	// vm_pgoff 是vb2用来找缓冲区的偏移，映射总是从缓冲区开头开始；清零后缺页时 vmf->pgoff 就是缓冲区内的页号
+	vma->vm_pgoff = 0;
+	vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = buf;
+	vma->vm_ops = &my_vb2_buf_vm_ops;
+
+	// 映射持有缓冲区，REQBUFS(0) 之后还没 munmap 的映射仍然有效
+	my_vb2_buf_vm_open(vma);
+
+	mem_dbg("size=%lu, uaddr=%#lx\n", vma->vm_end - vma->vm_start, vma->vm_start);
+
+	return 0;
+}
+
+/*
+ * 导出的 dmabuf。导入者各自有一份 sg_table 映射到自己的设备；CPU 访问（DMA_BUF_IOCTL_SYNC）
+ * 同步的是缓冲区自己的流式映射，用户映射和内核映射都是可缓存的。
+ */
+struct my_vb2_attachment {
+	struct sg_table sgt;
+	enum dma_data_direction dma_dir;
+};
+
+static int my_vb2_dmabuf_attach(struct dma_buf *dbuf, struct dma_buf_attachment *db_attach)
+{
+	struct my_vb2_buf *buf = dbuf->priv;
+	struct my_vb2_attachment *attach;
+	struct scatterlist *rd, *wr;
+	unsigned int i;
+
+	attach = kzalloc(sizeof(*attach), GFP_KERNEL);
+	if (!attach)
+		return -ENOMEM;
+
+	// 复制一份 sg_table，各个导入者的DMA地址互不影响
+	if (sg_alloc_table(&attach->sgt, buf->sgt.orig_nents, GFP_KERNEL)) {
+		kfree(attach);
+		return -ENOMEM;
+	}
+	wr = attach->sgt.sgl;
+	for_each_sg(buf->sgt.sgl, rd, buf->sgt.orig_nents, i) {
+		sg_set_page(wr, sg_page(rd), rd->length, rd->offset);
+		wr = sg_next(wr);
+	}
+
+	attach->dma_dir = DMA_NONE;
+	db_attach->priv = attach;
+
+	return 0;
+}
+
+static void my_vb2_dmabuf_detach(struct dma_buf *dbuf, struct dma_buf_attachment *db_attach)
+{
+	struct my_vb2_attachment *attach = db_attach->priv;
+
+	if (!attach)
+		return;
+
+	if (attach->dma_dir != DMA_NONE)
+		dma_unmap_sg_attrs(db_attach->dev, attach->sgt.sgl, attach->sgt.orig_nents, attach->dma_dir,
+						   DMA_ATTR_SKIP_CPU_SYNC);
+	sg_free_table(&attach->sgt);
+	kfree(attach);
+	db_attach->priv = NULL;
+}
+
+static struct sg_table *my_vb2_dmabuf_map(struct dma_buf_attachment *db_attach, enum dma_data_direction dma_dir)
+{
+	struct my_vb2_attachment *attach = db_attach->priv;
+	struct mutex *lock = &db_attach->dmabuf->lock;
+
+	mutex_lock(lock);
+
+	// 已经按同样的方向映射过，直接复用
+	if (attach->dma_dir == dma_dir) {
+		mutex_unlock(lock);
+		return &attach->sgt;
+	}
+
+	if (attach->dma_dir != DMA_NONE) {
+		dma_unmap_sg_attrs(db_attach->dev, attach->sgt.sgl, attach->sgt.orig_nents, attach->dma_dir,
+						   DMA_ATTR_SKIP_CPU_SYNC);
+		attach->dma_dir = DMA_NONE;
+	}
+
+	// cache 由导出者在 QBUF/DQBUF 和 begin/end_cpu_access 时维护，这里跳过
+	attach->sgt.nents = dma_map_sg_attrs(db_attach->dev, attach->sgt.sgl, attach->sgt.orig_nents, dma_dir,
+										 DMA_ATTR_SKIP_CPU_SYNC);
+	if (!attach->sgt.nents) {
+		mem_err("Failed to map sg_table for %s\n", dev_name(db_attach->dev));
+		mutex_unlock(lock);
+		return ERR_PTR(-EIO);
+	}
+
+	attach->dma_dir = dma_dir;
+
+	mutex_unlock(lock);
+
+	return &attach->sgt;
+}
+
+static void my_vb2_dmabuf_unmap(struct dma_buf_attachment *db_attach, struct sg_table *sgt,
+								enum dma_data_direction dma_dir)
+{
+	// 映射保留到 detach，重复 map/unmap 不必每次都重新映射
+}
+
+static void my_vb2_dmabuf_release(struct dma_buf *dbuf)
+{
+	my_vb2_buf_put(dbuf->priv);
+}
+
+// DMA_BUF_IOCTL_SYNC 的 SYNC_START：CPU 读之前作废 cache
+static int my_vb2_dmabuf_begin_cpu_access(struct dma_buf *dbuf, enum dma_data_direction dma_dir)
+{
+	my_vb2_mem_sync_for_cpu(dbuf->priv);
+
+	return 0;
+}
+
+// DMA_BUF_IOCTL_SYNC 的 SYNC_END：把 CPU 写过的数据写回内存
+static int my_vb2_dmabuf_end_cpu_access(struct dma_buf *dbuf, enum dma_data_direction dma_dir)
+{
+	my_vb2_mem_sync_for_device(dbuf->priv);
+
+	return 0;
+}
+
+static void *my_vb2_dmabuf_kmap(struct dma_buf *dbuf, unsigned long pgnum)
+{
+	struct my_vb2_buf *buf = dbuf->priv;
+
+	return buf->vaddr + pgnum * PAGE_SIZE;
+}
+
+static void *my_vb2_dmabuf_vmap(struct dma_buf *dbuf)
+{
+	struct my_vb2_buf *buf = dbuf->priv;
+
+	return buf->vaddr;
+}
+
+static int my_vb2_dmabuf_mmap(struct dma_buf *dbuf, struct vm_area_struct *vma)
+{
+	// 映射总是从缓冲区开头开始，不支持从中间的偏移映射
+	if (vma->vm_pgoff)
+		return -EINVAL;
+
+	return my_vb2_buf_mmap(dbuf->priv, vma);
+}
+
+static const struct dma_buf_ops my_vb2_dmabuf_ops = {
+	.attach				= my_vb2_dmabuf_attach,
+	.detach				= my_vb2_dmabuf_detach,
+	.map_dma_buf		= my_vb2_dmabuf_map,
+	.unmap_dma_buf		= my_vb2_dmabuf_unmap,
+	.begin_cpu_access	= my_vb2_dmabuf_begin_cpu_access,
+	.end_cpu_access		= my_vb2_dmabuf_end_cpu_access,
+	.map				= my_vb2_dmabuf_kmap,
+	.vmap				= my_vb2_dmabuf_vmap,
+	.mmap				= my_vb2_dmabuf_mmap,
+	.release			= my_vb2_dmabuf_release,
+};
+
+static struct dma_buf *my_vb2_buf_get_dmabuf(void *buf_priv, unsigned long flags)
+{
+	struct my_vb2_buf *buf = buf_priv;
+	struct dma_buf *dbuf;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+	exp_info.ops = &my_vb2_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = flags;
+	exp_info.priv = buf;
+
+	dbuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dbuf))
+		return NULL;
+
+	// dmabuf 持有缓冲区，直到最后一个引用释放
+	refcount_inc(&buf->refcount);
+
+	return dbuf;
+}
+
+const struct vb2_mem_ops my_vb2_huge_memops = {
+	.alloc		= my_vb2_huge_alloc,
+	.put		= my_vb2_buf_put,
+	.get_userptr	= my_vb2_buf_get_userptr,
+	.put_userptr	= my_vb2_buf_put,
+	.get_dmabuf	= my_vb2_buf_get_dmabuf,
+	.vaddr		= my_vb2_buf_vaddr,
+	.mmap		= my_vb2_buf_mmap,
+	.num_users	= my_vb2_buf_num_users,
+};
+EXPORT_SYMBOL(my_vb2_huge_memops);
+
+const struct vb2_mem_ops my_vb2_cached_memops = {
+	.alloc		= my_vb2_cached_alloc,
+	.put		= my_vb2_buf_put,
+	.get_userptr	= my_vb2_buf_get_userptr,
+	.put_userptr	= my_vb2_buf_put,
+	.get_dmabuf	= my_vb2_buf_get_dmabuf,
+	.vaddr		= my_vb2_buf_vaddr,
+	.mmap		= my_vb2_buf_mmap,
+	.num_users	= my_vb2_buf_num_users,
+};
+EXPORT_SYMBOL(my_vb2_cached_memops);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Your Name");
+MODULE_DESCRIPTION("My vb2 2MB-chunk and cached memory ops");
+MODULE_VERSION("1.0");
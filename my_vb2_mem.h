@@ -0,0 +1,28 @@
+#ifndef __MY_VB2_MEM_H__
+#define __MY_VB2_MEM_H__
+
+#include <media/videobuf2-v4l2.h>
+
+/*
+ * 可缓存缓冲区的 vb2 内存操作，实现在 my_vb2_mem.c 中，支持 MMAP、EXPBUF 导出和 USERPTR，不支持导入 dmabuf。
+ *
+ * 缓冲区由若干个物理连续块组成（伙伴系统分配，按块大小对齐），内核侧 vmap 成一段连续地址，用户映射和内核映射都可缓存：
+ *   my_vb2_huge_memops：块大小 2MB，sg 表项少，分配不会把伙伴系统切得很碎；
+ *   my_vb2_cached_memops：块大小 4KB，内存紧张时也容易分配到。
+ * MMAP 的用户映射都是 4KB 的 PFN 映射，5.4 上不能安全地把驱动的页用 PMD 大页映射给用户；
+ * 需要大页 TLB 覆盖时用 USERPTR 交入用户自己的 hugetlb 内存（MAP_HUGETLB），由 hugetlbfs 做 PMD 映射。
+ * vb2 不会替这些缓冲区做 cache 维护，由驱动在 QBUF/DQBUF 时调用 my_vb2_mem_sync_for_device/for_cpu；
+ * 导出的 dmabuf 在 DMA_BUF_IOCTL_SYNC 时做同样的维护。
+ * 缓冲区整体不保证物理连续，cookie 为 NULL，真实DMA需要IOMMU或支持scatter-gather。
+ */
+#define MY_VB2_HUGE_SHIFT	21
+#define MY_VB2_HUGE_SIZE	(1UL << MY_VB2_HUGE_SHIFT)	// 大页模式分配的块大小
+
+extern const struct vb2_mem_ops my_vb2_huge_memops;
+extern const struct vb2_mem_ops my_vb2_cached_memops;
+
+// buf_priv 为 vb2_plane.mem_priv
+void my_vb2_mem_sync_for_cpu(void *buf_priv);
+void my_vb2_mem_sync_for_device(void *buf_priv);
+
+#endif /* __MY_VB2_MEM_H__ */
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>  // 包含 strcasecmp
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -10,19 +11,2131 @@
 #include <errno.h>    // 包含 errno 宏
 #include <signal.h>   // 包含信号处理函数
 #include <time.h>     // 包含高精度时间函数
+#include <math.h>     // 包含 sqrt
+#include <sys/time.h>
+#include <sys/resource.h> // 包含 getrusage
+#include <poll.h>
+#include <linux/dma-buf.h>    // 包含 DMA_BUF_IOCTL_SYNC
+#include <linux/dma-heap.h>   // 包含 DMA_HEAP_IOCTL_ALLOC
+#include <linux/media.h>      // 包含 MEDIA_IOC_SETUP_LINK
+#include <linux/sync_file.h>  // 包含 SYNC_IOC_FILE_INFO
+#include "my_camera.h"        // 完成环、输出 fence 的私有接口
 
 #define WIDTH 		1920
 #define HEIGHT 		1080
 #define NUM_BUFFERS 4
 #define CAMERA_DEV	"/dev/video0"
+#define MEDIA_DEV	"/dev/media0"
+
+// 驱动的自定义控制项，与 my_camera.c 保持一致
+#define MYCAM_CID_DROP_POLICY		(V4L2_CID_BASE + 0x1020)
+#define MYCAM_CID_DROPPED_SOURCE	(V4L2_CID_BASE + 0x1021)
+#define MYCAM_CID_DROPPED_SINK		(V4L2_CID_BASE + 0x1022)
+#define MYCAM_CID_FRAME_DIVIDER		(V4L2_CID_BASE + 0x1023)
+#define MYCAM_CID_CLIENT_DROPPED	(V4L2_CID_BASE + 0x1024)
 
 static struct timespec curr_frame_ts = {0};
 static struct timespec last_frame_ts = {0};
 
+// 帧率/抖动统计，基于驱动填写的 buf.timestamp
+struct rate_stats {
+	unsigned long frames;
+	unsigned long dropped;		// 根据序号空洞推算的丢帧数
+	__u32 last_seq;
+	double first_ts_ms;
+	double last_ts_ms;
+	double sum_period;
+	double sum_period_sq;
+	double min_period;
+	double max_period;
+};
+
+static const char *camera_dev = CAMERA_DEV;
+static const char *media_dev = MEDIA_DEV;   // -m: 与 -d 对应的媒体设备节点
+static int target_fps = 0;        // -r: 通过 VIDIOC_S_PARM 设置的帧率，0表示不设置
+static long max_frames = -1;      // -n: 采集的帧数，-1表示一直采集
+static int quiet = 0;             // -q: 不保存帧、不逐帧打印
+static __u32 req_width = WIDTH;   // -W/-H: 请求的分辨率
+static __u32 req_height = HEIGHT;
+static __u32 req_pixfmt = V4L2_PIX_FMT_YUYV; // -f: 请求的像素格式
+static int bench_seconds = 5;     // -s: 每个基准测试项的时长
+
+// 像素格式名与fourcc的对应关系
+static const struct {
+	const char *name;
+	__u32 fourcc;
+} pixfmt_names[] = {
+	{ "yuyv", V4L2_PIX_FMT_YUYV },
+	{ "nv12", V4L2_PIX_FMT_NV12 },
+	{ "grey", V4L2_PIX_FMT_GREY },
+	{ "nv12m", V4L2_PIX_FMT_NV12M },
+};
+
+static int parse_pixfmt(const char *name, __u32 *fourcc)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(pixfmt_names) / sizeof(pixfmt_names[0]); i++) {
+		if (!strcasecmp(name, pixfmt_names[i].name)) {
+			*fourcc = pixfmt_names[i].fourcc;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
 void save_to_yuv(void *buffer, int len);
 void handle_sigint(int sig);          // 信号处理函数
 
-int main() {
+static double timeval_to_ms(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void rate_stats_update(struct rate_stats *st, const struct v4l2_buffer *buf)
+{
+	double ts_ms = timeval_to_ms(&buf->timestamp);
+	double period;
+
+	if (st->frames == 0) {
+		st->first_ts_ms = ts_ms;
+		st->min_period = 1e9;
+	} else {
+		period = ts_ms - st->last_ts_ms;
+		st->sum_period += period;
+		st->sum_period_sq += period * period;
+		if (period < st->min_period)
+			st->min_period = period;
+		if (period > st->max_period)
+			st->max_period = period;
+		if (buf->sequence > st->last_seq + 1)
+			st->dropped += buf->sequence - st->last_seq - 1;
+	}
+
+	st->last_ts_ms = ts_ms;
+	st->last_seq = buf->sequence;
+	st->frames++;
+}
+
+static void rate_stats_print(const struct rate_stats *st)
+{
+	unsigned long n = st->frames > 1 ? st->frames - 1 : 0;
+	double mean, stddev;
+
+	if (n == 0) {
+		printf("帧数不足，无法统计帧率\n");
+		return;
+	}
+
+	mean = st->sum_period / n;
+	stddev = sqrt(st->sum_period_sq / n - mean * mean);
+
+	printf("\n=== 帧率统计 ===\n");
+	printf("    frames: %lu, dropped: %lu\n", st->frames, st->dropped);
+	printf("    achieved_fps: %.3f\n", n * 1000.0 / (st->last_ts_ms - st->first_ts_ms));
+	printf("    period_ms: mean=%.3f min=%.3f max=%.3f\n", mean, st->min_period, st->max_period);
+	printf("    jitter_ms(stddev): %.3f\n", stddev);
+}
+
+/*
+ * 基准测试用的精简采集流程，不打印中间过程
+ */
+// bench_cam 的缓冲区来源
+enum bench_mem {
+	BENCH_MEM_MMAP,			// 驱动分配，mmap 映射
+	BENCH_MEM_USER_4K,		// 自己分配的普通匿名内存，关掉透明大页，按 USERPTR 交给驱动
+	BENCH_MEM_USER_HUGETLB,	// 自己分配的 MAP_HUGETLB 大页内存，按 USERPTR 交给驱动
+};
+
+// 大页内存按 2MB 取整
+#define HUGE_PAGE_SIZE		(2UL << 20)
+
+struct bench_cam {
+	int fd;
+	const char *dev;
+	__u32 width;
+	__u32 height;
+	int fps;
+	__u32 nbufs;
+	void *buffers[NUM_BUFFERS];
+	__u32 lengths[NUM_BUFFERS];
+	struct v4l2_format fmt;
+	__u32 qbuf_flags;			// 初始入队时附加的 v4l2_buffer.flags
+	enum bench_mem mem;			// 缓冲区来源，默认 MMAP
+	__u32 memory;				// 由 mem 决定的 V4L2_MEMORY_*，DQBUF/QBUF 时填
+	int fence_fd[NUM_BUFFERS];	// qbuf_flags 带 MYCAM_BUF_FLAG_OUT_FENCE 时各缓冲区的 fence，-1 表示没有
+};
+
+// 系统整体CPU时间，来自 /proc/stat 第一行
+struct cpu_snapshot {
+	unsigned long long busy;
+	unsigned long long total;
+	struct rusage self;
+	struct timespec ts;
+};
+
+static double ts_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+static void cpu_snapshot_take(struct cpu_snapshot *snap)
+{
+	unsigned long long user = 0, nice = 0, sys = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+	FILE *f = fopen("/proc/stat", "r");
+
+	if (f) {
+		if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+				   &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal) < 4)
+			user = nice = sys = idle = iowait = irq = softirq = steal = 0;
+		fclose(f);
+	}
+	snap->busy = user + nice + sys + irq + softirq + steal;
+	snap->total = snap->busy + idle + iowait;
+	getrusage(RUSAGE_SELF, &snap->self);
+	clock_gettime(CLOCK_MONOTONIC, &snap->ts);
+}
+
+// 系统CPU占用（以单核为100%），包括驱动内核线程和中断
+static double cpu_snapshot_sys_pct(const struct cpu_snapshot *a, const struct cpu_snapshot *b)
+{
+	unsigned long long total = b->total - a->total;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (!total)
+		return 0.0;
+	return 100.0 * (b->busy - a->busy) / total * (ncpu > 0 ? ncpu : 1);
+}
+
+// 本进程CPU占用（以单核为100%）
+static double cpu_snapshot_self_pct(const struct cpu_snapshot *a, const struct cpu_snapshot *b)
+{
+	double used_ms = (b->self.ru_utime.tv_sec - a->self.ru_utime.tv_sec) * 1000.0 +
+					 (b->self.ru_utime.tv_usec - a->self.ru_utime.tv_usec) / 1000.0 +
+					 (b->self.ru_stime.tv_sec - a->self.ru_stime.tv_sec) * 1000.0 +
+					 (b->self.ru_stime.tv_usec - a->self.ru_stime.tv_usec) / 1000.0;
+	double wall_ms = ts_diff_ms(&a->ts, &b->ts);
+
+	return wall_ms > 0 ? 100.0 * used_ms / wall_ms : 0.0;
+}
+
+static void bench_cam_close(struct bench_cam *cam)
+{
+	__u32 i;
+
+	for (i = 0; i < cam->nbufs; i++) {
+		if (cam->buffers[i] && cam->buffers[i] != MAP_FAILED)
+			munmap(cam->buffers[i], cam->lengths[i]);
+		cam->buffers[i] = NULL;
+	}
+	cam->nbufs = 0;
+	for (i = 0; (cam->qbuf_flags & MYCAM_BUF_FLAG_OUT_FENCE) && i < NUM_BUFFERS; i++) {
+		if (cam->fence_fd[i] >= 0)
+			close(cam->fence_fd[i]);
+		cam->fence_fd[i] = -1;
+	}
+	if (cam->fd >= 0)
+		close(cam->fd);
+	cam->fd = -1;
+}
+
+// 打开设备，设置格式和帧率，申请并映射缓冲区，全部入队
+static int bench_cam_setup(struct bench_cam *cam)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	__u32 i;
+
+	for (i = 0; i < NUM_BUFFERS; i++)
+		cam->fence_fd[i] = -1;
+
+	cam->fd = open(cam->dev, O_RDWR);
+	if (cam->fd < 0) {
+		perror("无法打开设备");
+		return -1;
+	}
+
+	memset(&cam->fmt, 0, sizeof(cam->fmt));
+	cam->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	cam->fmt.fmt.pix.width = cam->width;
+	cam->fmt.fmt.pix.height = cam->height;
+	cam->fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	cam->fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(cam->fd, VIDIOC_S_FMT, &cam->fmt) < 0) {
+		perror("设置视频格式失败");
+		goto err;
+	}
+	if (cam->fmt.fmt.pix.width != cam->width || cam->fmt.fmt.pix.height != cam->height)
+		printf("    注意：驱动将分辨率调整为 %ux%u\n", cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height);
+
+	if (cam->fps > 0) {
+		struct v4l2_streamparm parm;
+
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = cam->fps;
+		if (ioctl(cam->fd, VIDIOC_S_PARM, &parm) < 0) {
+			perror("设置帧率失败");
+			goto err;
+		}
+	}
+
+	cam->memory = cam->mem == BENCH_MEM_MMAP ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+
+	memset(&req, 0, sizeof(req));
+	req.count = NUM_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = cam->memory;
+	if (ioctl(cam->fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("请求缓冲区失败");
+		goto err;
+	}
+
+	for (i = 0; i < req.count && i < NUM_BUFFERS; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = cam->memory;
+		buf.index = i;
+		if (cam->mem == BENCH_MEM_MMAP) {
+			if (ioctl(cam->fd, VIDIOC_QUERYBUF, &buf) < 0) {
+				perror("查询缓冲区失败");
+				goto err;
+			}
+			cam->lengths[i] = buf.length;
+			cam->buffers[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, buf.m.offset);
+		} else {
+			// 两种用户内存都按 2MB 取整，只有页大小不同
+			cam->lengths[i] = (cam->fmt.fmt.pix.sizeimage + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+			cam->buffers[i] = mmap(NULL, cam->lengths[i], PROT_READ | PROT_WRITE,
+								   MAP_PRIVATE | MAP_ANONYMOUS |
+								   (cam->mem == BENCH_MEM_USER_HUGETLB ? MAP_HUGETLB : 0), -1, 0);
+			if (cam->buffers[i] != MAP_FAILED && cam->mem == BENCH_MEM_USER_4K)
+				madvise(cam->buffers[i], cam->lengths[i], MADV_NOHUGEPAGE);
+			buf.m.userptr = (unsigned long)cam->buffers[i];
+			buf.length = cam->lengths[i];
+		}
+		cam->nbufs = i + 1;
+		if (cam->buffers[i] == MAP_FAILED) {
+			perror(cam->mem == BENCH_MEM_USER_HUGETLB ? "分配大页内存失败（检查 /proc/sys/vm/nr_hugepages）" :
+				   "映射缓冲区失败");
+			goto err;
+		}
+		buf.flags = cam->qbuf_flags;
+		if (ioctl(cam->fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			goto err;
+		}
+		if (buf.flags & MYCAM_BUF_FLAG_OUT_FENCE)
+			cam->fence_fd[i] = buf.reserved2;
+	}
+
+	return 0;
+
+err:
+	bench_cam_close(cam);
+	return -1;
+}
+
+// 出流指定时长，统计帧率和丢帧
+static int bench_cam_run(struct bench_cam *cam, int seconds, struct rate_stats *st)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct timespec start, now;
+	struct v4l2_buffer buf;
+
+	memset(st, 0, sizeof(*st));
+
+	if (ioctl(cam->fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(cam->fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("出队缓冲区失败");
+			break;
+		}
+		rate_stats_update(st, &buf);
+		if (ioctl(cam->fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (ts_diff_ms(&start, &now) < seconds * 1000.0);
+
+	ioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+
+	return 0;
+}
+
+// 分辨率基准测试：每种配置输出持续帧率、CPU占用和丢帧
+static int run_resolution_benchmark(void)
+{
+	static const struct {
+		__u32 width;
+		__u32 height;
+		int fps;
+	} configs[] = {
+		{ 1280,  720, 30 },
+		{ 1280,  720, 60 },
+		{ 1920, 1080, 30 },
+		{ 1920, 1080, 60 },
+		{ 3840, 2160, 30 },
+	};
+	unsigned i;
+
+	printf("%-12s %5s %10s %8s %8s %10s %10s\n",
+		   "resolution", "fps", "achieved", "frames", "dropped", "sys_cpu%", "self_cpu%");
+
+	for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+		struct bench_cam cam;
+		struct rate_stats st;
+		struct cpu_snapshot a, b;
+		double achieved = 0.0;
+		char res[16];
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = configs[i].width;
+		cam.height = configs[i].height;
+		cam.fps = configs[i].fps;
+
+		if (bench_cam_setup(&cam) < 0)
+			return -1;
+
+		cpu_snapshot_take(&a);
+		bench_cam_run(&cam, bench_seconds, &st);
+		cpu_snapshot_take(&b);
+		bench_cam_close(&cam);
+
+		if (st.frames > 1 && st.last_ts_ms > st.first_ts_ms)
+			achieved = (st.frames - 1) * 1000.0 / (st.last_ts_ms - st.first_ts_ms);
+
+		snprintf(res, sizeof(res), "%ux%u", configs[i].width, configs[i].height);
+		printf("%-12s %5d %10.2f %8lu %8lu %10.1f %10.1f\n", res, configs[i].fps, achieved,
+			   st.frames, st.dropped, cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+	}
+
+	return 0;
+}
+
+#define MAX_CAMERAS 8
+
+// 扫描 /dev/video*，找出本驱动注册的采集节点
+static int find_cameras(char devs[][32], int max)
+{
+	struct v4l2_capability cap;
+	int i, fd, n = 0;
+
+	for (i = 0; i < 64 && n < max; i++) {
+		snprintf(devs[n], sizeof(devs[n]), "/dev/video%d", i);
+		fd = open(devs[n], O_RDWR);
+		if (fd < 0)
+			continue;
+		memset(&cap, 0, sizeof(cap));
+		if (!ioctl(fd, VIDIOC_QUERYCAP, &cap) && !strcmp((char *)cap.driver, "my_camera"))
+			n++;
+		close(fd);
+	}
+
+	return n;
+}
+
+// 多路同时出流，用poll轮流取帧，统计每一路的帧率和丢帧
+static int bench_multi_run(struct bench_cam *cams, int n, int seconds, struct rate_stats *st)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct pollfd pfds[MAX_CAMERAS];
+	struct timespec start, now;
+	struct v4l2_buffer buf;
+	int i, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		memset(&st[i], 0, sizeof(st[i]));
+		pfds[i].fd = cams[i].fd;
+		pfds[i].events = POLLIN;
+		if (ioctl(cams[i].fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("启动视频流失败");
+			n = i;
+			ret = -1;
+			goto stop;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (poll(pfds, n, 1000) < 0) {
+			perror("poll失败");
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(cams[i].fd, VIDIOC_DQBUF, &buf) < 0)
+				continue;
+			rate_stats_update(&st[i], &buf);
+			ioctl(cams[i].fd, VIDIOC_QBUF, &buf);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (ts_diff_ms(&start, &now) < seconds * 1000.0);
+
+stop:
+	for (i = 0; i < n; i++)
+		ioctl(cams[i].fd, VIDIOC_STREAMOFF, &type);
+
+	return ret;
+}
+
+// 多路扩展性基准测试：1/2/4/8 路同时出流，输出总帧率、最慢一路的帧率、丢帧和CPU占用
+static int run_scaling_benchmark(void)
+{
+	static const int counts[] = { 1, 2, 4, 8 };
+	char devs[MAX_CAMERAS][32];
+	int found = find_cameras(devs, MAX_CAMERAS);
+	int fps = target_fps > 0 ? target_fps : 30;
+	unsigned c;
+	int i;
+
+	printf("找到 %d 路摄像头，%ux%u@%d，每项持续 %d 秒\n", found, req_width, req_height, fps, bench_seconds);
+	printf("%-8s %10s %12s %8s %8s %10s %10s\n",
+		   "cameras", "total_fps", "min_cam_fps", "frames", "dropped", "sys_cpu%", "self_cpu%");
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		struct bench_cam cams[MAX_CAMERAS];
+		struct rate_stats st[MAX_CAMERAS];
+		struct cpu_snapshot a, b;
+		unsigned long frames = 0, dropped = 0;
+		double total = 0.0, min_fps = 0.0;
+		int n = counts[c];
+
+		if (n > found) {
+			printf("%-8d 跳过（只找到 %d 路）\n", n, found);
+			continue;
+		}
+
+		memset(cams, 0, sizeof(cams));
+		for (i = 0; i < n; i++) {
+			cams[i].fd = -1;
+			cams[i].dev = devs[i];
+			cams[i].width = req_width;
+			cams[i].height = req_height;
+			cams[i].fps = fps;
+			if (bench_cam_setup(&cams[i]) < 0) {
+				while (--i >= 0)
+					bench_cam_close(&cams[i]);
+				return -1;
+			}
+		}
+
+		cpu_snapshot_take(&a);
+		bench_multi_run(cams, n, bench_seconds, st);
+		cpu_snapshot_take(&b);
+
+		for (i = 0; i < n; i++) {
+			double achieved = 0.0;
+
+			if (st[i].frames > 1 && st[i].last_ts_ms > st[i].first_ts_ms)
+				achieved = (st[i].frames - 1) * 1000.0 / (st[i].last_ts_ms - st[i].first_ts_ms);
+			total += achieved;
+			if (i == 0 || achieved < min_fps)
+				min_fps = achieved;
+			frames += st[i].frames;
+			dropped += st[i].dropped;
+			bench_cam_close(&cams[i]);
+		}
+
+		printf("%-8d %10.2f %12.2f %8lu %8lu %10.1f %10.1f\n", n, total, min_fps, frames, dropped,
+			   cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+	}
+
+	return 0;
+}
+
+/*
+ * DMABUF导入测试：从dma-heap分配缓冲区，以 V4L2_MEMORY_DMABUF 导入驱动，
+ * 出流后检查每一帧都直接写进了这些外部缓冲区。
+ * dma-contig要求缓冲区物理连续（无IOMMU时），默认依次尝试CMA堆和system堆。
+ */
+static int dmaheap_alloc(const char *heap, size_t len)
+{
+	struct dma_heap_allocation_data data;
+	char path[64];
+	int heap_fd;
+
+	snprintf(path, sizeof(path), "/dev/dma_heap/%s", heap);
+	heap_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (heap_fd < 0)
+		return -1;
+
+	memset(&data, 0, sizeof(data));
+	data.len = len;
+	data.fd_flags = O_RDWR | O_CLOEXEC;
+	if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &data) < 0) {
+		close(heap_fd);
+		return -1;
+	}
+	close(heap_fd);
+
+	return data.fd;
+}
+
+static int dmabuf_sync(int fd, __u64 flags)
+{
+	struct dma_buf_sync sync = { .flags = flags };
+
+	return ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static int run_dmaheap_test(const char *heap)
+{
+	static const char *default_heaps[] = { "linux,cma", "reserved", "system" };
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct v4l2_requestbuffers req;
+	struct v4l2_format fmt;
+	struct v4l2_buffer buf;
+	int dmabuf_fds[NUM_BUFFERS];
+	void *maps[NUM_BUFFERS];
+	long frames = max_frames > 0 ? max_frames : 100;
+	struct rate_stats st;
+	unsigned long bad = 0;
+	size_t len = 0, h;
+	int fd, ret = -1;
+	__u32 i, nbufs = 0;
+
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		dmabuf_fds[i] = -1;
+		maps[i] = MAP_FAILED;
+	}
+
+	fd = open(camera_dev, O_RDWR);
+	if (fd < 0) {
+		perror("无法打开设备");
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = req_width;
+	fmt.fmt.pix.height = req_height;
+	fmt.fmt.pix.pixelformat = req_pixfmt;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("设置视频格式失败");
+		goto out;
+	}
+
+	// 按页对齐分配，每个缓冲区放一帧
+	len = (fmt.fmt.pix.sizeimage + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		if (heap) {
+			dmabuf_fds[i] = dmaheap_alloc(heap, len);
+		} else {
+			for (h = 0; h < sizeof(default_heaps) / sizeof(default_heaps[0]); h++) {
+				dmabuf_fds[i] = dmaheap_alloc(default_heaps[h], len);
+				if (dmabuf_fds[i] >= 0) {
+					if (i == 0)
+						printf("使用 dma-heap: %s\n", default_heaps[h]);
+					break;
+				}
+			}
+		}
+		if (dmabuf_fds[i] < 0) {
+			perror("从dma-heap分配缓冲区失败");
+			goto out;
+		}
+
+		// 先清零，出流后以非零数据判断帧确实写进了导入的缓冲区
+		maps[i] = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, dmabuf_fds[i], 0);
+		if (maps[i] == MAP_FAILED) {
+			perror("映射dmabuf失败");
+			goto out;
+		}
+		dmabuf_sync(dmabuf_fds[i], DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+		memset(maps[i], 0, len);
+		dmabuf_sync(dmabuf_fds[i], DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.count = NUM_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_DMABUF;
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("请求DMABUF缓冲区失败");
+		goto out;
+	}
+	nbufs = req.count < NUM_BUFFERS ? req.count : NUM_BUFFERS;
+
+	for (i = 0; i < nbufs; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_DMABUF;
+		buf.index = i;
+		buf.m.fd = dmabuf_fds[i];
+		buf.length = len;
+		if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("导入dmabuf失败");
+			goto out;
+		}
+	}
+
+	if (ioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		goto out;
+	}
+
+	while (frames-- > 0) {
+		unsigned char *p;
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_DMABUF;
+		if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("出队缓冲区失败");
+			break;
+		}
+		rate_stats_update(&st, &buf);
+
+		// 出队的fd必须是导入时的那个，数据必须是驱动写入的
+		p = maps[buf.index];
+		dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+		if (buf.m.fd != dmabuf_fds[buf.index] || buf.bytesused != fmt.fmt.pix.sizeimage ||
+			(!p[0] && !p[buf.bytesused - 1]))
+			bad++;
+		if (!quiet)
+			printf("index=%u, sequence=%u, bytesused=%u, data[0]=%#x\n",
+				   buf.index, buf.sequence, buf.bytesused, p[0]);
+		// 清掉首尾字节，下一次出队时仍能检查
+		p[0] = p[buf.bytesused - 1] = 0;
+		dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+
+		buf.m.fd = dmabuf_fds[buf.index];
+		buf.length = len;
+		if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			break;
+		}
+	}
+
+	ioctl(fd, VIDIOC_STREAMOFF, &type);
+
+	rate_stats_print(&st);
+	printf("    bad_frames: %lu\n", bad);
+	ret = (st.frames && !bad) ? 0 : -1;
+	printf("DMABUF导入测试%s\n", ret ? "失败" : "通过");
+
+out:
+	memset(&req, 0, sizeof(req));
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_DMABUF;
+	ioctl(fd, VIDIOC_REQBUFS, &req);
+	for (i = 0; i < NUM_BUFFERS; i++) {
+		if (maps[i] != MAP_FAILED)
+			munmap(maps[i], len);
+		if (dmabuf_fds[i] >= 0)
+			close(dmabuf_fds[i]);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * 多平面接口测试（驱动以 multiplanar=1 加载）：按 VIDEO_CAPTURE_MPLANE 设置格式，
+ * 逐个平面映射缓冲区，检查每个平面的载荷都等于驱动给出的平面大小
+ */
+static int run_mplane_test(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	void *maps[NUM_BUFFERS][VIDEO_MAX_PLANES];
+	__u32 lens[NUM_BUFFERS][VIDEO_MAX_PLANES];
+	struct v4l2_requestbuffers req;
+	struct v4l2_format fmt;
+	struct v4l2_buffer buf;
+	long frames = max_frames > 0 ? max_frames : 100;
+	struct rate_stats st;
+	unsigned long bad = 0;
+	__u32 i, p, nbufs = 0, nplanes;
+	int fd, ret = -1;
+
+	memset(&st, 0, sizeof(st));
+	memset(maps, 0, sizeof(maps));
+
+	fd = open(camera_dev, O_RDWR);
+	if (fd < 0) {
+		perror("无法打开设备");
+		return -1;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = type;
+	fmt.fmt.pix_mp.width = req_width;
+	fmt.fmt.pix_mp.height = req_height;
+	fmt.fmt.pix_mp.pixelformat = req_pixfmt;
+	fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
+		perror("设置多平面格式失败（驱动需以 multiplanar=1 加载）");
+		goto out;
+	}
+	nplanes = fmt.fmt.pix_mp.num_planes;
+	printf("VIDIOC_S_FMT: %ux%u, format=%.4s, num_planes=%u\n", fmt.fmt.pix_mp.width,
+		   fmt.fmt.pix_mp.height, (char *)&fmt.fmt.pix_mp.pixelformat, nplanes);
+	for (p = 0; p < nplanes; p++)
+		printf("    plane%u: bytesperline=%u, sizeimage=%u\n", p,
+			   fmt.fmt.pix_mp.plane_fmt[p].bytesperline, fmt.fmt.pix_mp.plane_fmt[p].sizeimage);
+
+	memset(&req, 0, sizeof(req));
+	req.count = NUM_BUFFERS;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) < 0) {
+		perror("请求缓冲区失败");
+		goto out;
+	}
+	nbufs = req.count < NUM_BUFFERS ? req.count : NUM_BUFFERS;
+
+	for (i = 0; i < nbufs; i++) {
+		memset(&buf, 0, sizeof(buf));
+		memset(planes, 0, sizeof(planes));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		buf.m.planes = planes;
+		buf.length = VIDEO_MAX_PLANES;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf) < 0) {
+			perror("查询缓冲区失败");
+			goto out;
+		}
+		for (p = 0; p < buf.length; p++) {
+			lens[i][p] = planes[p].length;
+			maps[i][p] = mmap(NULL, planes[p].length, PROT_READ | PROT_WRITE, MAP_SHARED,
+							  fd, planes[p].m.mem_offset);
+			if (maps[i][p] == MAP_FAILED) {
+				maps[i][p] = NULL;
+				perror("映射平面失败");
+				goto out;
+			}
+		}
+		if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			goto out;
+		}
+	}
+
+	if (ioctl(fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		goto out;
+	}
+
+	while (frames-- > 0) {
+		memset(&buf, 0, sizeof(buf));
+		memset(planes, 0, sizeof(planes));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.m.planes = planes;
+		buf.length = VIDEO_MAX_PLANES;
+		if (ioctl(fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("出队缓冲区失败");
+			break;
+		}
+		rate_stats_update(&st, &buf);
+
+		if (buf.length != nplanes)
+			bad++;
+		for (p = 0; p < buf.length && p < nplanes; p++) {
+			if (planes[p].bytesused != fmt.fmt.pix_mp.plane_fmt[p].sizeimage)
+				bad++;
+		}
+		if (!quiet)
+			printf("index=%u, sequence=%u, bytesused=%u/%u\n", buf.index, buf.sequence,
+				   planes[0].bytesused, nplanes > 1 ? planes[1].bytesused : 0);
+
+		if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			break;
+		}
+	}
+
+	ioctl(fd, VIDIOC_STREAMOFF, &type);
+
+	rate_stats_print(&st);
+	printf("    bad_frames: %lu\n", bad);
+	ret = (st.frames && !bad) ? 0 : -1;
+	printf("多平面测试%s\n", ret ? "失败" : "通过");
+
+out:
+	for (i = 0; i < nbufs; i++) {
+		for (p = 0; p < VIDEO_MAX_PLANES; p++) {
+			if (maps[i][p])
+				munmap(maps[i][p], lens[i][p]);
+		}
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * 流控测试：模拟处理不过来的用户程序（每帧处理两个帧周期），分别在 video 节点丢帧和在源头丢帧，
+ * 比较实际帧率、两种丢帧计数和CPU占用。源头丢帧时 CSI/ISP 不再为注定丢弃的帧做无用功。
+ */
+static long long get_ctrl64(int fd, __u32 id)
+{
+	struct v4l2_ext_control ctrl;
+	struct v4l2_ext_controls ctrls;
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	memset(&ctrls, 0, sizeof(ctrls));
+	ctrl.id = id;
+	ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+	ctrls.count = 1;
+	ctrls.controls = &ctrl;
+	if (ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls) < 0)
+		return -1;
+
+	return ctrl.value64;
+}
+
+static int run_backpressure_test(void)
+{
+	static const char *const names[] = { "drop at sink", "drop at source" };
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int fps = target_fps > 0 ? target_fps : 30;
+	int policy;
+
+	printf("%ux%u@%d，用户程序每帧耗时 %d ms，每项持续 %d 秒\n", req_width, req_height, fps, 2000 / fps, bench_seconds);
+	printf("%-16s %10s %8s %12s %10s %10s %10s\n",
+		   "policy", "achieved", "frames", "drop_source", "drop_sink", "sys_cpu%", "self_cpu%");
+
+	for (policy = 0; policy <= 1; policy++) {
+		struct bench_cam cam;
+		struct rate_stats st;
+		struct cpu_snapshot a, b;
+		struct v4l2_control ctrl;
+		struct v4l2_buffer buf;
+		struct timespec start, now;
+		double achieved = 0.0;
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		if (bench_cam_setup(&cam) < 0)
+			return -1;
+
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = MYCAM_CID_DROP_POLICY;
+		ctrl.value = policy;
+		if (ioctl(cam.fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+			perror("设置丢帧策略失败");
+			bench_cam_close(&cam);
+			return -1;
+		}
+
+		memset(&st, 0, sizeof(st));
+		if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("启动视频流失败");
+			bench_cam_close(&cam);
+			return -1;
+		}
+
+		cpu_snapshot_take(&a);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+				perror("出队缓冲区失败");
+				break;
+			}
+			rate_stats_update(&st, &buf);
+
+			// 处理一帧要两个帧周期，缓冲区被占住，驱动很快就没有空闲缓冲区
+			usleep(2000000 / fps);
+
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+		cpu_snapshot_take(&b);
+
+		// 计数在下一次出流时清零，停流前后读都可以
+		if (st.frames > 1 && st.last_ts_ms > st.first_ts_ms)
+			achieved = (st.frames - 1) * 1000.0 / (st.last_ts_ms - st.first_ts_ms);
+		printf("%-16s %10.2f %8lu %12lld %10lld %10.1f %10.1f\n", names[policy], achieved, st.frames,
+			   get_ctrl64(cam.fd, MYCAM_CID_DROPPED_SOURCE), get_ctrl64(cam.fd, MYCAM_CID_DROPPED_SINK),
+			   cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+
+		ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+		bench_cam_close(&cam);
+	}
+
+	return 0;
+}
+
+/*
+ * 抽帧测试：sensor 以 -r 帧率运行，frame_divider 分别取 1/2/6，检查送到用户的帧率和帧序号间隔，以及CPU占用
+ */
+static int run_divider_test(void)
+{
+	static const int dividers[] = { 1, 2, 6 };
+	int fps = target_fps > 0 ? target_fps : 30;
+	unsigned d;
+
+	printf("sensor %ux%u@%d，每项持续 %d 秒\n", req_width, req_height, fps, bench_seconds);
+	printf("%-8s %10s %10s %8s %8s %10s %10s\n",
+		   "divider", "expected", "achieved", "frames", "dropped", "sys_cpu%", "self_cpu%");
+
+	for (d = 0; d < sizeof(dividers) / sizeof(dividers[0]); d++) {
+		struct bench_cam cam;
+		struct rate_stats st;
+		struct cpu_snapshot a, b;
+		struct v4l2_control ctrl;
+		double achieved = 0.0;
+		unsigned long dropped;
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		if (bench_cam_setup(&cam) < 0)
+			return -1;
+
+		memset(&ctrl, 0, sizeof(ctrl));
+		ctrl.id = MYCAM_CID_FRAME_DIVIDER;
+		ctrl.value = dividers[d];
+		if (ioctl(cam.fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+			perror("设置抽帧失败");
+			bench_cam_close(&cam);
+			return -1;
+		}
+
+		cpu_snapshot_take(&a);
+		bench_cam_run(&cam, bench_seconds, &st);
+		cpu_snapshot_take(&b);
+
+		// 恢复默认，不影响之后使用该节点的程序
+		ctrl.value = 1;
+		ioctl(cam.fd, VIDIOC_S_CTRL, &ctrl);
+		bench_cam_close(&cam);
+
+		if (st.frames > 1 && st.last_ts_ms > st.first_ts_ms)
+			achieved = (st.frames - 1) * 1000.0 / (st.last_ts_ms - st.first_ts_ms);
+
+		// 驱动按实际到达的帧抽帧，被抽掉的帧在序号上留下 divider-1 的间隔，扣除后剩下的是丢帧和上游的序号空洞
+		dropped = st.dropped;
+		if (st.frames > 1 && dropped >= (st.frames - 1) * (dividers[d] - 1))
+			dropped -= (st.frames - 1) * (dividers[d] - 1);
+
+		printf("%-8d %10.2f %10.2f %8lu %8lu %10.1f %10.1f\n", dividers[d], (double)fps / dividers[d], achieved,
+			   st.frames, dropped, cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+	}
+
+	return 0;
+}
+
+/*
+ * 共享出流测试（驱动需以 shared_stream=1 加载）：同一个节点先由1个、再由 n 个文件句柄同时出流，
+ * 输出每个句柄的帧率、帧序号空洞和驱动记录的本句柄丢帧，以及CPU占用
+ */
+static int run_shared_test(int clients)
+{
+	int fps = target_fps > 0 ? target_fps : 30;
+	int counts[2] = { 1, clients };
+	int c, i;
+
+	if (clients < 1 || clients > MAX_CAMERAS) {
+		fprintf(stderr, "句柄个数需在 1~%d 之间\n", MAX_CAMERAS);
+		return -1;
+	}
+
+	printf("%s %ux%u@%d，每项持续 %d 秒\n", camera_dev, req_width, req_height, fps, bench_seconds);
+	printf("%-8s %-6s %10s %8s %8s %14s %10s %10s\n",
+		   "clients", "client", "fps", "frames", "dropped", "client_dropped", "sys_cpu%", "self_cpu%");
+
+	for (c = 0; c < 2; c++) {
+		struct bench_cam cams[MAX_CAMERAS];
+		struct rate_stats st[MAX_CAMERAS];
+		struct cpu_snapshot a, b;
+		int n = counts[c];
+
+		if (c && n == counts[0])
+			break;
+
+		memset(cams, 0, sizeof(cams));
+		for (i = 0; i < n; i++) {
+			cams[i].fd = -1;
+			cams[i].dev = camera_dev;
+			cams[i].width = req_width;
+			cams[i].height = req_height;
+			cams[i].fps = fps;
+			if (bench_cam_setup(&cams[i]) < 0) {
+				if (i)
+					fprintf(stderr, "第 %d 个句柄申请缓冲区失败，驱动是否以 shared_stream=1 加载？\n", i + 1);
+				while (--i >= 0)
+					bench_cam_close(&cams[i]);
+				return -1;
+			}
+		}
+
+		cpu_snapshot_take(&a);
+		bench_multi_run(cams, n, bench_seconds, st);
+		cpu_snapshot_take(&b);
+
+		for (i = 0; i < n; i++) {
+			double achieved = 0.0;
+
+			if (st[i].frames > 1 && st[i].last_ts_ms > st[i].first_ts_ms)
+				achieved = (st[i].frames - 1) * 1000.0 / (st[i].last_ts_ms - st[i].first_ts_ms);
+
+			printf("%-8d %-6d %10.2f %8lu %8lu %14lld %10.1f %10.1f\n", n, i, achieved, st[i].frames, st[i].dropped,
+				   get_ctrl64(cams[i].fd, MYCAM_CID_CLIENT_DROPPED),
+				   cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+		}
+
+		for (i = 0; i < n; i++)
+			bench_cam_close(&cams[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * 首帧延迟测试：反复 STREAMON -> 第一次 DQBUF -> STREAMOFF，统计 STREAMON 返回耗时和出流到拿到第一帧的耗时。
+ * 每轮之间缓冲区保持映射，只重新入队，测的是驱动出流路径本身。
+ */
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void ttff_print(const char *name, double *v, int n)
+{
+	double sum = 0.0;
+	int i;
+
+	qsort(v, n, sizeof(*v), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+
+	printf("%-14s %8.3f %8.3f %8.3f %8.3f %8.3f\n", name, v[0], sum / n, v[n / 2], v[(n * 9) / 10], v[n - 1]);
+}
+
+static int run_ttff_benchmark(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int cycles = max_frames > 0 ? (int)max_frames : 20;
+	struct bench_cam cam;
+	struct v4l2_buffer buf;
+	struct timespec t0, t1, t2;
+	double *on_ms, *first_ms;
+	int ret = 0;
+	int c, done = 0;
+	__u32 i;
+
+	memset(&cam, 0, sizeof(cam));
+	cam.fd = -1;
+	cam.dev = camera_dev;
+	cam.width = req_width;
+	cam.height = req_height;
+	cam.fps = target_fps;
+	if (bench_cam_setup(&cam) < 0)
+		return -1;
+
+	on_ms = calloc(cycles, sizeof(*on_ms));
+	first_ms = calloc(cycles, sizeof(*first_ms));
+	if (!on_ms || !first_ms) {
+		ret = -1;
+		goto out;
+	}
+
+	for (c = 0; c < cycles; c++) {
+		// 从第二轮开始，停流时所有缓冲区都已出队，需要重新入队
+		for (i = 0; c > 0 && i < cam.nbufs; i++) {
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = i;
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				ret = -1;
+				goto out;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("启动视频流失败");
+			ret = -1;
+			goto out;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("出队缓冲区失败");
+			ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+			ret = -1;
+			goto out;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+
+		on_ms[done] = ts_diff_ms(&t0, &t1);
+		first_ms[done] = ts_diff_ms(&t0, &t2);
+		done++;
+		if (!quiet)
+			printf("cycle %3d: streamon %.3f ms, first frame %.3f ms (seq %u)\n",
+				   c, on_ms[c], first_ms[c], buf.sequence);
+	}
+
+out:
+	if (done > 0) {
+		printf("\n=== 首帧延迟（%d 轮，%ux%u） ===\n", done, cam.fmt.fmt.pix.width, cam.fmt.fmt.pix.height);
+		printf("%-14s %8s %8s %8s %8s %8s\n", "ms", "min", "avg", "p50", "p90", "max");
+		ttff_print("streamon", on_ms, done);
+		ttff_print("first_frame", first_ms, done);
+	}
+	free(on_ms);
+	free(first_ms);
+	bench_cam_close(&cam);
+
+	return ret;
+}
+
+/*
+ * 帧起始事件测试：订阅 V4L2_EVENT_FRAME_SYNC，用 poll() 同时等 POLLPRI（帧起始）和 POLLIN（帧完成），
+ * 按帧序号配对，统计帧起始事件比缓冲区完成早多少：
+ *   kernel: buf.timestamp（vb2_buffer_done）- 事件时间戳（帧起始通知）
+ *   user:   DQBUF 返回 - DQEVENT 返回，即用户程序实际多出的提前量
+ */
+#define SYNC_SLOTS	64
+
+static int run_frame_sync_test(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct {
+		__u32 seq;
+		int valid;
+		double ev_ms;		// 事件中的时间戳
+		double recv_ms;		// DQEVENT 返回的时刻
+	} sof[SYNC_SLOTS];
+	struct v4l2_event_subscription sub;
+	struct v4l2_event ev;
+	struct v4l2_buffer buf;
+	struct bench_cam cam;
+	struct pollfd pfd;
+	struct timespec start, now;
+	double *kernel_ms, *user_ms;
+	unsigned long events = 0, events_lost = 0, unmatched = 0;
+	__u32 next_ev_seq = 0;
+	int cap, n = 0;
+	int ret = 0;
+
+	memset(&cam, 0, sizeof(cam));
+	cam.fd = -1;
+	cam.dev = camera_dev;
+	cam.width = req_width;
+	cam.height = req_height;
+	cam.fps = target_fps;
+	if (bench_cam_setup(&cam) < 0)
+		return -1;
+
+	memset(&sub, 0, sizeof(sub));
+	sub.type = V4L2_EVENT_FRAME_SYNC;
+	if (ioctl(cam.fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0) {
+		perror("订阅帧起始事件失败");
+		bench_cam_close(&cam);
+		return -1;
+	}
+
+	cap = (target_fps > 0 ? target_fps : 240) * bench_seconds + SYNC_SLOTS;
+	kernel_ms = calloc(cap, sizeof(*kernel_ms));
+	user_ms = calloc(cap, sizeof(*user_ms));
+	if (!kernel_ms || !user_ms) {
+		ret = -1;
+		goto out;
+	}
+	memset(sof, 0, sizeof(sof));
+
+	if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		ret = -1;
+		goto out;
+	}
+
+	pfd.fd = cam.fd;
+	pfd.events = POLLIN | POLLPRI;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (poll(&pfd, 1, 1000) <= 0) {
+			fprintf(stderr, "等待帧超时\n");
+			break;
+		}
+
+		if (pfd.revents & POLLPRI) {
+			while (ioctl(cam.fd, VIDIOC_DQEVENT, &ev) == 0) {
+				__u32 seq = ev.u.frame_sync.frame_sequence;
+
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (ev.type != V4L2_EVENT_FRAME_SYNC)
+					continue;
+				if (events && seq != next_ev_seq)
+					events_lost += seq - next_ev_seq;
+				next_ev_seq = seq + 1;
+				events++;
+
+				sof[seq % SYNC_SLOTS].seq = seq;
+				sof[seq % SYNC_SLOTS].valid = 1;
+				sof[seq % SYNC_SLOTS].ev_ms = ev.timestamp.tv_sec * 1000.0 + ev.timestamp.tv_nsec / 1e6;
+				sof[seq % SYNC_SLOTS].recv_ms = now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+				if (ev.pending == 0)
+					break;
+			}
+		}
+
+		if (pfd.revents & POLLIN) {
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+				perror("出队缓冲区失败");
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			if (sof[buf.sequence % SYNC_SLOTS].valid && sof[buf.sequence % SYNC_SLOTS].seq == buf.sequence) {
+				if (n < cap) {
+					kernel_ms[n] = timeval_to_ms(&buf.timestamp) - sof[buf.sequence % SYNC_SLOTS].ev_ms;
+					user_ms[n] = now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - sof[buf.sequence % SYNC_SLOTS].recv_ms;
+					n++;
+				}
+				sof[buf.sequence % SYNC_SLOTS].valid = 0;
+			} else {
+				unmatched++;
+			}
+
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				break;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+
+	ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+
+	printf("\n=== 帧起始事件提前量（%ux%u，%d 秒） ===\n", cam.fmt.fmt.pix.width, cam.fmt.fmt.pix.height, bench_seconds);
+	printf("事件 %lu 个，丢失 %lu 个；配对的帧 %d 个，没有对应事件的帧 %lu 个\n", events, events_lost, n, unmatched);
+	if (n > 0) {
+		printf("%-14s %8s %8s %8s %8s %8s\n", "ms", "min", "avg", "p50", "p90", "max");
+		ttff_print("kernel_lead", kernel_ms, n);
+		ttff_print("user_lead", user_ms, n);
+	}
+
+out:
+	free(kernel_ms);
+	free(user_ms);
+	bench_cam_close(&cam);
+
+	return ret;
+}
+
+/*
+ * 完成环基准测试：同一配置下分别用 DQBUF/QBUF、完成环+poll、完成环+定时批量取帧出流，
+ * 比较每帧的系统调用次数和CPU占用。小分辨率、高帧率时差别最明显，例如 -Q -W 320 -H 240 -r 240。
+ */
+enum ring_mode {
+	RING_OFF,		// 每帧一对 DQBUF/QBUF
+	RING_POLL,		// poll() 等完成队列非空，一次取走所有完成的帧
+	RING_BATCH,		// 不 poll，每隔半个缓冲区队列的时长醒来一次批量取帧
+};
+
+static int bench_cam_run_ring(struct bench_cam *cam, enum ring_mode mode, int seconds,
+							  struct rate_stats *st, unsigned long *syscalls)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct mycam_ring_setup setup;
+	struct mycam_ring *ring;
+	struct timespec start, now;
+	struct pollfd pfd;
+	__u32 head, tail, sq_head;
+	long batch_us;
+	int ret = 0;
+
+	memset(st, 0, sizeof(*st));
+	*syscalls = 0;
+
+	memset(&setup, 0, sizeof(setup));
+	setup.enable = 1;
+	if (ioctl(cam->fd, MYCAM_IOC_RING_SETUP, &setup) < 0) {
+		perror("打开完成环失败");
+		return -1;
+	}
+	ring = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, setup.mmap_offset);
+	if (ring == MAP_FAILED) {
+		perror("映射完成环失败");
+		return -1;
+	}
+
+	if (ioctl(cam->fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		munmap(ring, setup.size);
+		return -1;
+	}
+
+	batch_us = 1000000L / (cam->fps > 0 ? cam->fps : 30) * (cam->nbufs / 2 ? cam->nbufs / 2 : 1);
+	pfd.fd = cam->fd;
+	pfd.events = POLLIN;
+	sq_head = 0;
+	tail = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (mode == RING_POLL) {
+			if (poll(&pfd, 1, 1000) <= 0) {
+				fprintf(stderr, "等待帧超时\n");
+				ret = -1;
+				break;
+			}
+		} else {
+			usleep(batch_us);
+		}
+		(*syscalls)++;
+
+		// 取走所有已完成的帧，处理完立刻通过提交队列归还
+		head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			const struct mycam_ring_cqe *cqe = &ring->cqes[tail % setup.entries];
+			struct v4l2_buffer buf;
+
+			memset(&buf, 0, sizeof(buf));
+			buf.index = cqe->index;
+			buf.sequence = cqe->sequence;
+			buf.timestamp.tv_sec = cqe->timestamp_ns / 1000000000ULL;
+			buf.timestamp.tv_usec = (cqe->timestamp_ns % 1000000000ULL) / 1000;
+			if (!(cqe->flags & MYCAM_RING_F_ERROR))
+				rate_stats_update(st, &buf);
+
+			ring->sqes[sq_head % setup.entries] = cqe->index;
+			sq_head++;
+		}
+		__atomic_store_n(&ring->cq_tail, tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&ring->sq_head, sq_head, __ATOMIC_RELEASE);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (ts_diff_ms(&start, &now) < seconds * 1000.0);
+
+	ioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+	munmap(ring, setup.size);
+
+	setup.enable = 0;
+	ioctl(cam->fd, MYCAM_IOC_RING_SETUP, &setup);
+
+	return ret;
+}
+
+static int run_ring_benchmark(void)
+{
+	static const char *names[] = { "qbuf/dqbuf", "ring+poll", "ring+batch" };
+	int fps = target_fps > 0 ? target_fps : 240;
+	int m;
+
+	printf("%ux%u@%d，每项持续 %d 秒\n", req_width, req_height, fps, bench_seconds);
+	printf("%-12s %10s %8s %8s %14s %10s %10s\n",
+		   "mode", "achieved", "frames", "dropped", "syscalls/frame", "sys_cpu%", "self_cpu%");
+
+	for (m = RING_OFF; m <= RING_BATCH; m++) {
+		struct bench_cam cam;
+		struct rate_stats st;
+		struct cpu_snapshot a, b;
+		unsigned long syscalls = 0;
+		double achieved = 0.0;
+		int ret;
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		if (bench_cam_setup(&cam) < 0)
+			return -1;
+
+		cpu_snapshot_take(&a);
+		if (m == RING_OFF) {
+			ret = bench_cam_run(&cam, bench_seconds, &st);
+			syscalls = st.frames * 2;
+		} else {
+			ret = bench_cam_run_ring(&cam, m, bench_seconds, &st, &syscalls);
+		}
+		cpu_snapshot_take(&b);
+		bench_cam_close(&cam);
+		if (ret < 0)
+			return -1;
+
+		if (st.frames > 1 && st.last_ts_ms > st.first_ts_ms)
+			achieved = (st.frames - 1) * 1000.0 / (st.last_ts_ms - st.first_ts_ms);
+
+		printf("%-12s %10.2f %8lu %8lu %14.2f %10.1f %10.1f\n", names[m], achieved, st.frames, st.dropped,
+			   st.frames ? (double)syscalls / st.frames : 0.0,
+			   cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+	}
+
+	return 0;
+}
+
+/*
+ * 输出 fence 测试：每次 QBUF 都带 MYCAM_BUF_FLAG_OUT_FENCE，消费者只 poll() 各缓冲区的 fence，
+ * fence 信号后再非阻塞 DQBUF 取走，全程没有阻塞的 DQBUF。与阻塞 DQBUF 比较从缓冲区完成到消费者醒来的延迟。
+ */
+static double fence_signal_ms(int fd, int *status)
+{
+	struct sync_fence_info info;
+	struct sync_file_info file_info;
+
+	memset(&info, 0, sizeof(info));
+	memset(&file_info, 0, sizeof(file_info));
+	file_info.num_fences = 1;
+	file_info.sync_fence_info = (__u64)(unsigned long)&info;
+	if (ioctl(fd, SYNC_IOC_FILE_INFO, &file_info) < 0) {
+		*status = -errno;
+		return -1.0;
+	}
+
+	*status = info.status;
+	return info.timestamp_ns / 1e6;
+}
+
+static int run_fence_test(void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct bench_cam cam;
+	struct rate_stats st;
+	struct v4l2_buffer buf;
+	struct pollfd pfds[NUM_BUFFERS];
+	__u32 owner[NUM_BUFFERS];
+	struct timespec start, now;
+	double *fence_wake, *dqbuf_wake;
+	unsigned long eagain = 0, fence_errors = 0;
+	int cap, nf = 0, nd = 0, n, status;
+	int ret = 0;
+	__u32 i;
+
+	cap = (target_fps > 0 ? target_fps : 240) * bench_seconds + 1;
+	fence_wake = calloc(cap, sizeof(*fence_wake));
+	dqbuf_wake = calloc(cap, sizeof(*dqbuf_wake));
+	if (!fence_wake || !dqbuf_wake) {
+		ret = -1;
+		goto out_free;
+	}
+
+	// 1. 阻塞 DQBUF：从 vb2_buffer_done（buf.timestamp）到 DQBUF 返回
+	memset(&cam, 0, sizeof(cam));
+	cam.fd = -1;
+	cam.dev = camera_dev;
+	cam.width = req_width;
+	cam.height = req_height;
+	cam.fps = target_fps;
+	if (bench_cam_setup(&cam) < 0) {
+		ret = -1;
+		goto out_free;
+	}
+	if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		bench_cam_close(&cam);
+		ret = -1;
+		goto out_free;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+			perror("出队缓冲区失败");
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (nd < cap)
+			dqbuf_wake[nd++] = now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - timeval_to_ms(&buf.timestamp);
+		if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+			perror("入队缓冲区失败");
+			break;
+		}
+	} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+	ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+	bench_cam_close(&cam);
+
+	// 2. 输出 fence：初始入队就带 fence，之后只等 fence
+	memset(&cam, 0, sizeof(cam));
+	cam.fd = -1;
+	cam.dev = camera_dev;
+	cam.width = req_width;
+	cam.height = req_height;
+	cam.fps = target_fps;
+	cam.qbuf_flags = MYCAM_BUF_FLAG_OUT_FENCE;
+	if (bench_cam_setup(&cam) < 0) {
+		ret = -1;
+		goto out_free;
+	}
+	fcntl(cam.fd, F_SETFL, fcntl(cam.fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&st, 0, sizeof(st));
+	if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+		perror("启动视频流失败");
+		ret = -1;
+		goto out_close;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (i = 0, n = 0; i < cam.nbufs; i++) {
+			if (cam.fence_fd[i] < 0)
+				continue;
+			pfds[n].fd = cam.fence_fd[i];
+			pfds[n].events = POLLIN;
+			owner[n++] = i;
+		}
+		if (n == 0 || poll(pfds, n, 1000) <= 0) {
+			fprintf(stderr, "等待 fence 超时\n");
+			ret = -1;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for (i = 0; i < (__u32)n; i++) {
+			double signal_ms;
+
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+
+			// fence 信号时消费者就可以开始处理这个缓冲区，这里只记录醒来的延迟
+			signal_ms = fence_signal_ms(pfds[i].fd, &status);
+			if (status < 0)
+				fence_errors++;
+			else if (nf < cap && signal_ms > 0)
+				fence_wake[nf++] = now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - signal_ms;
+			close(pfds[i].fd);
+			cam.fence_fd[owner[i]] = -1;
+
+			// 缓冲区已经交还，非阻塞 DQBUF 应当立即成功；顺序不一定与 fence 一致，取到哪个就给哪个重新挂 fence
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+				if (errno == EAGAIN)
+					eagain++;
+				else
+					perror("出队缓冲区失败");
+				continue;
+			}
+			rate_stats_update(&st, &buf);
+
+			if (cam.fence_fd[buf.index] >= 0) {
+				close(cam.fence_fd[buf.index]);
+				cam.fence_fd[buf.index] = -1;
+			}
+			buf.flags = MYCAM_BUF_FLAG_OUT_FENCE;
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				continue;
+			}
+			cam.fence_fd[buf.index] = buf.reserved2;
+		}
+	} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+	ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+
+	printf("\n=== 输出 fence（%ux%u，%d 秒） ===\n", cam.fmt.fmt.pix.width, cam.fmt.fmt.pix.height, bench_seconds);
+	printf("经 fence 取到 %lu 帧，丢帧 %lu，非阻塞 DQBUF 取不到 %lu 次，带错误的 fence %lu 个\n",
+		   st.frames, st.dropped, eagain, fence_errors);
+	printf("%-14s %8s %8s %8s %8s %8s\n", "ms", "min", "avg", "p50", "p90", "max");
+	if (nd > 0)
+		ttff_print("dqbuf_wake", dqbuf_wake, nd);
+	if (nf > 0)
+		ttff_print("fence_wake", fence_wake, nf);
+
+out_close:
+	bench_cam_close(&cam);
+out_free:
+	free(fence_wake);
+	free(dqbuf_wake);
+
+	return ret;
+}
+
+/*
+ * 像素扫描测试：每帧做一次按行的顺序扫描和一次按列的扫描，输出每帧耗时和带宽。按列扫描每行跨一个跨距，
+ * 几乎每次访问都落在不同的 4KB 页上，对 TLB 和 cache 最敏感。依次比较三种缓冲区：
+ *   mmap：驱动分配的缓冲区，用户映射是 4KB 页；
+ *   user4k：自己分配的普通内存（关掉透明大页）按 USERPTR 交给驱动，同样是 4KB 页；
+ *   hugetlb：自己分配的 MAP_HUGETLB 内存按 USERPTR 交给驱动，用户映射是 2MB 页。
+ * user4k 和 hugetlb 只差页大小，两者的差别就是大页 TLB 覆盖带来的。USERPTR 要求驱动以 hugepage_buffers=1
+ * 或 cached_buffers=1 加载，hugetlb 要求事先预留大页，例如 echo 16 > /proc/sys/vm/nr_hugepages。
+ */
+
+// 按行扫描：累加所有字节
+static unsigned long scan_rows(const unsigned char *p, __u32 stride, __u32 width_bytes, __u32 height)
+{
+	unsigned long sum = 0;
+	__u32 x, y;
+
+	for (y = 0; y < height; y++, p += stride) {
+		for (x = 0; x < width_bytes; x++)
+			sum += p[x];
+	}
+
+	return sum;
+}
+
+// 按列扫描：每列从上到下，每次访问间隔一个跨距
+static unsigned long scan_cols(const unsigned char *p, __u32 stride, __u32 width_bytes, __u32 height)
+{
+	unsigned long sum = 0;
+	__u32 x, y;
+
+	for (x = 0; x < width_bytes; x++) {
+		const unsigned char *q = p + x;
+
+		for (y = 0; y < height; y++, q += stride)
+			sum += *q;
+	}
+
+	return sum;
+}
+
+static int run_scan_test(void)
+{
+	static const char *names[] = { "mmap", "user4k", "hugetlb" };
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int fps = target_fps > 0 ? target_fps : 30;
+	volatile unsigned long sink = 0;
+	int m;
+
+	printf("%ux%u@%d，每项持续 %d 秒\n", req_width, req_height, fps, bench_seconds);
+	printf("%-8s %8s %10s %10s %10s %10s %10s\n", "mem", "frames", "length", "row_ms", "row_GB/s", "col_ms", "col_GB/s");
+
+	for (m = BENCH_MEM_MMAP; m <= BENCH_MEM_USER_HUGETLB; m++) {
+		struct bench_cam cam;
+		struct v4l2_buffer buf;
+		struct timespec start, now, t0, t1, t2;
+		double row_ms = 0.0, col_ms = 0.0;
+		unsigned long frames = 0;
+		__u32 stride, width_bytes, height;
+		double bytes;
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		cam.mem = m;
+		// 驱动不支持 USERPTR 或者没有预留大页时跳过这一项，其余照常比较
+		if (bench_cam_setup(&cam) < 0) {
+			printf("%-8s %8s\n", names[m], "跳过");
+			continue;
+		}
+
+		stride = cam.fmt.fmt.pix.bytesperline;
+		height = cam.fmt.fmt.pix.height;
+		width_bytes = cam.fmt.fmt.pix.width * 2;	// YUYV
+		if (!stride)
+			stride = width_bytes;
+		bytes = (double)width_bytes * height;
+
+		if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("启动视频流失败");
+			bench_cam_close(&cam);
+			return -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = cam.memory;
+			if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+				perror("出队缓冲区失败");
+				break;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			sink += scan_rows(cam.buffers[buf.index], stride, width_bytes, height);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			sink += scan_cols(cam.buffers[buf.index], stride, width_bytes, height);
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+			row_ms += ts_diff_ms(&t0, &t1);
+			col_ms += ts_diff_ms(&t1, &t2);
+			frames++;
+
+			// DQBUF 回填了 m.userptr 和 length，原样入队即可
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+
+		ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+
+		if (frames) {
+			row_ms /= frames;
+			col_ms /= frames;
+		}
+		printf("%-8s %8lu %10u %10.3f %10.2f %10.3f %10.2f\n", names[m], frames, cam.lengths[0],
+			   row_ms, row_ms > 0 ? bytes / row_ms / 1e6 : 0.0,
+			   col_ms, col_ms > 0 ? bytes / col_ms / 1e6 : 0.0);
+		bench_cam_close(&cam);
+	}
+	(void)sink;
+
+	return 0;
+}
+
+/*
+ * cache 测试：分别以不可缓存（默认 dma-contig）和可缓存（cached_buffers=1）加载驱动各跑一次，比较按行扫描一帧的耗时。
+ * 每次运行依次测三种用法：
+ *   sync：普通 QBUF/DQBUF，驱动在 QBUF 时写回、DQBUF 时作废 cache；
+ *   nosync：QBUF 带 NO_CACHE_INVALIDATE|NO_CACHE_CLEAN，模拟从不用CPU访问像素的客户端，驱动不做 cache 维护，
+ *           可缓存时CPU可能读到旧数据，这里只用来看省下的开销；
+ *   dmabuf：同样带两个标志，改为 EXPBUF 导出后映射 dmabuf，扫描前后用 DMA_BUF_IOCTL_SYNC 自己维护。
+ */
+static int read_module_param(const char *path)
+{
+	char c = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+	if (fread(&c, 1, 1, f) != 1)
+		c = 0;
+	fclose(f);
+
+	return c == 'Y' || c == '1';
+}
+
+enum cache_mode {
+	CACHE_SYNC,
+	CACHE_NOSYNC,
+	CACHE_DMABUF,
+};
+
+static int run_cache_scan_test(void)
+{
+	static const char *names[] = { "sync", "nosync", "dmabuf" };
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int fps = target_fps > 0 ? target_fps : 30;
+	int cached = read_module_param("/sys/module/my_camera/parameters/cached_buffers");
+	int huge = read_module_param("/sys/module/my_camera/parameters/hugepage_buffers");
+	volatile unsigned long sink = 0;
+	int m;
+
+	printf("驱动缓冲区：%s\n", cached > 0 || huge > 0 ? "可缓存" : cached < 0 ? "未知" : "不可缓存（dma-contig）");
+	printf("%ux%u@%d，每项持续 %d 秒\n", req_width, req_height, fps, bench_seconds);
+	printf("%-8s %8s %10s %10s %10s %10s\n", "mode", "frames", "dqbuf_ms", "scan_ms", "scan_GB/s", "qbuf_ms");
+
+	for (m = CACHE_SYNC; m <= CACHE_DMABUF; m++) {
+		struct bench_cam cam;
+		struct v4l2_buffer buf;
+		struct v4l2_exportbuffer expbuf;
+		struct pollfd pfd;
+		struct timespec start, now, t0, t1, t2, t3;
+		void *maps[NUM_BUFFERS] = { NULL };
+		int dmabuf_fds[NUM_BUFFERS];
+		double dqbuf_ms = 0.0, scan_ms = 0.0, qbuf_ms = 0.0;
+		unsigned long frames = 0;
+		__u32 stride, width_bytes, height, i;
+		double bytes;
+		int ret = 0;
+
+		for (i = 0; i < NUM_BUFFERS; i++)
+			dmabuf_fds[i] = -1;
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		if (m != CACHE_SYNC)
+			cam.qbuf_flags = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+		if (bench_cam_setup(&cam) < 0)
+			return -1;
+
+		for (i = 0; i < cam.nbufs; i++) {
+			maps[i] = cam.buffers[i];
+			if (m != CACHE_DMABUF)
+				continue;
+
+			memset(&expbuf, 0, sizeof(expbuf));
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			expbuf.index = i;
+			expbuf.flags = O_RDWR | O_CLOEXEC;
+			if (ioctl(cam.fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+				perror("导出缓冲区失败");
+				ret = -1;
+				goto out_close;
+			}
+			dmabuf_fds[i] = expbuf.fd;
+			maps[i] = mmap(NULL, cam.lengths[i], PROT_READ | PROT_WRITE, MAP_SHARED, expbuf.fd, 0);
+			if (maps[i] == MAP_FAILED) {
+				perror("映射dmabuf失败");
+				maps[i] = NULL;
+				ret = -1;
+				goto out_close;
+			}
+		}
+
+		stride = cam.fmt.fmt.pix.bytesperline;
+		height = cam.fmt.fmt.pix.height;
+		width_bytes = cam.fmt.fmt.pix.width * 2;	// YUYV
+		if (!stride)
+			stride = width_bytes;
+		bytes = (double)width_bytes * height;
+
+		if (ioctl(cam.fd, VIDIOC_STREAMON, &type) < 0) {
+			perror("启动视频流失败");
+			ret = -1;
+			goto out_close;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		do {
+			// 先等帧就绪，DQBUF 的耗时只剩出队本身和 cache 作废
+			pfd.fd = cam.fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 1000) <= 0) {
+				fprintf(stderr, "等待帧超时\n");
+				break;
+			}
+
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (ioctl(cam.fd, VIDIOC_DQBUF, &buf) < 0) {
+				perror("出队缓冲区失败");
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			// dmabuf 方式的扫描时间包括 begin/end 同步
+			if (m == CACHE_DMABUF)
+				dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+			sink += scan_rows(maps[buf.index], stride, width_bytes, height);
+			if (m == CACHE_DMABUF)
+				dmabuf_sync(dmabuf_fds[buf.index], DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+			clock_gettime(CLOCK_MONOTONIC, &t2);
+
+			buf.flags = cam.qbuf_flags;
+			if (ioctl(cam.fd, VIDIOC_QBUF, &buf) < 0) {
+				perror("入队缓冲区失败");
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &t3);
+
+			dqbuf_ms += ts_diff_ms(&t0, &t1);
+			scan_ms += ts_diff_ms(&t1, &t2);
+			qbuf_ms += ts_diff_ms(&t2, &t3);
+			frames++;
+			now = t3;
+		} while (ts_diff_ms(&start, &now) < bench_seconds * 1000.0);
+
+		ioctl(cam.fd, VIDIOC_STREAMOFF, &type);
+
+		if (frames) {
+			dqbuf_ms /= frames;
+			scan_ms /= frames;
+			qbuf_ms /= frames;
+		}
+		printf("%-8s %8lu %10.3f %10.3f %10.2f %10.3f\n", names[m], frames, dqbuf_ms,
+			   scan_ms, scan_ms > 0 ? bytes / scan_ms / 1e6 : 0.0, qbuf_ms);
+
+out_close:
+		for (i = 0; i < NUM_BUFFERS; i++) {
+			if (dmabuf_fds[i] < 0)
+				continue;
+			if (maps[i])
+				munmap(maps[i], cam.lengths[i]);
+			close(dmabuf_fds[i]);
+		}
+		bench_cam_close(&cam);
+		if (ret < 0)
+			return ret;
+	}
+	(void)sink;
+
+	return 0;
+}
+
+/*
+ * 通路切换测试：通过媒体设备在 CSI -> ISP -> video 和 CSI -> video（旁路ISP）两条通路间切换，
+ * 分别出流并比较帧率和丢帧，结束后恢复为经过ISP的通路。
+ */
+static int media_find_entity(int fd, const char *name, __u32 *id)
+{
+	struct media_entity_desc ent;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.id = MEDIA_ENT_ID_FLAG_NEXT;
+	while (ioctl(fd, MEDIA_IOC_ENUM_ENTITIES, &ent) == 0) {
+		if (!strcmp(ent.name, name)) {
+			*id = ent.id;
+			return 0;
+		}
+		ent.id |= MEDIA_ENT_ID_FLAG_NEXT;
+	}
+
+	fprintf(stderr, "媒体设备中没有实体 %s\n", name);
+	return -1;
+}
+
+static int media_setup_link(int fd, __u32 src, __u16 src_pad, __u32 sink, __u16 sink_pad, int enable)
+{
+	struct media_link_desc link;
+
+	memset(&link, 0, sizeof(link));
+	link.source.entity = src;
+	link.source.index = src_pad;
+	link.sink.entity = sink;
+	link.sink.index = sink_pad;
+	link.flags = enable ? MEDIA_LNK_FL_ENABLED : 0;
+	if (ioctl(fd, MEDIA_IOC_SETUP_LINK, &link) < 0) {
+		perror("设置链路失败");
+		return -1;
+	}
+
+	return 0;
+}
+
+// 切换 video 节点的输入：bypass 为1时接 CSI:1，否则接 ISP:1。video 同时只能有一条使能的输入，先断后连
+static int media_select_route(int fd, __u32 csi, __u32 isp, __u32 video, int bypass)
+{
+	if (media_setup_link(fd, bypass ? isp : csi, 1, video, 0, 0) < 0)
+		return -1;
+
+	return media_setup_link(fd, bypass ? csi : isp, 1, video, 0, 1);
+}
+
+static int run_route_test(void)
+{
+	static const char *const names[] = { "CSI -> ISP -> video", "CSI -> video" };
+	__u32 csi, isp, video;
+	int fps = target_fps > 0 ? target_fps : 30;
+	int ret = 0;
+	int fd, bypass;
+
+	fd = open(media_dev, O_RDWR);
+	if (fd < 0) {
+		perror("无法打开媒体设备");
+		return -1;
+	}
+
+	if (media_find_entity(fd, "my_csi_subdev", &csi) < 0 ||
+		media_find_entity(fd, "my_isp_subdev", &isp) < 0 ||
+		media_find_entity(fd, "my_video_device", &video) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	printf("%s，%ux%u@%d，每项持续 %d 秒\n", media_dev, req_width, req_height, fps, bench_seconds);
+	printf("%-22s %10s %8s %8s %10s %10s\n", "route", "achieved", "frames", "dropped", "sys_cpu%", "self_cpu%");
+
+	for (bypass = 0; bypass <= 1; bypass++) {
+		struct bench_cam cam;
+		struct rate_stats st;
+		struct cpu_snapshot a, b;
+		double achieved = 0.0;
+
+		if (media_select_route(fd, csi, isp, video, bypass) < 0) {
+			ret = -1;
+			break;
+		}
+
+		memset(&cam, 0, sizeof(cam));
+		cam.fd = -1;
+		cam.dev = camera_dev;
+		cam.width = req_width;
+		cam.height = req_height;
+		cam.fps = fps;
+		if (bench_cam_setup(&cam) < 0) {
+			ret = -1;
+			break;
+		}
+
+		cpu_snapshot_take(&a);
+		bench_cam_run(&cam, bench_seconds, &st);
+		cpu_snapshot_take(&b);
+		bench_cam_close(&cam);
+
+		if (st.frames > 1 && st.last_ts_ms > st.first_ts_ms)
+			achieved = (st.frames - 1) * 1000.0 / (st.last_ts_ms - st.first_ts_ms);
+
+		printf("%-22s %10.2f %8lu %8lu %10.1f %10.1f\n", names[bypass], achieved, st.frames, st.dropped,
+			   cpu_snapshot_sys_pct(&a, &b), cpu_snapshot_self_pct(&a, &b));
+	}
+
+	// 恢复默认通路
+	media_select_route(fd, csi, isp, video, 0);
+	close(fd);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	printf("用法: %s [-d 设备] [-W 宽] [-H 高] [-f 格式] [-r 帧率] [-n 帧数] [-q] [-b [-s 秒]] [-D [堆]] [-M] [-S] [-R [-m 媒体设备]] [-T] [-P] [-F] [-C 句柄数] [-E] [-Q] [-O] [-G] [-K]\n", prog);
+	printf("    -d  视频设备节点，默认 %s\n", CAMERA_DEV);
+	printf("    -W/-H  请求的分辨率，默认 %dx%d\n", WIDTH, HEIGHT);
+	printf("    -f  像素格式：yuyv（默认）、nv12、grey，多平面接口下还支持 nv12m\n");
+	printf("    -r  通过 VIDIOC_S_PARM 设置帧率（15~240）\n");
+	printf("    -n  采集指定帧数后停止，并输出实际帧率和抖动\n");
+	printf("    -q  不保存帧数据，不逐帧打印\n");
+	printf("    -b  分辨率基准测试（720p30/60、1080p30/60、4K30），每项持续 -s 秒（默认5秒）\n");
+	printf("    -D  DMABUF导入测试：从 /dev/dma_heap 分配缓冲区并导入驱动出流（-D 后可直接跟堆名，默认依次尝试 linux,cma、reserved、system）\n");
+	printf("    -M  多平面接口测试（驱动需以 multiplanar=1 加载），例如 -M -f nv12m\n");
+	printf("    -S  多路扩展性基准测试：1/2/4/8 路同时出流（分辨率取 -W/-H，帧率取 -r，默认30），每项持续 -s 秒\n");
+	printf("    -R  通路切换测试：分别经过ISP和旁路ISP出流，比较帧率和丢帧（分辨率取 -W/-H，帧率取 -r，默认30）\n");
+	printf("    -m  媒体设备节点，默认 %s\n", MEDIA_DEV);
+	printf("    -T  首帧延迟测试：反复启停出流，统计 STREAMON 到第一次 DQBUF 的耗时，轮数取 -n（默认20）\n");
+	printf("    -P  流控测试：模拟处理慢的用户程序，比较在 video 节点丢帧和在源头丢帧（分辨率取 -W/-H，帧率取 -r，默认30）\n");
+	printf("    -F  抽帧测试：frame_divider 分别取 1/2/6，检查送到用户的帧率（分辨率取 -W/-H，sensor 帧率取 -r，默认30）\n");
+	printf("    -C  共享出流测试（驱动需以 shared_stream=1 加载）：同一节点由1个、再由指定个数的句柄同时出流，比较每个句柄的帧率和丢帧\n");
+	printf("    -E  帧起始事件测试：订阅 FRAME_SYNC 事件，统计事件比对应缓冲区完成早多少（分辨率取 -W/-H，帧率取 -r），持续 -s 秒\n");
+	printf("    -Q  完成环基准测试：分别用 QBUF/DQBUF、完成环+poll、完成环+批量取帧出流，比较每帧系统调用次数和CPU占用（分辨率取 -W/-H，帧率取 -r，默认240）\n");
+	printf("    -O  输出 fence 测试：QBUF 时取得 fence，只等 fence 不阻塞在 DQBUF 上，与阻塞 DQBUF 比较消费者醒来的延迟（分辨率取 -W/-H，帧率取 -r），持续 -s 秒\n");
+	printf("    -G  像素扫描测试：按行、按列扫描一帧的耗时，比较驱动的 MMAP 缓冲区、USERPTR 交入的 4KB 页内存和 hugetlb 大页内存（驱动需以 hugepage_buffers=1 或 cached_buffers=1 加载，分辨率取 -W/-H，帧率取 -r，默认30）\n");
+	printf("    -K  cache 测试：比较 QBUF/DQBUF 同步、带 NO_CACHE_* 标志不同步、EXPBUF 后用 DMA_BUF_IOCTL_SYNC 同步时扫描一帧的耗时，驱动分别以默认和 cached_buffers=1 加载各跑一次（分辨率取 -W/-H，帧率取 -r，默认30）\n");
+	printf("例如，240fps 测试：%s -r 240 -n 2400 -q\n", prog);
+}
+
+int main(int argc, char *argv[]) {
     int fd;
     struct v4l2_capability cap;
     struct v4l2_format fmt;
@@ -31,17 +2144,112 @@ int main() {
     void *buffers[NUM_BUFFERS];
     __u32 i;
 	double frame_period_ms = 0.0;
+	struct rate_stats stats;
+	int opt;
+
+	int bench = 0;
+	int dmaheap = 0;
+	int mplane = 0;
+	int scaling = 0;
+	int route = 0;
+	int ttff = 0;
+	int backpressure = 0;
+	int divider = 0;
+	int shared = 0;
+	int frame_sync = 0;
+	int ring = 0;
+	int fence = 0;
+	int scan = 0;
+	int cache = 0;
+	const char *dmaheap_name = NULL;
+
+	while ((opt = getopt(argc, argv, "d:W:H:f:r:n:qbs:D::MSRm:TPFC:EQOGKh")) != -1) {
+		switch (opt) {
+		case 'd': camera_dev = optarg; break;
+		case 'W': req_width = atoi(optarg); break;
+		case 'H': req_height = atoi(optarg); break;
+		case 'f':
+			if (parse_pixfmt(optarg, &req_pixfmt)) {
+				fprintf(stderr, "不支持的像素格式: %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r': target_fps = atoi(optarg); break;
+		case 'n': max_frames = atol(optarg); break;
+		case 'q': quiet = 1; break;
+		case 'b': bench = 1; break;
+		case 's': bench_seconds = atoi(optarg); break;
+		case 'D': dmaheap = 1; dmaheap_name = optarg; break;
+		case 'M': mplane = 1; break;
+		case 'S': scaling = 1; break;
+		case 'R': route = 1; break;
+		case 'm': media_dev = optarg; break;
+		case 'T': ttff = 1; break;
+		case 'P': backpressure = 1; break;
+		case 'F': divider = 1; break;
+		case 'C': shared = atoi(optarg); break;
+		case 'E': frame_sync = 1; break;
+		case 'Q': ring = 1; break;
+		case 'O': fence = 1; break;
+		case 'G': scan = 1; break;
+		case 'K': cache = 1; break;
+		default: usage(argv[0]); return opt == 'h' ? 0 : -1;
+		}
+	}
+	memset(&stats, 0, sizeof(stats));
+
+	if (bench)
+		return run_resolution_benchmark();
+
+	if (dmaheap)
+		return run_dmaheap_test(dmaheap_name);
+
+	if (mplane)
+		return run_mplane_test();
+
+	if (scaling)
+		return run_scaling_benchmark();
+
+	if (route)
+		return run_route_test();
+
+	if (ttff)
+		return run_ttff_benchmark();
+
+	if (backpressure)
+		return run_backpressure_test();
+
+	if (divider)
+		return run_divider_test();
+
+	if (shared)
+		return run_shared_test(shared);
+
+	if (frame_sync)
+		return run_frame_sync_test();
+
+	if (ring)
+		return run_ring_benchmark();
+
+	if (fence)
+		return run_fence_test();
+
+	if (scan)
+		return run_scan_test();
+
+	if (cache)
+		return run_cache_scan_test();
 	
 	// 注册信号处理函数以捕获 Ctrl+C
     signal(SIGINT, handle_sigint);
 
     // 打开设备
-    fd = open(CAMERA_DEV, O_RDWR);
+    fd = open(camera_dev, O_RDWR);
     if (fd < 0) {
         perror("无法打开设备");
         return -1;
     }
-	printf("\nOpen %s successfully\n\n", CAMERA_DEV);
+	printf("\nOpen %s successfully\n\n", camera_dev);
 
     // 查询设备能力
     if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
@@ -69,16 +2277,35 @@ int main() {
     // 设置视频格式
     memset(&fmt, 0, sizeof(fmt));
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width = WIDTH;
-    fmt.fmt.pix.height = HEIGHT;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV; // YUYV 格式
+    fmt.fmt.pix.width = req_width;
+    fmt.fmt.pix.height = req_height;
+    fmt.fmt.pix.pixelformat = req_pixfmt;
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
     if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
         perror("设置视频格式失败");
         close(fd);
         return -1;
     }
-	printf("VIDIOC_S_FMT successfully\n\n");
+	printf("VIDIOC_S_FMT successfully: %ux%u, format=%.4s, bytesperline=%u, sizeimage=%u\n\n",
+		   fmt.fmt.pix.width, fmt.fmt.pix.height, (char *)&fmt.fmt.pix.pixelformat,
+		   fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage);
+
+	// 设置帧率
+	if (target_fps > 0) {
+		struct v4l2_streamparm parm;
+
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = target_fps;
+		if (ioctl(fd, VIDIOC_S_PARM, &parm) < 0) {
+			perror("设置帧率失败");
+			close(fd);
+			return -1;
+		}
+		printf("VIDIOC_S_PARM successfully: %u/%u\n\n",
+			   parm.parm.capture.timeperframe.denominator, parm.parm.capture.timeperframe.numerator);
+	}
 
     // 请求缓冲区
     memset(&req, 0, sizeof(req));
@@ -159,18 +2386,25 @@ dequeue_buf:
 	}
 	last_frame_ts.tv_sec = curr_frame_ts.tv_sec;
 	last_frame_ts.tv_nsec = curr_frame_ts.tv_nsec;
-	printf("VIDIOC_DQBUF: frame_period=%.3fms\n", frame_period_ms);
+	rate_stats_update(&stats, &buf);
 
-	save_to_yuv(buffers[buf.index], buf.length);
+	if (!quiet) {
+		printf("VIDIOC_DQBUF: frame_period=%.3fms\n", frame_period_ms);
+		save_to_yuv(buffers[buf.index], buf.bytesused);
+	}
 	
 	if (ioctl(fd, VIDIOC_QBUF, &buf) < 0) {
 		perror("入队缓冲区失败");
 		close(fd);
 		return -1;
 	}
-	printf("VIDIOC_QBUF\n\n");
+	if (!quiet)
+		printf("VIDIOC_QBUF\n\n");
 	
-	goto dequeue_buf;
+	if (max_frames < 0 || (long)stats.frames < max_frames)
+		goto dequeue_buf;
+
+	rate_stats_print(&stats);
 
     // 停止视频流
     if (ioctl(fd, VIDIOC_STREAMOFF, &type) < 0) {